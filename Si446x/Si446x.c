@@ -9,7 +9,7 @@
 #ifdef ARDUINO
 #include <Arduino.h>
 #include <SPI.h>
-#else
+#elif defined(__AVR__)
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
@@ -23,6 +23,9 @@
 #include "Si446x.h"
 #include "Si446x_config.h"
 #include "Si446x_defs.h"
+#if !defined(ARDUINO) && SI446X_HAL != SI446X_HAL_AVR
+#include "Si446x_hal.h"
+#endif
 
 #include "radio_config.h"
 
@@ -32,6 +35,9 @@
 // The first byte is used for length, then the remaining 128 bytes for the packet data
 #define MAX_PACKET_LEN			SI446X_MAX_PACKET_LEN
 
+// PLL settle time in us for TX_HOP, the PA is turned off while the synth retunes
+#define TX_HOP_SETTLE			50
+
 #define IRQ_PACKET				0
 #define IRQ_MODEM				1
 #define IRQ_CHIP				2
@@ -41,29 +47,276 @@
 #if SI446X_INTERRUPTS != 0
 	#if defined(ARDUINO) && SI446X_IRQ == -1
 		#error "SI446X_INTERRUPTS is 1, but SI446X_IRQ is set to -1!"
-	#elif !defined(ARDUINO) && !defined(IRQ_BIT)
+	#elif !defined(ARDUINO) && SI446X_HAL == SI446X_HAL_AVR && !defined(IRQ_BIT)
 		#error "SI446X_INTERRUPTS is 1, but SI446X_IRQ_PORT or SI446X_IRQ_BIT has not been set!"
 	#endif
 #endif
 
+// Hot path counters, these compile to nothing if SI446X_STATS is off
+#if SI446X_STATS
+#define STAT_ADD(field, n)		(statCounters.field += (n))
+#else
+#define STAT_ADD(field, n)		((void)0)
+#endif
+
+// Event trace, these also compile to nothing if SI446X_TRACE is off
+// TRACE_CB() records when a callback starts and finishes, so time spent in user code shows up
+#if SI446X_TRACE
+#define TRACE(event, arg, data)	traceAdd((event), (arg), (data))
+#define TRACE_CB(cb, call)		do { traceAdd(SI446X_TRACE_CB, (cb), 0); call; traceAdd(SI446X_TRACE_CB_END, (cb), 0); } while(0)
+#else
+#define TRACE(event, arg, data)	((void)0)
+#define TRACE_CB(cb, call)		call
+#endif
+
 #ifdef ARDUINO
 #define	delay_ms(ms)			delay(ms)
 #define delay_us(us)			delayMicroseconds(us)
 #define spiSelect()				(digitalWrite(SI446X_CSN, LOW))
 #define spiDeselect()			(digitalWrite(SI446X_CSN, HIGH))
-#define spi_transfer_nr(data)	(SPI.transfer(data))
-#define spi_transfer(data)		(SPI.transfer(data))
+#define spi_transfer_nr(data)	(STAT_ADD(spiBytes, 1), SPI.transfer(data))
+#define spi_transfer(data)		(STAT_ADD(spiBytes, 1), SPI.transfer(data))
+#define spi_transfer_block(out, in, len)	spiTransferBlock(out, in, len)
+#elif SI446X_HAL != SI446X_HAL_AVR
+#define	delay_ms(ms)			si446x_hal_delay_us((ms) * 1000UL)
+#define delay_us(us)			si446x_hal_delay_us(us)
+#define spiSelect()				si446x_hal_select()
+#define spiDeselect()			si446x_hal_deselect()
+#define spi_transfer_nr(data)	(STAT_ADD(spiBytes, 1), (void)si446x_hal_transfer(data))
+#define spi_transfer(data)		(STAT_ADD(spiBytes, 1), si446x_hal_transfer(data))
+#define spi_transfer_block(out, in, len)	(STAT_ADD(spiBytes, len), si446x_hal_transferBlock(out, in, len))
+#define PROGMEM
+#define memcpy_P(dst, src, len)	memcpy(dst, src, len)
+#define pgm_read_byte(addr)		(*(const uint8_t*)(addr))
 #else
 #define	delay_ms(ms)			_delay_ms(ms)
 #define delay_us(us)			_delay_us(us)
 #define spiSelect()				(CSN_PORT &= ~_BV(CSN_BIT))
 #define spiDeselect()			(CSN_PORT |= _BV(CSN_BIT))
+#if SI446X_STATS
+// The inline functions from Si446x_spi.h are called from inside these, a macro doesn't expand itself
+#define spi_transfer_nr(data)	(STAT_ADD(spiBytes, 1), spi_transfer_nr(data))
+#define spi_transfer(data)		(STAT_ADD(spiBytes, 1), spi_transfer(data))
+#define spi_transfer_block(out, in, len)	(STAT_ADD(spiBytes, len), spi_transfer_block(out, in, len))
+#endif
 #endif
 
 static const uint8_t config[] PROGMEM = RADIO_CONFIGURATION_DATA_ARRAY;
 
+#if SI446X_STATS
+static si446x_stats_t statCounters;
+static uint8_t statOpcode; // Last command sent, CTS polls are counted against it
+#endif
+
+#if SI446X_TRACE
+#if SI446X_TRACE < 2 || SI446X_TRACE > 128 || (SI446X_TRACE & (SI446X_TRACE - 1))
+	#error "SI446X_TRACE must be a power of 2 between 2 and 128"
+#endif
+
+// traceHead counts up forever (wrapping at 256) like the RX queue, the newest record is at traceHead - 1
+static si446x_trace_t traceRing[SI446X_TRACE];
+static uint8_t traceHead;
+static uint8_t traceCount; // Records in the ring, stops at SI446X_TRACE
+#endif
+
 static volatile uint8_t enabledInterrupts[3];
 
+static uint8_t txLoaded; // TX FIFO has a packet that can be sent with Si446x_fire() or Si446x_retransmit()
+static uint8_t txSent; // Loaded packet has been sent at least once, so RETRANSMIT can be used
+#if !SI446X_FIXED_LENGTH
+static uint8_t txLength; // Length of the loaded packet
+#endif
+#if SI446X_STREAM
+#if SI446X_FIXED_LENGTH
+	#error "SI446X_STREAM doesn't work with SI446X_FIXED_LENGTH"
+#endif
+static const uint8_t* txStreamData; // Rest of the packet that still needs to go into the FIFO
+static uint16_t txStreamLeft;
+static uint8_t* rxStreamBuff; // NULL if not streaming
+static uint16_t rxStreamSize;
+static uint16_t rxStreamLen;
+static uint8_t rxStreamSkip; // Length field bytes that still need to be thrown away
+static uint8_t streamLength; // PKT_FIELD_2_LENGTH is something other than MAX_PACKET_LEN
+#endif
+
+#if SI446X_RX_POOL
+static si446x_packet_t pool[SI446X_RX_POOL];
+static volatile uint8_t poolUsed[SI446X_RX_POOL];
+#endif
+
+#if SI446X_RX_QUEUE
+#if SI446X_RX_POOL
+	#error "SI446X_RX_QUEUE and SI446X_RX_POOL can't both be used"
+#endif
+#if SI446X_RX_QUEUE > 128 || (SI446X_RX_QUEUE & (SI446X_RX_QUEUE - 1))
+	#error "SI446X_RX_QUEUE must be a power of 2 and no more than 128"
+#endif
+
+// The ISR only writes queueHead and the main loop only writes queueTail
+// They count up forever (wrapping at 256), the difference is the number of packets in the queue
+static si446x_packet_t queue[SI446X_RX_QUEUE];
+static volatile uint8_t queueHead;
+static volatile uint8_t queueTail;
+static volatile uint8_t queueHighWater;
+static volatile uint16_t queueDropped;
+
+// Make sure the packet has been written/read before the index that hands it over changes
+#ifdef __AVR__
+#define queueBarrier()	__asm__ __volatile__("" ::: "memory")
+#else
+#define queueBarrier()	__sync_synchronize()
+#endif
+#endif
+
+#if SI446X_TX_QUEUE
+#if SI446X_TX_QUEUE > 128 || (SI446X_TX_QUEUE & (SI446X_TX_QUEUE - 1))
+	#error "SI446X_TX_QUEUE must be a power of 2 and no more than 128"
+#endif
+
+typedef struct {
+	const void* packet;
+	uint8_t len;
+	uint8_t channel;
+	uint8_t onTxFinish;
+} txQueueItem_t;
+
+// Only changed with interrupts off or from the ISR
+static txQueueItem_t txQueue[SI446X_TX_QUEUE];
+static uint8_t txQueueHead; // Where the next packet goes
+static uint8_t txQueueTail; // Packet being sent
+static uint8_t txQueueActive; // Packet at txQueueTail is on the air
+static uint8_t txQueueNext; // Packet after that one is already in the FIFO
+static uint8_t txQueueFinish; // State the radio goes into once the current packet has been sent
+
+#define txQueueCount()	((uint8_t)(txQueueHead - txQueueTail))
+#endif
+
+#if SI446X_MAC
+#if SI446X_FIXED_LENGTH || SI446X_RX_POOL || SI446X_RX_QUEUE
+	#error "SI446X_MAC can't be used with SI446X_FIXED_LENGTH, SI446X_RX_POOL or SI446X_RX_QUEUE"
+#endif
+
+// MAC header
+#define MAC_DST			0
+#define MAC_SRC			1
+#define MAC_CTRL		2
+#define MAC_SEQ			3
+
+#define MAC_CTRL_ACK	0x01 // This is an ACK
+#define MAC_CTRL_ACKREQ	0x02 // Sender wants an ACK
+
+typedef struct {
+	uint8_t addr;
+	uint8_t seq;
+} macPeer_t;
+
+static uint8_t macOn;
+static uint8_t macAddr;
+static uint8_t macChannel;
+static uint8_t macSeq;
+static uint8_t macTx[MAX_PACKET_LEN]; // Packet to send again if the ACK doesn't arrive
+static uint8_t macTxLen;
+static uint8_t macRx[MAX_PACKET_LEN];
+static volatile uint8_t macWaiting; // Waiting for an ACK
+static uint8_t macTries;
+static uint32_t macSentAt;
+static uint32_t macWait;
+static macPeer_t macPeers[SI446X_MAC_PEERS]; // Last sequence number from each peer
+static uint8_t macPeerNext;
+#endif
+
+#if SI446X_LINK_STATS
+#if !SI446X_MAC
+	#error "SI446X_LINK_STATS needs SI446X_MAC"
+#endif
+
+// Bigger jumps in sequence number are taken as the peer restarting instead of lost packets
+#define LINK_MAX_GAP	64
+
+// Only changed from the ISR or with interrupts off
+static si446x_link_t linkPeers[SI446X_LINK_PEERS];
+static uint8_t linkPeerNext;
+static uint16_t linkCRCErrors; // Can't tell who sent a corrupted packet
+#endif
+
+#if SI446X_MAC || SI446X_CCA
+static uint8_t randState = 1; // For backoff times
+#endif
+
+#if SI446X_CCA
+static uint8_t channelBusy; // Last Si446x_TX() gave up because the channel was busy
+#endif
+
+#if SI446X_SCAN
+static uint16_t scanSweeps; // Sweeps done since the last Si446x_scanRate()
+static uint8_t scanActive; // A sweep is using the radio
+static uint32_t scanSince; // When Si446x_scanRate() was last called
+#endif
+
+#if SI446X_WATERFALL && !SI446X_SCAN
+	#error "SI446X_WATERFALL needs SI446X_SCAN"
+#endif
+
+static uint8_t currentChannel; // Channel used for the last RX, TX or hop
+#if SI446X_HOP
+static uint8_t rxHopping; // Automatic RX hopping is on, the channel needs to be read when a packet arrives
+#endif
+
+#if SI446X_GPIO_CTS != -1
+static uint8_t ctsPinReady; // The radio GPIO has been setup as CTS
+#endif
+
+#if SI446X_FAST_TX
+static uint8_t fifoDirty; // Something might have been received into the FIFO since it was last cleared
+static uint8_t ldcRx; // WUT low duty cycle RX is on, the radio can go into RX by itself at any time
+#if !SI446X_FIXED_LENGTH
+static uint8_t pktLength; // Current PKT_FIELD_2_LENGTH_LOW value, 0 if not known
+#endif
+#endif
+
+#if SI446X_PROP_CACHE
+// Properties to keep a copy of; group, first property, count
+static const uint8_t cacheRanges[] PROGMEM = {
+	SI446X_PROP_GROUP_GLOBAL,	0x00, 0x0A,
+	SI446X_PROP_GROUP_INT,		0x00, 0x04,
+	SI446X_PROP_GROUP_FRR,		0x00, 0x04,
+	SI446X_PROP_GROUP_PKT,		0x12, 0x01, // PKT_FIELD_2_LENGTH_LOW
+	SI446X_PROP_GROUP_PA,		0x01, 0x01 // PA_PWR_LVL
+};
+#define CACHE_SIZE	(0x0A + 0x04 + 0x04 + 0x01 + 0x01)
+
+static uint8_t cache[CACHE_SIZE];
+static uint8_t cacheValid[(CACHE_SIZE + 7) / 8]; // Bit for each cached property, set if the value is known
+#endif
+
+#if SI446X_PROP_BATCH == 1
+	#error "SI446X_PROP_BATCH must be 0 or at least 2, there's nothing to merge with only 1"
+#endif
+
+#if SI446X_PROP_BATCH
+// Largest gap between properties that will be filled with cached values to put them in the same command
+// A separate command costs 4 more bytes and a CTS wait
+#define PROP_MAX_GAP	4
+
+// Property writes waiting for Si446x_commitProperties(), sorted by property
+static uint16_t batchProp[SI446X_PROP_BATCH];
+static uint8_t batchValue[SI446X_PROP_BATCH];
+static uint8_t batchCount;
+static uint8_t batchDepth; // Nested begins
+#endif
+
+#if SI446X_ASYNC
+static si446x_cmd_t* cmdHead; // Command being processed or next to send
+static si446x_cmd_t* cmdTail;
+static uint8_t cmdCount;
+static uint8_t cmdSent; // Head command has been sent to the radio
+static uint8_t cmdFinished; // The ISR has read the head command's response (SI446X_ASYNC_DONE or SI446X_ASYNC_TIMEOUT), its callback is left for Si446x_poll()
+#endif
+
+#if SI446X_ASYNC || SI446X_PROP_BATCH
+static uint8_t inISR; // isrRun() is running
+#endif
+
 // http://stackoverflow.com/questions/10802324/aliasing-a-function-on-a-c-interface-within-a-c-application-on-linux
 #if defined(__cplusplus)
 extern "C" {
@@ -81,6 +334,40 @@ void __attribute__((weak, alias ("__empty_callback1"))) SI446X_CB_RXINVALID(int1
 void __attribute__((weak, alias ("__empty_callback0"))) SI446X_CB_SENT(void);
 void __attribute__((weak, alias ("__empty_callback0"))) SI446X_CB_WUT(void);
 void __attribute__((weak, alias ("__empty_callback0"))) SI446X_CB_LOWBATT(void);
+#if SI446X_HOP
+void __attribute__((weak)) SI446X_CB_RXCHANNEL(uint8_t channel){(void)(channel);}
+#endif
+#if SI446X_RX_POOL
+void __attribute__((weak)) SI446X_CB_RXPACKET(si446x_packet_t* packet){Si446x_release(packet);}
+#endif
+#if SI446X_MAC
+void __attribute__((weak)) SI446X_CB_MACRX(uint8_t from, uint8_t* data, uint8_t len, int16_t rssi){(void)(from);(void)(data);(void)(len);(void)(rssi);}
+void __attribute__((weak)) SI446X_CB_MACSENT(uint8_t to, uint8_t ok){(void)(to);(void)(ok);}
+#endif
+#if SI446X_RX_POOL || SI446X_RX_QUEUE || SI446X_MAC || SI446X_SCAN
+uint32_t SI446X_CB_TIMESTAMP(void);
+#ifdef ARDUINO
+uint32_t __attribute__((weak)) SI446X_CB_TIMESTAMP(void){return millis();}
+#endif
+// No default on other platforms, the MAC would never time out with a clock that doesn't move, so not providing one is a link error
+#endif
+#if SI446X_TRACE
+#ifdef ARDUINO
+uint32_t __attribute__((weak)) SI446X_CB_TRACETIME(void){return micros();}
+#else
+uint32_t __attribute__((weak)) SI446X_CB_TRACETIME(void){return 0;}
+#endif
+#endif
+#if SI446X_WATERFALL
+void __attribute__((weak)) SI446X_CB_WATERFALL(const uint8_t* data, uint8_t len){(void)(data);(void)(len);}
+#endif
+#if SI446X_STREAM
+void __attribute__((weak)) SI446X_CB_RXSTREAM(uint16_t length, int16_t rssi){(void)(length);(void)(rssi);}
+#endif
+#if SI446X_IRCAL_CACHE
+uint8_t __attribute__((weak)) SI446X_CB_IRCAL_LOAD(si446x_ircal_t* cal){(void)(cal); return 0;}
+void __attribute__((weak)) SI446X_CB_IRCAL_SAVE(si446x_ircal_t* cal){(void)(cal);}
+#endif
 #if SI446X_ENABLE_ADDRMATCHING
 void __attribute__((weak, alias ("__empty_callback0"))) SI446X_CB_ADDRMATCH(void);
 void __attribute__((weak, alias ("__empty_callback0"))) SI446X_CB_ADDRMISS(void);
@@ -130,6 +417,7 @@ static inline uint8_t interrupt_on(void)
 static inline uint8_t cselect(void)
 {
 //	spi_enable();
+	STAT_ADD(selects, 1);
 	spiSelect();
 	return 1;
 }
@@ -143,6 +431,27 @@ static inline uint8_t cdeselect(void)
 
 #define CHIPSELECT()	for(uint8_t _cs = cselect(); _cs; _cs = cdeselect())
 
+#ifdef ARDUINO
+// Arduino's block transfer overwrites the buffer with what's received, so it can only be used for reads
+static void spiTransferBlock(const void* out, void* in, uint8_t len)
+{
+	if(in != NULL)
+	{
+		if(out != NULL)
+			memcpy(in, out, len);
+		else
+			memset(in, 0xFF, len);
+		STAT_ADD(spiBytes, len);
+		SPI.transfer(in, len);
+	}
+	else
+	{
+		for(uint8_t i=0;i<len;i++)
+			spi_transfer_nr(((const uint8_t*)out)[i]);
+	}
+}
+#endif
+
 // TODO
 // 2 types of interrupt blocks
 // Local (SI446X_NO_INTERRUPT()): Disables the pin interrupt so the ISR does not run while normal code is busy in the Si446x code, however another interrupt can enter the code which would be bad.
@@ -155,6 +464,8 @@ static inline uint8_t cdeselect(void)
 #define SI446X_ATOMIC() ((void)(0));
 #elif defined(ARDUINO)
 #define SI446X_ATOMIC() for(uint8_t _cs2 = interrupt_off(); _cs2; _cs2 = interrupt_on())
+#elif SI446X_HAL != SI446X_HAL_AVR
+#define SI446X_ATOMIC() ((void)(0)); // Si446x_SERVICE() is kept out by si446x_hal_lock() instead
 #else
 #define SI446X_ATOMIC()	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 #endif
@@ -168,6 +479,9 @@ uint8_t Si446x_irq_off()
 	detachInterrupt(digitalPinToInterrupt(SI446X_IRQ));
 	isrState_local++;
 	return 0;
+#elif SI446X_HAL != SI446X_HAL_AVR
+	si446x_hal_lock();
+	return 1;
 #else
 	uint8_t origVal = SI446X_REG_EXTERNAL_INT;
 	SI446X_REG_EXTERNAL_INT &= ~_BV(SI446X_BIT_EXTERNAL_INT);
@@ -191,6 +505,9 @@ void Si446x_irq_on(uint8_t origVal)
 		isrState_local--;
 	if(isrState_local == 0)
 		attachInterrupt(digitalPinToInterrupt(SI446X_IRQ), Si446x_SERVICE, FALLING);
+#elif SI446X_HAL != SI446X_HAL_AVR
+	if(origVal)
+		si446x_hal_unlock();
 #else
 	if(origVal)// == 2) TODO
 		SI446X_REG_EXTERNAL_INT |= _BV(SI446X_BIT_EXTERNAL_INT);
@@ -201,6 +518,32 @@ void Si446x_irq_on(uint8_t origVal)
 #endif
 }
 
+#if SI446X_TRACE
+// Add a record to the trace ring, overwriting the oldest one once it's full
+static void traceAdd(uint8_t event, uint8_t arg, uint16_t data)
+{
+	uint32_t time = SI446X_CB_TRACETIME();
+
+#if !defined(ARDUINO) && SI446X_HAL != SI446X_HAL_AVR
+	// Si446x_SERVICE() might be adding records from another thread
+	si446x_hal_lock();
+#endif
+	SI446X_ATOMIC()
+	{
+		si446x_trace_t* rec = &traceRing[traceHead++ & (SI446X_TRACE - 1)];
+		rec->time = time;
+		rec->event = event;
+		rec->arg = arg;
+		rec->data = data;
+		if(traceCount < SI446X_TRACE)
+			traceCount++;
+	}
+#if !defined(ARDUINO) && SI446X_HAL != SI446X_HAL_AVR
+	si446x_hal_unlock();
+#endif
+}
+#endif
+
 // Read CTS and if its ok then read the command buffer
 static uint8_t getResponse(void* buff, uint8_t len)
 {
@@ -216,143 +559,605 @@ static uint8_t getResponse(void* buff, uint8_t len)
 			// Get CTS value
 			cts = (spi_transfer(0xFF) == 0xFF);
 
+			// Get response data
 			if(cts)
-			{
-				// Get response data
-				for(uint8_t i=0;i<len;i++)
-					((uint8_t*)buff)[i] = spi_transfer(0xFF);
-			}
+				spi_transfer_block(NULL, buff, len);
 		}
 	}
 	return cts;
 }
 
+#if SI446X_GPIO_CTS != -1
+// Read the CTS pin
+static inline uint8_t ctsPin(void)
+{
+#ifdef ARDUINO
+	return (digitalRead(SI446X_CTS) == HIGH);
+#elif SI446X_HAL != SI446X_HAL_AVR
+	return si446x_hal_cts();
+#else
+	return !!(CTS_PIN & _BV(CTS_BIT));
+#endif
+}
+#endif
+
+#if SI446X_STATS
+// Count a CTS wait against the command the radio is busy with
+static void statWait(uint32_t polls)
+{
+	if(!polls)
+		return;
+
+	uint8_t idx = statOpcode;
+	if(idx >= SI446X_STATS_OPCODES)
+		idx = SI446X_STATS_OPCODES - 1;
+	statCounters.ctsPolls[idx] += polls;
+
+	if(polls > statCounters.ctsMaxWait)
+	{
+		statCounters.ctsMaxWait = (polls > 0xFFFF) ? 0xFFFF : polls;
+		statCounters.ctsMaxOpcode = statOpcode;
+	}
+}
+#define STAT_WAIT(polls)	statWait(polls)
+#else
+#define STAT_WAIT(polls)	((void)(polls))
+#endif
+
 // Keep trying to read the command buffer, with timeout of around 500ms
 static uint8_t waitForResponse(void* out, uint8_t outLen, uint8_t useTimeout)
 {
+#if SI446X_GPIO_CTS != -1
+	if(ctsPinReady)
+	{
+		// Watch the pin instead of the SPI bus, then only read the command buffer if there's a response to get
+		uint32_t timeout = 400000;
+		uint32_t polls = 0;
+		while(!ctsPin())
+		{
+			delay_us(1);
+			polls++;
+			if(useTimeout && !--timeout)
+			{
+				STAT_ADD(timeouts, 1);
+				STAT_WAIT(polls);
+				TRACE_CB(SI446X_TRACE_CB_CMDTIMEOUT, SI446X_CB_CMDTIMEOUT());
+				return 0;
+			}
+		}
+		STAT_WAIT(polls);
+
+		if(out == NULL || getResponse(out, outLen))
+			return 1;
+
+		// Pin said ready but the radio didn't, carry on polling below
+	}
+#endif
+
 	// With F_CPU at 8MHz and SPI at 4MHz each check takes about 7us + 10us delay
 	uint16_t timeout = 40000;
+	uint32_t polls = 0;
 	while(!getResponse(out, outLen))
 	{
 		delay_us(10);
+		polls++;
 		if(useTimeout && !--timeout)
 		{
-			SI446X_CB_CMDTIMEOUT();
+			STAT_ADD(timeouts, 1);
+			STAT_WAIT(polls);
+			TRACE_CB(SI446X_TRACE_CB_CMDTIMEOUT, SI446X_CB_CMDTIMEOUT());
 			return 0;
 		}
 	}
+	STAT_WAIT(polls);
 	return 1;
 }
 
-static void doAPI(void* data, uint8_t len, void* out, uint8_t outLen)
+// Send a command, CTS must have already been checked
+static void sendCommand(const void* data, uint8_t len)
 {
-	SI446X_NO_INTERRUPT()
+#if SI446X_STATS
+	statOpcode = ((const uint8_t*)data)[0];
+#endif
+	SI446X_ATOMIC()
 	{
-		if(waitForResponse(NULL, 0, 1)) // Make sure it's ok to send a command
+		CHIPSELECT()
 		{
-			SI446X_ATOMIC()
-			{
-				CHIPSELECT()
-				{
-					for(uint8_t i=0;i<len;i++)
-						spi_transfer_nr(((uint8_t*)data)[i]); // (pgm_read_byte(&((uint8_t*)data)[i]));
-				}
-			}
+			spi_transfer_block(data, NULL, len);
+		}
+	}
+}
 
-			if(((uint8_t*)data)[0] == SI446X_CMD_IRCAL) // If we're doing an IRCAL then wait for its completion without a timeout since it can sometimes take a few seconds
-				waitForResponse(NULL, 0, 0);
-			else if(out != NULL) // If we have an output buffer then read command response into it
-				waitForResponse(out, outLen, 1);
+#if SI446X_ASYNC
+// Like waitForResponse(), but only checks once
+static uint8_t checkResponse(void* out, uint8_t outLen)
+{
+#if SI446X_GPIO_CTS != -1
+	if(ctsPinReady)
+	{
+		if(!ctsPin())
+		{
+			STAT_WAIT(1);
+			return 0;
 		}
+		if(out == NULL)
+			return 1;
+	}
+#endif
+	if(!getResponse(out, outLen))
+	{
+		STAT_WAIT(1);
+		return 0;
 	}
+	return 1;
 }
 
-// Configure a bunch of properties (up to 12 properties in one go)
-static void setProperties(uint16_t prop, void* values, uint8_t len)
+// Remove the head command from the queue and let the caller know
+static void asyncDone(si446x_cmd_t* cmd, si446x_async_t status)
 {
-	// len must not be greater than 12
+	SI446X_ATOMIC()
+	{
+		cmdHead = cmd->next;
+		if(cmdHead == NULL)
+			cmdTail = NULL;
+		cmdCount--;
+	}
+	cmdSent = 0;
+	cmdFinished = 0;
+	cmd->next = NULL;
+	cmd->status = status;
+	if(cmd->callback != NULL)
+		cmd->callback(cmd);
+}
 
-	uint8_t data[16] = {
-		SI446X_CMD_SET_PROPERTY,
-		(uint8_t)(prop>>8),
-		len,
-		(uint8_t)prop
-	};
+// Send the head command if the radio is ready, or finish it off if it's been sent
+// Returns 1 if a command finished and the next one can be looked at
+static uint8_t asyncStep(void)
+{
+	si446x_cmd_t* cmd = cmdHead;
+	if(cmd == NULL)
+		return 0;
+
+	if(cmdFinished)
+	{
+		asyncDone(cmd, (si446x_async_t)cmdFinished);
+		return 1;
+	}
+
+	if(!cmdSent)
+	{
+		// Radio will be busy for a bit after this, so don't bother checking again straight away
+		if(checkResponse(NULL, 0))
+		{
+			sendCommand(cmd->data, cmd->len);
+			cmdSent = 1;
+			cmd->status = SI446X_ASYNC_SENT;
+		}
+		return 0;
+	}
 
-	// Copy values into data, starting at index 4
-	memcpy(data + 4, values, len);
+	if(!checkResponse(cmd->out, cmd->outLen))
+		return 0;
 
-	doAPI(data, len + 4, NULL, 0);
+	asyncDone(cmd, SI446X_ASYNC_DONE);
+	return 1;
 }
 
-// Set a single property
-static inline void setProperty(uint16_t prop, uint8_t value)
+// Finish off everything in the queue, waiting for each command like doAPI() does
+static void asyncFlush(void)
 {
-	setProperties(prop, &value, 1);
+	si446x_cmd_t* cmd;
+	while((cmd = cmdHead) != NULL)
+	{
+		uint8_t ok = 1;
+		if(cmdFinished)
+			ok = (cmdFinished == SI446X_ASYNC_DONE);
+		else
+		{
+			if(!cmdSent)
+			{
+				ok = waitForResponse(NULL, 0, 1);
+				if(ok)
+					sendCommand(cmd->data, cmd->len);
+			}
+			if(ok)
+				ok = waitForResponse(cmd->out, cmd->outLen, cmd->data[0] != SI446X_CMD_IRCAL);
+		}
+		asyncDone(cmd, ok ? SI446X_ASYNC_DONE : SI446X_ASYNC_TIMEOUT);
+	}
 }
-/*
-// Set a 16bit property
-static void setProperty16(uint16_t prop, uint16_t value)
+
+// The ISR can't send anything until the radio has finished the command that's been sent, so read its response now (with a timeout, even for IRCAL)
+// Callbacks are left for Si446x_poll() and commands that haven't been sent yet stay queued
+static void asyncSettle(void)
 {
-	uint8_t properties[] = {value>>8, value};
-	setProperties(prop, properties, sizeof(properties));
+	si446x_cmd_t* cmd = cmdHead;
+	if(cmd == NULL || !cmdSent || cmdFinished)
+		return;
+	cmdFinished = waitForResponse(cmd->out, cmd->outLen, 1) ? SI446X_ASYNC_DONE : SI446X_ASYNC_TIMEOUT;
 }
-*/
-// Read a bunch of properties
-static void getProperties(uint16_t prop, void* values, uint8_t len)
+#endif
+
+// Returns 0 if the radio didn't respond in time
+static uint8_t doAPI(void* data, uint8_t len, void* out, uint8_t outLen)
 {
-	uint8_t data[] = {
-		SI446X_CMD_GET_PROPERTY,
-		(uint8_t)(prop>>8),
-		len,
-		(uint8_t)prop
-	};
+	uint8_t ok = 0;
+	SI446X_NO_INTERRUPT()
+	{
+#if SI446X_ASYNC
+		// Queued commands go first so responses don't get mixed up
+		if(inISR)
+			asyncSettle();
+		else
+			asyncFlush();
+#endif
+
+		TRACE(SI446X_TRACE_API, ((uint8_t*)data)[0], len);
+
+		ok = waitForResponse(NULL, 0, 1);
+		if(ok) // Make sure it's ok to send a command
+		{
+			sendCommand(data, len);
+
+			if(((uint8_t*)data)[0] == SI446X_CMD_IRCAL) // If we're doing an IRCAL then wait for its completion without a timeout since it can sometimes take a few seconds
+				ok = waitForResponse(NULL, 0, 0);
+			else if(out != NULL) // If we have an output buffer then read command response into it
+				ok = waitForResponse(out, outLen, 1);
+		}
 
-	doAPI(data, sizeof(data), values, len);
+		TRACE(SI446X_TRACE_API_END, ((uint8_t*)data)[0], ok);
+	}
+	return ok;
 }
 
-// Read a single property
-static inline uint8_t getProperty(uint16_t prop)
+#if SI446X_PROP_CACHE
+// Find where a property is in the cache, returns -1 if it isn't cached
+static int8_t cacheIndex(uint16_t prop)
 {
-	uint8_t val;
-	getProperties(prop, &val, 1);
-	return val;
+	uint8_t offset = 0;
+	for(uint8_t i=0;i<sizeof(cacheRanges);i+=3)
+	{
+		uint8_t range[3];
+		memcpy_P(range, &cacheRanges[i], sizeof(range));
+
+		uint8_t index = (uint8_t)prop;
+		if(range[0] == (prop>>8) && index >= range[1] && index < range[1] + range[2])
+			return offset + (index - range[1]);
+		offset += range[2];
+	}
+	return -1;
 }
 
-// Do an ADC conversion
-static uint16_t getADC(uint8_t adc_en, uint8_t adc_cfg, uint8_t part)
+// See if a property is known to already have a value
+static uint8_t cacheSame(uint16_t prop, uint8_t value)
 {
-	uint8_t data[6] = {
-		SI446X_CMD_GET_ADC_READING,
-		adc_en,
-		adc_cfg
-	};
-	doAPI(data, 3, data, 6);
-	return (data[part]<<8 | data[part + 1]);
+	int8_t idx = cacheIndex(prop);
+	return (idx != -1 && (cacheValid[idx / 8] & _BV(idx % 8)) && cache[(uint8_t)idx] == value);
 }
 
-// Read a fast response register
-static uint8_t getFRR(uint8_t reg)
+// Get values of a bunch of properties, returns 0 if any of them aren't known
+static uint8_t cacheGet(uint16_t prop, void* values, uint8_t len)
 {
-	uint8_t frr = 0;
-	SI446X_ATOMIC()
+	for(uint8_t i=0;i<len;i++)
 	{
-		CHIPSELECT()
+		int8_t idx = cacheIndex(prop + i);
+		if(idx == -1 || !(cacheValid[idx / 8] & _BV(idx % 8)))
+			return 0;
+		((uint8_t*)values)[i] = cache[(uint8_t)idx];
+	}
+	return 1;
+}
+
+// Update the cache with new values, properties that aren't cached are ignored
+static void cacheSet(uint16_t prop, const void* values, uint8_t len)
+{
+	for(uint8_t i=0;i<len;i++)
+	{
+		int8_t idx = cacheIndex(prop + i);
+		if(idx != -1)
 		{
-			spi_transfer_nr(reg);
-			frr = spi_transfer(0xFF);
+			cache[(uint8_t)idx] = ((const uint8_t*)values)[i];
+			cacheValid[idx / 8] |= _BV(idx % 8);
 		}
 	}
-	return frr;
 }
 
-// Ge the patched RSSI from the beginning of the packet
-static int16_t getLatchedRSSI(void)
+// Forget everything, the radio has been reset
+static inline void cacheClear(void)
 {
-	uint8_t frr = getFRR(SI446X_CMD_READ_FRR_A);
-	int16_t rssi = rssi_dBm(frr);
-	return rssi;
+	memset(cacheValid, 0, sizeof(cacheValid));
 }
+#endif
+
+// Send a bunch of properties (up to 12 properties in one go)
+static void writeProperties(uint16_t prop, void* values, uint8_t len)
+{
+	// len must not be greater than 12
+
+	SI446X_NO_INTERRUPT()
+	{
+#if SI446X_PROP_CACHE
+		// Only send the values that are different from what the radio already has
+		while(len && cacheSame(prop, *(uint8_t*)values))
+		{
+			prop++;
+			values = (uint8_t*)values + 1;
+			len--;
+		}
+		while(len && cacheSame(prop + len - 1, ((uint8_t*)values)[len - 1]))
+			len--;
+
+		if(!len)
+			return;
+#endif
+
+		uint8_t data[16] = {
+			SI446X_CMD_SET_PROPERTY,
+			(uint8_t)(prop>>8),
+			len,
+			(uint8_t)prop
+		};
+
+		// Copy values into data, starting at index 4
+		memcpy(data + 4, values, len);
+
+#if SI446X_PROP_CACHE
+		// If the command didn't get sent then the radio still has the old values
+		if(doAPI(data, len + 4, NULL, 0))
+			cacheSet(prop, data + 4, len);
+#else
+		doAPI(data, len + 4, NULL, 0);
+#endif
+	}
+}
+
+#if SI446X_PROP_BATCH
+// Send everything that's been held back
+static void batchFlush(void)
+{
+	uint8_t i = 0;
+	while(i < batchCount)
+	{
+		uint8_t values[12];
+		uint16_t first = batchProp[i];
+		uint8_t len = 1;
+		values[0] = batchValue[i++];
+
+		// Keep adding properties from the same group while they fit in one command
+		while(i < batchCount)
+		{
+			uint16_t next = batchProp[i];
+			if((next>>8) != (first>>8))
+				break;
+
+			uint8_t gap = next - (first + len);
+			if(gap > PROP_MAX_GAP || len + gap + 1u > sizeof(values))
+				break;
+#if SI446X_PROP_CACHE
+			if(gap && !cacheGet(first + len, values + len, gap))
+				break;
+#else
+			if(gap)
+				break;
+#endif
+			len += gap;
+			values[len++] = batchValue[i++];
+		}
+
+		writeProperties(first, values, len);
+	}
+	batchCount = 0;
+}
+
+// Hold back a property write until commit, a later write to the same property replaces the earlier one
+static void batchAdd(uint16_t prop, uint8_t value)
+{
+	uint8_t i = 0;
+	while(i < batchCount && batchProp[i] < prop)
+		i++;
+
+	if(i < batchCount && batchProp[i] == prop)
+	{
+		batchValue[i] = value;
+		return;
+	}
+
+	// Full, send what we've got so far
+	if(batchCount == SI446X_PROP_BATCH)
+	{
+		batchFlush();
+		i = 0;
+	}
+
+	memmove(&batchProp[i + 1], &batchProp[i], (batchCount - i) * sizeof(batchProp[0]));
+	memmove(&batchValue[i + 1], &batchValue[i], batchCount - i);
+	batchProp[i] = prop;
+	batchValue[i] = value;
+	batchCount++;
+}
+
+// Forget held back writes to properties that are about to be written directly, the direct write is the newer one
+static void batchDrop(uint16_t prop, uint8_t len)
+{
+	uint8_t j = 0;
+	for(uint8_t i=0;i<batchCount;i++)
+	{
+		if((uint16_t)(batchProp[i] - prop) < len)
+			continue;
+		batchProp[j] = batchProp[i];
+		batchValue[j++] = batchValue[i];
+	}
+	batchCount = j;
+}
+#endif
+
+// Start holding back property writes
+static inline void propBegin(void)
+{
+#if SI446X_PROP_BATCH
+	SI446X_ATOMIC()
+	{
+		batchDepth++;
+	}
+#endif
+}
+
+// Send held back property writes, once every begin has had its commit
+static inline void propCommit(void)
+{
+#if SI446X_PROP_BATCH
+	SI446X_NO_INTERRUPT()
+	{
+		if(batchDepth > 0 && --batchDepth == 0)
+			batchFlush();
+	}
+#endif
+}
+
+// Configure a bunch of properties (up to 12 properties in one go) straight away, even if a batch has been started
+// For the library's own writes that the next command depends on (packet length, TX threshold, interrupt enables)
+static void setPropertiesNow(uint16_t prop, void* values, uint8_t len)
+{
+#if SI446X_PROP_BATCH
+	SI446X_NO_INTERRUPT()
+	{
+		batchDrop(prop, len);
+		writeProperties(prop, values, len);
+	}
+#else
+	writeProperties(prop, values, len);
+#endif
+}
+
+// Set a single property straight away
+static inline void setPropertyNow(uint16_t prop, uint8_t value)
+{
+	setPropertiesNow(prop, &value, 1);
+}
+
+// Configure a bunch of properties (up to 12 properties in one go), or hold them back if a batch has been started
+// The ISR never holds writes back, the batch might not be committed until long after it has finished
+static void setProperties(uint16_t prop, void* values, uint8_t len)
+{
+#if SI446X_PROP_BATCH
+	if(inISR)
+	{
+		setPropertiesNow(prop, values, len);
+		return;
+	}
+
+	if(batchDepth)
+	{
+		SI446X_NO_INTERRUPT()
+		{
+			for(uint8_t i=0;i<len;i++)
+				batchAdd(prop + i, ((uint8_t*)values)[i]);
+		}
+		return;
+	}
+#endif
+	writeProperties(prop, values, len);
+}
+
+// Set a single property
+static inline void setProperty(uint16_t prop, uint8_t value)
+{
+	setProperties(prop, &value, 1);
+}
+/*
+// Set a 16bit property
+static void setProperty16(uint16_t prop, uint16_t value)
+{
+	uint8_t properties[] = {value>>8, value};
+	setProperties(prop, properties, sizeof(properties));
+}
+*/
+// Read a bunch of properties from the radio
+// Returns 0 if the radio didn't respond in time
+static uint8_t readProperties(uint16_t prop, void* values, uint8_t len)
+{
+#if SI446X_PROP_BATCH
+	// Make sure held back writes are seen, the ISR leaves a half built batch alone and gets what the radio has
+	SI446X_NO_INTERRUPT()
+	{
+		if(!inISR)
+			batchFlush();
+	}
+#endif
+
+	uint8_t data[] = {
+		SI446X_CMD_GET_PROPERTY,
+		(uint8_t)(prop>>8),
+		len,
+		(uint8_t)prop
+	};
+
+	return doAPI(data, sizeof(data), values, len);
+}
+
+// Read a bunch of properties, from the cache if they're all in there
+static void getProperties(uint16_t prop, void* values, uint8_t len)
+{
+#if SI446X_PROP_CACHE
+	SI446X_NO_INTERRUPT()
+	{
+#if SI446X_PROP_BATCH
+		// Make sure held back writes are seen
+		if(!inISR)
+			batchFlush();
+#endif
+		if(!cacheGet(prop, values, len) && readProperties(prop, values, len))
+			cacheSet(prop, values, len);
+	}
+#else
+	readProperties(prop, values, len);
+#endif
+}
+
+// Read a single property
+static inline uint8_t getProperty(uint16_t prop)
+{
+	uint8_t val;
+	getProperties(prop, &val, 1);
+	return val;
+}
+
+// Do an ADC conversion
+static uint16_t getADC(uint8_t adc_en, uint8_t adc_cfg, uint8_t part)
+{
+	uint8_t data[6] = {
+		SI446X_CMD_GET_ADC_READING,
+		adc_en,
+		adc_cfg
+	};
+	doAPI(data, 3, data, 6);
+	return (data[part]<<8 | data[part + 1]);
+}
+
+// Read a fast response register
+static uint8_t getFRR(uint8_t reg)
+{
+	uint8_t frr = 0;
+	SI446X_ATOMIC()
+	{
+		CHIPSELECT()
+		{
+			spi_transfer_nr(reg);
+			frr = spi_transfer(0xFF);
+		}
+	}
+	return frr;
+}
+
+#if !SI446X_FRR_ISR
+// Ge the patched RSSI from the beginning of the packet
+static int16_t getLatchedRSSI(void)
+{
+	uint8_t frr = getFRR(SI446X_CMD_READ_FRR_A);
+	int16_t rssi = rssi_dBm(frr);
+	return rssi;
+}
+#endif
 
 // Get current radio state
 static si446x_state_t getState(void)
@@ -370,6 +1175,7 @@ static si446x_state_t getState(void)
 // Set new state
 static void setState(si446x_state_t newState)
 {
+	TRACE(SI446X_TRACE_STATE, newState, 0);
 	uint8_t data[] = {
 		SI446X_CMD_CHANGE_STATE,
 		newState
@@ -388,6 +1194,16 @@ static void clearFIFO(void)
 	doAPI((uint8_t*)clearFifo, sizeof(clearFifo), NULL, 0);
 }
 
+// Clear the RX FIFO, leaving a loaded TX packet alone
+static void clearRxFIFO(void)
+{
+	static const uint8_t clearFifo[] = {
+		SI446X_CMD_FIFO_INFO,
+		SI446X_FIFO_CLEAR_RX
+	};
+	doAPI((uint8_t*)clearFifo, sizeof(clearFifo), NULL, 0);
+}
+
 /*
 // Sometimes the Si446x gets all messed up if it receives a bad packet, so we have to enable the INVALID SYNC interrupt when
 // a new packet starts coming in. If the INVALID SYNC interrupt is triggered then RX mode is restarted. The interrupt is turned off again
@@ -434,20 +1250,129 @@ static void interrupt2(void* buff, uint8_t clearPH, uint8_t clearMODEM, uint8_t
 	doAPI(data, sizeof(data), buff, 8);
 }
 
+// See if the NIRQ pin is asserted
+// Returns 1 if we can't read the pin so that callers assume an interrupt is pending
+static inline uint8_t irqAsserted(void)
+{
+#ifdef ARDUINO
+#if SI446X_IRQ != -1
+	return (digitalRead(SI446X_IRQ) == LOW);
+#else
+	return 1;
+#endif
+#elif SI446X_HAL != SI446X_HAL_AVR
+	return !si446x_hal_irq();
+#elif defined(IRQ_BIT)
+	return !(IRQ_PIN & _BV(IRQ_BIT));
+#else
+	return 1;
+#endif
+}
+
+#if SI446X_FRR_ISR
+static uint8_t isrFRR[4]; // FRR A - D as read at the start of the ISR
+
+#define isrLatchedRSSI()	rssi_dBm(isrFRR[0])
+#define isrGetState()		((si446x_state_t)isrFRR[1])
+
+// Get pending interrupts from the FRRs and clear just those, buff must be atleast 8 bytes and is laid out like the GET_INT_STATUS response
+// Everything that becomes pending after the FRRs are read stays pending, keeping NIRQ low for the next time round
+static void interruptFRR(uint8_t* buff)
+{
+	memset(buff, 0, 8);
+	memset(isrFRR, 0, sizeof(isrFRR));
+
+#if SI446X_ASYNC
+	// The command with the radio goes first so its response doesn't get lost
+	asyncSettle();
+#endif
+
+	// If the clear from last time is still being processed then the FRRs will still have the old pending bits
+	if(!waitForResponse(NULL, 0, 1) || !irqAsserted())
+		return;
+
+	SI446X_ATOMIC()
+	{
+		CHIPSELECT()
+		{
+			spi_transfer_nr(SI446X_CMD_READ_FRR_A);
+			spi_transfer_block(NULL, isrFRR, sizeof(isrFRR));
+		}
+	}
+
+	uint8_t data[] = {
+		SI446X_CMD_GET_INT_STATUS,
+		(uint8_t)~isrFRR[2],
+		(uint8_t)~isrFRR[3],
+		0xFF
+	};
+
+	// CTS was checked above and reading FRRs doesn't change it, so go straight to sending
+	if(enabledInterrupts[IRQ_CHIP])
+	{
+		// Chip interrupts aren't in the FRRs
+		data[3] = 0;
+		sendCommand(data, sizeof(data));
+		waitForResponse(buff, 8, 1);
+	}
+	else if(isrFRR[2] || isrFRR[3])
+		sendCommand(data, sizeof(data));
+
+	buff[2] = isrFRR[2];
+	buff[4] = isrFRR[3];
+}
+#else
+#define isrLatchedRSSI()	getLatchedRSSI()
+#define isrGetState()		getState()
+#endif
+
+// Wait for the radio to finish its power on reset, returns 0 if it took more than around 100ms
+// PART_INFO is checked for a Si446x part number since the bus could read as ready (0xFF) while the radio isn't driving it yet
+static uint8_t waitForPOR(void)
+{
+	uint8_t data[3];
+	for(uint8_t i=0;i<200;i++)
+	{
+		// Commands must only be sent once CTS says the radio is ready for one
+		if(getResponse(NULL, 0))
+		{
+			data[0] = SI446X_CMD_PART_INFO;
+			sendCommand(data, 1);
+			for(uint8_t j=0;j<50;j++)
+			{
+				delay_us(10);
+				if(getResponse(data, sizeof(data)))
+				{
+					if(data[1] == 0x44)
+						return 1;
+					break;
+				}
+			}
+		}
+		delay_us(500);
+	}
+	return 0;
+}
+
 // Reset the RF chip
-static void resetDevice(void)
+// SDN only needs to be high for 10us, after that the radio is polled until it's ready instead of waiting a fixed time
+// Returns 0 if the radio didn't come back
+static uint8_t resetDevice(void)
 {
 #ifdef ARDUINO
 	digitalWrite(SI446X_SDN, HIGH);
-	delay_ms(50);
+	delay_ms(1);
 	digitalWrite(SI446X_SDN, LOW);
-	delay_ms(50);
+#elif SI446X_HAL != SI446X_HAL_AVR
+	si446x_hal_sdn(1);
+	delay_ms(1);
+	si446x_hal_sdn(0);
 #else
 	SDN_PORT |= _BV(SDN_BIT);
-	delay_ms(50);
+	delay_ms(1);
 	SDN_PORT &= ~_BV(SDN_BIT);
-	delay_ms(50);
 #endif
+	return waitForPOR();
 }
 
 /*
@@ -460,37 +1385,210 @@ void Si446x_interrupt(uint8_t* buff)
 }
 */
 
-// Apply the radio configuration
-static void applyStartupConfig(void)
+#if SI446X_WARM_START
+// Property groups that the library changes while running, these are put back to the startup config on a warm start
+static uint8_t warmGroup(uint8_t group)
+{
+	return (
+		group == SI446X_PROP_GROUP_GLOBAL ||
+		group == SI446X_PROP_GROUP_INT ||
+		group == SI446X_PROP_GROUP_FRR ||
+		group == SI446X_PROP_GROUP_PKT ||
+		group == SI446X_PROP_GROUP_PA ||
+		group == SI446X_PROP_GROUP_MATCH ||
+		group == SI446X_PROP_GROUP_RX_HOP
+	);
+}
+
+// See if the radio has the same values as the startup config for some properties
+static uint8_t configMatches(uint16_t prop, uint8_t len)
 {
-	uint8_t buff[17];
+	uint8_t expected[16];
+	uint8_t buff[16];
+	uint16_t found = 0;
+	uint8_t first = (uint8_t)prop;
+
 	for(uint16_t i=0;i<sizeof(config);i++)
 	{
-		memcpy_P(buff, &config[i], sizeof(buff));
-		doAPI(&buff[1], buff[0], NULL, 0);
-		i += buff[0];
+		uint8_t cmdLen = pgm_read_byte(&config[i]);
+		memcpy_P(buff, &config[i + 1], cmdLen);
+		i += cmdLen;
+
+		if(buff[0] != SI446X_CMD_SET_PROPERTY || buff[1] != (uint8_t)(prop>>8))
+			continue;
+
+		for(uint8_t j=0;j<buff[2];j++)
+		{
+			uint8_t idx = (uint8_t)(buff[3] + j - first);
+			if(idx < len) // Later commands can set the same property again, the last one wins
+			{
+				expected[idx] = buff[4 + j];
+				found |= 1<<idx;
+			}
+		}
 	}
+
+	// Everything has to be in the config, otherwise the radio could have its default values and still match
+	if(found != (uint16_t)((1UL<<len) - 1))
+		return 0;
+
+	readProperties(prop, buff, len);
+	return (memcmp(buff, expected, len) == 0);
 }
 
-void Si446x_init()
+// See if the radio is still running with the startup config (MCU was reset, but the radio wasn't)
+// The frequency and modem setup are different for pretty much every config and the library never changes them
+static uint8_t radioConfigured(void)
 {
-	spiDeselect();
-#ifdef ARDUINO
-	pinMode(SI446X_CSN, OUTPUT);
-	pinMode(SI446X_SDN, OUTPUT);
-#if SI446X_IRQ != -1
-	pinMode(SI446X_IRQ, INPUT_PULLUP);
+	// Don't wait for the full command timeout if the radio isn't there or is still powering up
+	if(!waitForPOR())
+		return 0;
+	return configMatches(SI446X_FREQ_CONTROL_INTE, 8) && configMatches(SI446X_MODEM_MOD_TYPE, 12);
+}
 #endif
-	
-	SPI.begin();
-#else
-	CSN_DDR |= _BV(CSN_BIT);
-	SDN_DDR |= _BV(SDN_BIT);
 
-#ifdef IRQ_BIT
-	// Interrupt pin (input with pullup)
-#if defined(PUEA) || defined(PUEB) || defined(PUEC) || defined(PUED) || defined(PUEE)
-	IRQ_PUE |= _BV(IRQ_BIT);
+#if SI446X_IRCAL_CACHE
+#if SI446X_IRCAL_CACHE < 1 || SI446X_IRCAL_CACHE > 127
+	#error "SI446X_IRCAL_CACHE must be 0 - 127"
+#endif
+
+// Checksum of the startup config, stored with the IRCAL result since the calibration depends on the frequency and modem setup
+static uint16_t configSum(void)
+{
+	uint16_t sum = 0;
+	for(uint16_t i=0;i<sizeof(config);i++)
+		sum = ((sum<<1) | (sum>>15)) + pgm_read_byte(&config[i]);
+	return sum;
+}
+
+// Get the stored IRCAL result, returns 0 if there isn't one or if it's too old to use
+static uint8_t ircalLoad(si446x_ircal_t* cal, int8_t temperature)
+{
+	if(!SI446X_CB_IRCAL_LOAD(cal) || cal->configSum != configSum())
+		return 0;
+
+	int16_t drift = temperature - cal->temperature;
+	return (drift <= SI446X_IRCAL_CACHE && drift >= -SI446X_IRCAL_CACHE);
+}
+
+// Read back the result of the IRCAL that was just done and pass it on to be stored
+static void ircalSave(si446x_ircal_t* cal, int8_t temperature)
+{
+	uint8_t data[3] = {
+		SI446X_CMD_IRCAL_MANUAL,
+		0x00, // Only read, don't replace anything
+		0x00
+	};
+	doAPI(data, sizeof(data), data, 2);
+
+	cal->amp = data[0] & 0x1F;
+	cal->ph = data[1] & 0x3F;
+	cal->temperature = temperature;
+	cal->configSum = configSum();
+	SI446X_CB_IRCAL_SAVE(cal);
+}
+
+// Apply a stored IRCAL result
+static void ircalApply(const si446x_ircal_t* cal)
+{
+	uint8_t data[3] = {
+		SI446X_CMD_IRCAL_MANUAL,
+		(uint8_t)(0x80 | cal->amp), // IRCAL_AMP_REPLACE
+		(uint8_t)(0x80 | cal->ph) // IRCAL_PH_REPLACE
+	};
+	doAPI(data, sizeof(data), NULL, 0);
+}
+#endif
+
+// Apply the radio configuration
+// For a warm start only the GPIO setup and property groups that the library changes are applied
+static void applyStartupConfig(uint8_t warm)
+{
+	uint8_t buff[16];
+#if SI446X_IRCAL_CACHE
+	si446x_ircal_t cal;
+	int8_t temperature = 0;
+	uint8_t ircal = 0; // 0 = Not got to the IRCAL commands yet, 1 = Using the stored result, 2 = Calibrating
+#endif
+	for(uint16_t i=0;i<sizeof(config);i++)
+	{
+		// Only copy the command itself, copying a fixed 17 bytes would read past the end of the array for the last command
+		uint8_t len = pgm_read_byte(&config[i]);
+		memcpy_P(buff, &config[i + 1], len);
+		i += len;
+
+#if SI446X_WARM_START
+		if(warm && buff[0] != SI446X_CMD_GPIO_PIN_CFG && !(buff[0] == SI446X_CMD_SET_PROPERTY && warmGroup(buff[1])))
+			continue;
+#else
+		((void)(warm));
+#endif
+
+#if SI446X_IRCAL_CACHE
+		if(buff[0] == SI446X_CMD_IRCAL)
+		{
+			if(!ircal)
+			{
+				// The ADC works once POWER_UP is done, which is always before the IRCAL commands
+				temperature = (int8_t)Si446x_adc_temperature();
+				if(ircalLoad(&cal, temperature))
+				{
+					ircalApply(&cal);
+					ircal = 1;
+				}
+				else
+					ircal = 2;
+			}
+
+			if(ircal == 1) // Stored result was used, skip all of the IRCAL commands
+				continue;
+		}
+#endif
+
+#if SI446X_PROP_CACHE
+		uint8_t ok = doAPI(buff, len, NULL, 0);
+		if(buff[0] == SI446X_CMD_POWER_UP) // Properties go back to their defaults, which the cache doesn't know about
+			cacheClear();
+		else if(buff[0] == SI446X_CMD_SET_PROPERTY && ok)
+			cacheSet((buff[1]<<8) | buff[3], buff + 4, buff[2]);
+#else
+		doAPI(buff, len, NULL, 0);
+#endif
+	}
+
+#if SI446X_IRCAL_CACHE
+	if(ircal == 2)
+		ircalSave(&cal, temperature);
+#endif
+}
+
+uint8_t Si446x_init()
+{
+	spiDeselect();
+#ifdef ARDUINO
+	pinMode(SI446X_CSN, OUTPUT);
+	pinMode(SI446X_SDN, OUTPUT);
+#if SI446X_IRQ != -1
+	pinMode(SI446X_IRQ, INPUT_PULLUP);
+#endif
+#if SI446X_GPIO_CTS != -1
+	pinMode(SI446X_CTS, INPUT);
+#endif
+	
+	SPI.begin();
+#elif SI446X_HAL != SI446X_HAL_AVR
+	si446x_hal_init();
+#else
+	CSN_DDR |= _BV(CSN_BIT);
+	SDN_DDR |= _BV(SDN_BIT);
+#if SI446X_GPIO_CTS != -1
+	CTS_DDR &= ~_BV(CTS_BIT); // Input, the radio drives this pin
+#endif
+
+#ifdef IRQ_BIT
+	// Interrupt pin (input with pullup)
+#if defined(PUEA) || defined(PUEB) || defined(PUEC) || defined(PUED) || defined(PUEE)
+	IRQ_PUE |= _BV(IRQ_BIT);
 #else
 	IRQ_PORT |= _BV(IRQ_BIT);
 #endif
@@ -499,11 +1597,98 @@ void Si446x_init()
 	spi_init();
 #endif
 
-	resetDevice();
-	applyStartupConfig();
+#if SI446X_GPIO_CTS != -1
+	ctsPinReady = 0;
+#endif
+
+#if SI446X_PROP_CACHE
+	cacheClear();
+#endif
+
+#if SI446X_PROP_BATCH
+	batchCount = 0;
+	batchDepth = 0;
+#endif
+
+#if SI446X_ASYNC
+	// Anything still queued is meant for the old radio setup
+	cmdHead = NULL;
+	cmdTail = NULL;
+	cmdCount = 0;
+	cmdSent = 0;
+	cmdFinished = 0;
+#endif
+
+#if SI446X_WARM_START
+	uint8_t warm = radioConfigured();
+#else
+	uint8_t warm = 0;
+#endif
+	// Don't bother sending the config if nothing's there, every command would time out
+	if(!warm && !resetDevice())
+		return 0;
+	applyStartupConfig(warm);
 	interrupt(NULL);
+
+#if SI446X_HOP
+	// Hopping could have been left on from before a warm start, or turned on by the startup config
+	rxHopping = !!(getProperty(SI446X_RX_HOP_CONTROL) & 0x70);
+#endif
+
+#if SI446X_FRR_ISR
+	// Latched RSSI and state stay in A and B where getLatchedRSSI() and getState() expect them
+	uint8_t frrModes[] = {
+		SI446X_FRR_MODE_LATCHED_RSSI,
+		SI446X_FRR_MODE_CURRENT_STATE,
+		SI446X_FRR_MODE_INT_PH_PEND,
+		SI446X_FRR_MODE_INT_MODEM_PEND
+	};
+	setProperties(SI446X_FRR_CTL_A_MODE, frrModes, sizeof(frrModes));
+#endif
+
+#if SI446X_GPIO_CTS != -1
+	// The startup config usually changes the GPIO pins, so set the CTS pin up afterwards
+	Si446x_writeGPIO((si446x_gpio_t)SI446X_GPIO_CTS, SI446X_GPIO_MODE_CTS);
+	ctsPinReady = 1;
+#endif
+
 	Si446x_sleep();
 
+	txLoaded = 0;
+
+#if SI446X_TX_QUEUE
+	txQueueHead = 0;
+	txQueueTail = 0;
+	txQueueActive = 0;
+	txQueueNext = 0;
+#endif
+
+#if SI446X_MAC
+	macOn = 0;
+	macWaiting = 0;
+#endif
+
+#if SI446X_LINK_STATS
+	Si446x_linkReset();
+#endif
+
+#if SI446X_STREAM
+	uint8_t thresholds[] = {
+		SI446X_STREAM_TX_THRESH,
+		SI446X_STREAM_RX_THRESH
+	};
+	setProperties(SI446X_PKT_TX_THRESHOLD, thresholds, sizeof(thresholds));
+	rxStreamBuff = NULL;
+	streamLength = 1; // Don't know what it was left at before a warm start
+#endif
+
+#if SI446X_FAST_TX
+	fifoDirty = 1; // Startup config can put the radio into RX mode
+#if !SI446X_FIXED_LENGTH
+	pktLength = 0;
+#endif
+#endif
+
 	enabledInterrupts[IRQ_PACKET] = (1<<SI446X_PACKET_RX_PEND) | (1<<SI446X_CRC_ERROR_PEND);
 	//enabledInterrupts[IRQ_MODEM] = (1<<SI446X_SYNC_DETECT_PEND);
 
@@ -512,6 +1697,7 @@ void Si446x_init()
 #endif
 
 	Si446x_irq_on(1);
+	return 1;
 }
 
 void Si446x_getInfo(si446x_info_t* info)
@@ -549,6 +1735,49 @@ int16_t Si446x_getRSSI()
 	return rssi;
 }
 
+#if SI446X_STATS
+void Si446x_getStats(si446x_stats_t* stats)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		*stats = statCounters;
+	}
+}
+
+void Si446x_resetStats()
+{
+	SI446X_NO_INTERRUPT()
+	{
+		memset(&statCounters, 0, sizeof(statCounters));
+	}
+}
+#endif
+
+#if SI446X_TRACE
+uint8_t Si446x_traceGet(si446x_trace_t* buff, uint8_t max)
+{
+	uint8_t count;
+	SI446X_NO_INTERRUPT()
+	{
+		count = (traceCount < max) ? traceCount : max;
+
+		// Newest records, oldest first
+		uint8_t idx = traceHead - count;
+		for(uint8_t i=0;i<count;i++)
+			buff[i] = traceRing[idx++ & (SI446X_TRACE - 1)];
+	}
+	return count;
+}
+
+void Si446x_traceClear()
+{
+	SI446X_NO_INTERRUPT()
+	{
+		traceCount = 0;
+	}
+}
+#endif
+
 si446x_state_t Si446x_getState()
 {
 	// TODO what about the state change delay with transmitting?
@@ -615,6 +1844,11 @@ void Si446x_setupWUT(uint8_t r, uint16_t m, uint8_t ldc, uint8_t config)
 
 	SI446X_NO_INTERRUPT()
 	{
+		// Read before starting the batch, reading would send the held back writes
+		uint8_t clkChange = (getProperty(SI446X_GLOBAL_CLK_CFG) != SI446X_DIVIDED_CLK_32K_SEL_RC);
+
+		propBegin();
+
 		// Disable WUT
 		setProperty(SI446X_GLOBAL_WUT_CONFIG, 0);
 
@@ -631,11 +1865,13 @@ void Si446x_setupWUT(uint8_t r, uint16_t m, uint8_t ldc, uint8_t config)
 		setProperty(SI446X_INT_CTL_CHIP_ENABLE, intChip);
 
 		// Set WUT clock source to internal 32KHz RC
-		if(getProperty(SI446X_GLOBAL_CLK_CFG) != SI446X_DIVIDED_CLK_32K_SEL_RC)
-		{
+		if(clkChange)
 			setProperty(SI446X_GLOBAL_CLK_CFG, SI446X_DIVIDED_CLK_32K_SEL_RC);
+
+		propCommit();
+
+		if(clkChange)
 			delay_us(300); // Need to wait 300us for clock source to stabilize, see GLOBAL_WUT_CONFIG:WUT_EN info
-		}
 
 		// Setup WUT
 		uint8_t properties[5];
@@ -647,6 +1883,11 @@ void Si446x_setupWUT(uint8_t r, uint16_t m, uint8_t ldc, uint8_t config)
 		properties[3] = r | SI446X_LDC_MAX_PERIODS_TWO | (1<<SI446X_WUT_SLEEP);
 		properties[4] = ldc;
 		setProperties(SI446X_GLOBAL_WUT_CONFIG, properties, sizeof(properties));
+
+#if SI446X_FAST_TX
+		ldcRx = !!doRx;
+		fifoDirty = 1;
+#endif
 	}
 }
 
@@ -654,8 +1895,19 @@ void Si446x_disableWUT()
 {
 	SI446X_NO_INTERRUPT()
 	{
+		propBegin();
 		setProperty(SI446X_GLOBAL_WUT_CONFIG, 0);
 		setProperty(SI446X_GLOBAL_CLK_CFG, 0);
+		propCommit();
+
+		// WUT and low battery interrupts can't happen now, the ISR doesn't need to check for them
+		enabledInterrupts[IRQ_CHIP] = 0;
+
+#if SI446X_FAST_TX
+		if(ldcRx) // Might have received something since the last clear
+			fifoDirty = 1;
+		ldcRx = 0;
+#endif
 	}
 }
 
@@ -704,138 +1956,1551 @@ void Si446x_setupCallback(uint16_t callbacks, uint8_t state)
 */
 }
 
-uint8_t Si446x_sleep()
+uint8_t Si446x_sleep()
+{
+	if(getState() == SI446X_STATE_TX)
+		return 0;
+	setState(SI446X_STATE_SLEEP);
+	return 1;
+}
+
+void Si446x_read(void* buff, uint8_t len)
+{
+	SI446X_ATOMIC()
+	{
+		CHIPSELECT()
+		{
+			spi_transfer_nr(SI446X_CMD_READ_RX_FIFO);
+			spi_transfer_block(NULL, buff, len);
+		}
+	}
+	TRACE(SI446X_TRACE_RX_FIFO, 0, len);
+}
+
+#if SI446X_RX_POOL || SI446X_RX_QUEUE
+// Read the length and the packet in one go, and fill in everything else
+static void readPacket(si446x_packet_t* packet)
+{
+	SI446X_ATOMIC()
+	{
+		CHIPSELECT()
+		{
+			spi_transfer_nr(SI446X_CMD_READ_RX_FIFO);
+#if !SI446X_FIXED_LENGTH
+			uint8_t len = spi_transfer(0xFF);
+			if(len > MAX_PACKET_LEN)
+				len = MAX_PACKET_LEN;
+#else
+			uint8_t len = SI446X_FIXED_LENGTH;
+#endif
+			spi_transfer_block(NULL, packet->data, len);
+			packet->length = len;
+		}
+	}
+	TRACE(SI446X_TRACE_RX_FIFO, 0, packet->length);
+
+	packet->timestamp = SI446X_CB_TIMESTAMP();
+	packet->rssi = isrLatchedRSSI();
+	packet->channel = currentChannel;
+}
+#endif
+
+#if SI446X_RX_POOL
+// Get a free packet buffer, NULL if they're all in use
+static si446x_packet_t* poolTake(void)
+{
+	for(uint8_t i=0;i<SI446X_RX_POOL;i++)
+	{
+		if(!poolUsed[i])
+		{
+			poolUsed[i] = 1;
+			return &pool[i];
+		}
+	}
+	return NULL;
+}
+
+void Si446x_release(si446x_packet_t* packet)
+{
+	poolUsed[packet - pool] = 0;
+}
+#endif
+
+#if SI446X_RX_QUEUE
+// Read the received packet out of the FIFO without keeping it, the next packet could already be arriving behind it
+static void skipPacket(void)
+{
+	SI446X_ATOMIC()
+	{
+		CHIPSELECT()
+		{
+			spi_transfer_nr(SI446X_CMD_READ_RX_FIFO);
+#if !SI446X_FIXED_LENGTH
+			uint8_t len = spi_transfer(0xFF);
+			if(len > MAX_PACKET_LEN)
+				len = MAX_PACKET_LEN;
+#else
+			uint8_t len = SI446X_FIXED_LENGTH;
+#endif
+			while(len--)
+				spi_transfer_nr(0xFF);
+		}
+	}
+}
+
+// Add the received packet to the queue (ISR only)
+static void queuePush(void)
+{
+	uint8_t head = queueHead;
+	uint8_t count = head - queueTail;
+	if(count >= SI446X_RX_QUEUE)
+	{
+		// Full, throw the packet away
+		skipPacket();
+		if(queueDropped != 0xFFFF)
+			queueDropped++;
+		return;
+	}
+
+	readPacket(&queue[head & (SI446X_RX_QUEUE - 1)]);
+	queueBarrier();
+	queueHead = head + 1;
+
+	count++;
+	if(count > queueHighWater)
+		queueHighWater = count;
+}
+
+si446x_packet_t* Si446x_queuePeek()
+{
+	uint8_t tail = queueTail;
+	if(queueHead == tail)
+		return NULL;
+	queueBarrier();
+	return &queue[tail & (SI446X_RX_QUEUE - 1)];
+}
+
+void Si446x_queuePop()
+{
+	uint8_t tail = queueTail;
+	if(queueHead == tail)
+		return;
+	queueBarrier();
+	queueTail = tail + 1;
+}
+
+void Si446x_queueStats(si446x_queue_stats_t* stats)
+{
+	stats->count = queueHead - queueTail;
+	stats->highWater = queueHighWater;
+	stats->dropped = queueDropped;
+}
+#endif
+
+#include <stdio.h>
+
+#if SI446X_STREAM || SI446X_TX_QUEUE
+// Turn packet handler interrupts on or off
+static void phInterrupts(uint8_t mask, uint8_t state)
+{
+	uint8_t en = enabledInterrupts[IRQ_PACKET];
+	en = state ? (en | mask) : (en & ~mask);
+	enabledInterrupts[IRQ_PACKET] = en;
+	setPropertyNow(SI446X_INT_CTL_PH_ENABLE, en);
+}
+
+// Bytes in the RX FIFO and space in the TX FIFO
+static void fifoInfo(uint8_t* info)
+{
+	info[0] = SI446X_CMD_FIFO_INFO;
+	doAPI(info, 1, info, 2);
+}
+#endif
+
+#if SI446X_STREAM
+// Set PKT_FIELD_2_LENGTH to something bigger than a normal packet
+static void setStreamLength(uint16_t len)
+{
+	uint8_t data[] = {
+		(uint8_t)(len>>8),
+		(uint8_t)len
+	};
+	setPropertiesNow(SI446X_PKT_FIELD_2_LENGTH, data, sizeof(data));
+	streamLength = 1;
+#if SI446X_FAST_TX
+	// Stops startRX() from overwriting the low byte, restoreLength() always runs before anything else uses it
+	pktLength = MAX_PACKET_LEN;
+#endif
+}
+
+// Put PKT_FIELD_2_LENGTH back to normal if streaming changed it
+static void restoreLength(void)
+{
+	if(!streamLength)
+		return;
+
+	uint8_t data[] = {
+		0,
+		MAX_PACKET_LEN
+	};
+	setPropertiesNow(SI446X_PKT_FIELD_2_LENGTH, data, sizeof(data));
+	streamLength = 0;
+#if SI446X_FAST_TX
+	pktLength = MAX_PACKET_LEN;
+#endif
+}
+
+// Size of the length field at the start of the packet
+static uint8_t lengthFieldSize(void)
+{
+	return (getProperty(SI446X_PKT_LEN) & SI446X_PKT_LEN_SIZE) ? 2 : 1;
+}
+
+// Top up the TX FIFO with more of the packet
+static void txStreamFill(void)
+{
+	uint8_t info[2];
+	fifoInfo(info);
+
+	uint8_t len = (txStreamLeft < info[1]) ? txStreamLeft : info[1];
+	if(len)
+	{
+		SI446X_ATOMIC()
+		{
+			CHIPSELECT()
+			{
+				spi_transfer_nr(SI446X_CMD_WRITE_TX_FIFO);
+				spi_transfer_block(txStreamData, NULL, len);
+			}
+		}
+		TRACE(SI446X_TRACE_TX_FIFO, 0, len);
+		txStreamData += len;
+		txStreamLeft -= len;
+	}
+
+	// Rest of the packet is in the FIFO, no need to know when it's getting empty anymore
+	if(!txStreamLeft)
+		phInterrupts(_BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND), 0);
+}
+
+// Move what's in the RX FIFO into the stream buffer
+static void rxStreamDrain(void)
+{
+	uint8_t info[2];
+	fifoInfo(info);
+	uint8_t count = info[0];
+
+	// Length field isn't needed, the packet handler has already checked it
+	uint8_t skip = (count < rxStreamSkip) ? count : rxStreamSkip;
+	if(skip)
+	{
+		Si446x_read(info, skip);
+		rxStreamSkip -= skip;
+		count -= skip;
+	}
+
+	uint16_t room = rxStreamSize - rxStreamLen;
+	uint8_t len = (count < room) ? count : room;
+	if(len)
+	{
+		Si446x_read(rxStreamBuff + rxStreamLen, len);
+		rxStreamLen += len;
+		count -= len;
+	}
+
+	// Shouldn't happen since the max length is the buffer size, but don't leave anything behind
+	while(count--)
+		Si446x_read(info, 1);
+}
+
+// Packet has finished arriving (or failed)
+static void rxStreamEnd(void)
+{
+	rxStreamBuff = NULL;
+	phInterrupts(_BV(SI446X_RX_FIFO_ALMOST_FULL_PEND), 0);
+}
+#endif
+
+#if SI446X_CCA || SI446X_SCAN
+// Returns 1 if the radio is transmitting or the TX queue is using it, the same checks as txPrepare()
+static uint8_t txBusy(si446x_state_t state)
+{
+#if SI446X_TX_QUEUE
+	if(txQueueActive)
+		return 1;
+#endif
+	return (state == SI446X_STATE_TX);
+}
+#endif
+
+// Stop receiving and clear out the FIFO and interrupts ready for loading a new packet, returns 0 if already transmitting
+static uint8_t txPrepare(void)
+{
+#if SI446X_TX_QUEUE
+	if(txQueueActive) // Queue is using the radio
+		return 0;
+#endif
+
+#if SI446X_FAST_TX
+	si446x_state_t state = getState();
+	if(state == SI446X_STATE_TX) // Already transmitting
+		return 0;
+#else
+	if(getState() == SI446X_STATE_TX) // Already transmitting
+		return 0;
+#endif
+
+	// Collision avoidance is done before getting here by Si446x_TX() (SI446X_CCA)
+	// TODO maybe collision detect (RSSI jump)
+
+#if SI446X_FAST_TX
+	// Stop receiving so nothing else gets put into the FIFO
+	if(state == SI446X_STATE_RX)
+	{
+		setState(IDLE_STATE);
+		fifoDirty = 1;
+	}
+
+	if(fifoDirty || ldcRx)
+	{
+		clearFIFO();
+		fifoDirty = 0;
+	}
+
+	// Only need to clear old interrupts if there are any
+	if(irqAsserted())
+		interrupt2(NULL, 0, 0, 0xFF);
+#else
+	setState(IDLE_STATE);
+	clearFIFO();
+	interrupt2(NULL, 0, 0, 0xFF);
+#endif
+
+	return 1;
+}
+
+// Write a packet to the TX FIFO
+static void txLoad(const void* packet, uint8_t len)
+{
+#if SI446X_FIXED_LENGTH
+	// Stop the unused parameter warning
+	((void)(len));
+#endif
+
+	SI446X_ATOMIC()
+	{
+		// Load data to FIFO
+		CHIPSELECT()
+		{
+			spi_transfer_nr(SI446X_CMD_WRITE_TX_FIFO);
+#if !SI446X_FIXED_LENGTH
+			spi_transfer_nr(len);
+			spi_transfer_block(packet, NULL, len);
+#else
+			spi_transfer_block(packet, NULL, SI446X_FIXED_LENGTH);
+#endif
+		}
+	}
+#if !SI446X_FIXED_LENGTH
+	TRACE(SI446X_TRACE_TX_FIFO, 0, len + 1);
+#else
+	TRACE(SI446X_TRACE_TX_FIFO, 0, SI446X_FIXED_LENGTH);
+#endif
+
+	txLoaded = 1;
+	txSent = 0;
+#if !SI446X_FIXED_LENGTH
+	txLength = len;
+#endif
+}
+
+// Transmit what's in the TX FIFO, or the last packet again if condition has SI446X_TX_RETRANSMIT
+static void txStart(uint8_t channel, si446x_state_t onTxFinish, uint8_t condition)
+{
+#if SI446X_STREAM
+	restoreLength();
+#endif
+
+#if !SI446X_FIXED_LENGTH
+	uint8_t len = txLength;
+
+	// Set packet length
+#if SI446X_FAST_TX
+	if(pktLength != len)
+	{
+		setPropertyNow(SI446X_PKT_FIELD_2_LENGTH_LOW, len);
+		pktLength = len;
+	}
+#else
+	setPropertyNow(SI446X_PKT_FIELD_2_LENGTH_LOW, len);
+#endif
+#endif
+
+	// Begin transmit
+	uint8_t data[] = {
+		SI446X_CMD_START_TX,
+		channel,
+		(uint8_t)((onTxFinish<<4) | condition),
+		0,
+		SI446X_FIXED_LENGTH,
+		0,
+		0
+	};
+	doAPI(data, sizeof(data), NULL, 0);
+	txSent = 1;
+	currentChannel = channel;
+
+#if SI446X_FAST_TX
+	if(onTxFinish == SI446X_STATE_RX)
+		fifoDirty = 1;
+#endif
+
+#if !SI446X_FIXED_LENGTH
+	// Reset packet length back to max for receive mode, whatever the finish state is
+	// The length is used when TX starts, and the next receive might not go through Si446x_RX()
+#if SI446X_FAST_TX
+	if(pktLength != MAX_PACKET_LEN)
+	{
+		setPropertyNow(SI446X_PKT_FIELD_2_LENGTH_LOW, MAX_PACKET_LEN);
+		pktLength = MAX_PACKET_LEN;
+	}
+#else
+	setPropertyNow(SI446X_PKT_FIELD_2_LENGTH_LOW, MAX_PACKET_LEN);
+#endif
+#endif
+}
+
+// Start receiving
+static void startRX(uint8_t channel)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		currentChannel = channel;
+		setState(IDLE_STATE);
+		if(txLoaded) // Keep the packet for Si446x_retransmit()
+			clearRxFIFO();
+		else
+			clearFIFO();
+		//fix_invalidSync_irq(0);
+		//Si446x_setupCallback(SI446X_CBS_INVALIDSYNC, 0);
+		//setProperty(SI446X_PKT_FIELD_2_LENGTH_LOW, MAX_PACKET_LEN); // TODO ?
+		interrupt2(NULL, 0, 0, 0xFF); // TODO needed?
+
+#if SI446X_FAST_TX
+		fifoDirty = 1;
+#if !SI446X_FIXED_LENGTH
+		// Might have been left at the last TX length
+		if(pktLength != MAX_PACKET_LEN)
+		{
+			setPropertyNow(SI446X_PKT_FIELD_2_LENGTH_LOW, MAX_PACKET_LEN);
+			pktLength = MAX_PACKET_LEN;
+		}
+#endif
+#endif
+
+		// TODO RX timeout to sleep if WUT LDC enabled
+
+		uint8_t data[] = {
+			SI446X_CMD_START_RX,
+			channel,
+			0,
+			0,
+			SI446X_FIXED_LENGTH,
+			SI446X_STATE_NOCHANGE, // RX Timeout
+#if SI446X_RX_QUEUE
+			SI446X_STATE_RX, // RX Valid (keep listening, the ISR queues the packet while the next one is coming in)
+#else
+			IDLE_STATE, // RX Valid
+#endif
+			SI446X_STATE_SLEEP // IDLE_STATE // RX Invalid (using SI446X_STATE_SLEEP for the INVALID_SYNC fix)
+		};
+		doAPI(data, sizeof(data), NULL, 0);
+	}
+}
+
+// Transmit the packet that's already in the FIFO
+static uint8_t txFire(uint8_t channel, si446x_state_t onTxFinish, uint8_t again)
+{
+	si446x_state_t state = getState();
+	if(state == SI446X_STATE_TX || !txLoaded) // Already transmitting or nothing to send
+		return 0;
+
+	if(state == SI446X_STATE_RX)
+	{
+		// The FIFOs are shared, if any of a new packet has been received then the loaded packet has been overwritten
+		// Leave the radio receiving that packet
+		uint8_t data[2] = {
+			SI446X_CMD_FIFO_INFO
+		};
+		doAPI(data, 1, data, sizeof(data));
+		if(data[0])
+		{
+			txLoaded = 0;
+			return 0;
+		}
+
+		// Check again once idle in case something arrived in between, the reception has been stopped so start listening again
+		setState(IDLE_STATE);
+		doAPI(data, 1, data, sizeof(data));
+		if(data[0])
+		{
+			txLoaded = 0;
+			startRX(currentChannel);
+			return 0;
+		}
+#if SI446X_FAST_TX
+		fifoDirty = 1;
+#endif
+	}
+
+#if SI446X_FAST_TX
+	if(irqAsserted())
+		interrupt2(NULL, 0, 0, 0xFF);
+#else
+	interrupt2(NULL, 0, 0, 0xFF);
+#endif
+
+	txStart(channel, onTxFinish, (again && txSent) ? SI446X_TX_RETRANSMIT : 0);
+	return 1;
+}
+
+#if SI446X_MAC || SI446X_CCA
+// Random number for backoff (8 bit xorshift)
+static uint8_t rand8(void)
+{
+	uint8_t x = randState;
+	x ^= x<<7;
+	x ^= x>>5;
+	x ^= x<<3;
+	randState = x;
+	return x;
+}
+#endif
+
+#if SI446X_CCA
+// Listen before talk, returns 1 if the channel is clear
+// Also returns 1 if the ISR has started transmitting something while backing off (MAC ACK), txPrepare() then fails without touching it
+static uint8_t channelClear(uint8_t channel)
+{
+	uint8_t settle = 0;
+	SI446X_NO_INTERRUPT()
+	{
+		si446x_state_t state = getState();
+		if(txBusy(state))
+			return 1;
+
+		// Need to be listening on the channel to measure it
+		if(state != SI446X_STATE_RX || currentChannel != channel)
+		{
+			startRX(channel);
+			settle = 1;
+		}
+	}
+
+	if(settle)
+		delay_us(SI446X_CCA_SETTLE);
+
+	int16_t rssi = Si446x_getRSSI();
+
+	// Noise makes for a good random seed
+	randState ^= (uint8_t)rssi;
+	if(!randState)
+		randState = 1;
+
+	return (rssi < SI446X_CCA_THRESHOLD);
+}
+
+uint8_t Si446x_channelBusy()
+{
+	return channelBusy;
+}
+#endif
+
+uint8_t Si446x_TX(void* packet, uint8_t len, uint8_t channel, si446x_state_t onTxFinish)
+{
+	// TODO what happens if len is 0?
+
+#if SI446X_CCA
+	channelBusy = 0;
+
+	// Listening would stop a packet that's already going out
+	si446x_state_t prevState;
+	uint8_t prevChannel;
+	SI446X_NO_INTERRUPT()
+	{
+		prevState = getState();
+		if(txBusy(prevState))
+			return 0;
+		prevChannel = currentChannel;
+	}
+
+	for(uint8_t tries=0;!channelClear(channel);tries++)
+	{
+		if(tries >= SI446X_CCA_RETRIES)
+		{
+			channelBusy = 1;
+
+			// Put the radio back to how it was before listening, unless the ISR has started sending something (MAC ACK)
+			SI446X_NO_INTERRUPT()
+			{
+				if(txBusy(getState()))
+					return 0;
+
+				if(prevState == SI446X_STATE_RX)
+				{
+					if(prevChannel != channel)
+						startRX(prevChannel);
+				}
+				else
+				{
+					if(prevState == SI446X_STATE_SPI_ACTIVE && IDLE_STATE != SI446X_STATE_SPI_ACTIVE) // Was asleep, reading the state woke it up
+						prevState = SI446X_STATE_SLEEP;
+					setState(prevState);
+				}
+			}
+			return 0;
+		}
+
+		// Random backoff, the window doubles each time
+		uint8_t slots = (rand8() & ((4<<tries) - 1)) + 1;
+		while(slots--)
+			delay_us(SI446X_CCA_SLOT);
+	}
+#endif
+
+	SI446X_NO_INTERRUPT()
+	{
+		if(!txPrepare())
+			return 0;
+		txLoad(packet, len);
+		txStart(channel, onTxFinish, 0);
+	}
+	return 1;
+}
+
+uint8_t Si446x_load(const void* packet, uint8_t len)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		if(!txPrepare())
+			return 0;
+		txLoad(packet, len);
+	}
+	return 1;
+}
+
+uint8_t Si446x_fire(uint8_t channel, si446x_state_t onTxFinish)
+{
+	uint8_t ok = 0;
+	SI446X_NO_INTERRUPT()
+	{
+		ok = txFire(channel, onTxFinish, 0);
+	}
+	return ok;
+}
+
+uint8_t Si446x_retransmit(uint8_t channel, si446x_state_t onTxFinish)
+{
+	uint8_t ok = 0;
+	SI446X_NO_INTERRUPT()
+	{
+		ok = txFire(channel, onTxFinish, 1);
+	}
+	return ok;
+}
+
+#if SI446X_TX_QUEUE
+// Load the next packet into the FIFO behind the one that's being sent, if there's room
+static void txQueuePrefill(void)
+{
+	if(!txQueueActive)
+		return;
+
+	// Only done if the radio is staying in TX_TUNE for the next packet, other states might lose the FIFO or receive into it
+	if(txQueueNext || txQueueFinish != SI446X_STATE_TX_TUNE)
+	{
+		if(enabledInterrupts[IRQ_PACKET] & _BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND))
+			phInterrupts(_BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND), 0);
+		return;
+	}
+
+	const txQueueItem_t* item = &txQueue[(uint8_t)(txQueueTail + 1) & (SI446X_TX_QUEUE - 1)];
+#if SI446X_FIXED_LENGTH
+	uint8_t size = SI446X_FIXED_LENGTH;
+#else
+	uint8_t size = item->len + 1;
+#endif
+
+	uint8_t info[2];
+	fifoInfo(info);
+	if(info[1] < size && !(enabledInterrupts[IRQ_PACKET] & _BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND)))
+	{
+		// Get an interrupt once there's room, then check again in case the room appeared while setting that up
+		setPropertyNow(SI446X_PKT_TX_THRESHOLD, size);
+		phInterrupts(_BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND), 1);
+		fifoInfo(info);
+	}
+
+	if(info[1] >= size)
+	{
+		txLoad(item->packet, item->len);
+		txQueueNext = 1;
+		if(enabledInterrupts[IRQ_PACKET] & _BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND))
+			phInterrupts(_BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND), 0);
+	}
+}
+
+// Start sending the packet at the front of the queue
+// handoff is set when the queue's last packet has just been sent, the radio is then in whatever state it was left in (txQueueFinish)
+static void txQueueStart(uint8_t handoff)
+{
+	const txQueueItem_t* item = &txQueue[txQueueTail & (SI446X_TX_QUEUE - 1)];
+
+	txQueueActive = 0;
+	if(txQueueNext) // Already loaded
+	{
+#if !SI446X_FIXED_LENGTH
+		txLength = item->len;
+#endif
+	}
+	else
+	{
+		// Left in TX_TUNE for this packet but it couldn't be loaded in time, the FIFO is empty so load it now
+		// txPrepare() would see TX_TUNE as transmitting and refuse
+		if(!(handoff && txQueueFinish == SI446X_STATE_TX_TUNE) && !txPrepare())
+			return;
+		txLoad(item->packet, item->len);
+	}
+
+	// Stay tuned if there's another packet to send
+	txQueueFinish = (txQueueCount() > 1) ? (uint8_t)SI446X_STATE_TX_TUNE : item->onTxFinish;
+	txQueueNext = 0;
+	txLoaded = 0; // FIFO might have more than one packet in it, can't retransmit
+	txStart(item->channel, (si446x_state_t)txQueueFinish, 0);
+	txQueueActive = 1;
+
+	txQueuePrefill();
+}
+
+// Packet sent interrupt, move on to the next one
+static void txQueueSent(void)
+{
+	if(!txQueueActive)
+		return;
+
+	txQueueActive = 0;
+	txQueueTail++;
+	if(txQueueCount())
+		txQueueStart(1);
+}
+
+uint8_t Si446x_TXQueue(const void* packet, uint8_t len, uint8_t channel, si446x_state_t onTxFinish)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		if(txQueueCount() >= SI446X_TX_QUEUE)
+			return 0;
+
+		if(!txQueueActive && getState() == SI446X_STATE_TX) // Something else is being sent
+			return 0;
+
+		txQueueItem_t* item = &txQueue[txQueueHead & (SI446X_TX_QUEUE - 1)];
+		item->packet = packet;
+		item->len = len;
+		item->channel = channel;
+		item->onTxFinish = onTxFinish;
+		txQueueHead++;
+
+		if(!txQueueActive)
+		{
+			// Need to know when each packet has been sent
+			if(!(enabledInterrupts[IRQ_PACKET] & _BV(SI446X_PACKET_SENT_PEND)))
+				phInterrupts(_BV(SI446X_PACKET_SENT_PEND), 1);
+			txQueueStart(0);
+		}
+	}
+	return 1;
+}
+
+uint8_t Si446x_TXQueueFree()
+{
+	uint8_t count;
+	SI446X_ATOMIC()
+	{
+		count = txQueueCount();
+	}
+	return SI446X_TX_QUEUE - count;
+}
+#endif
+
+#if SI446X_STREAM
+uint8_t Si446x_TXStream(const void* packet, uint16_t len, uint8_t channel, si446x_state_t onTxFinish)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		uint8_t lenSize = lengthFieldSize();
+		if(len > ((lenSize == 2) ? SI446X_MAX_STREAM_LEN : 255))
+			return 0;
+
+		if(!txPrepare())
+			return 0;
+
+		if(rxStreamBuff != NULL)
+			rxStreamEnd();
+
+		uint8_t lenField[2];
+		if(lenSize == 1)
+			lenField[0] = len;
+		else if(getProperty(SI446X_PKT_LEN) & SI446X_PKT_LEN_ENDIAN) // MSB first
+		{
+			lenField[0] = len>>8;
+			lenField[1] = len;
+		}
+		else
+		{
+			lenField[0] = len;
+			lenField[1] = len>>8;
+		}
+
+		// Fill the FIFO, the ISR does the rest
+		uint8_t first = MAX_PACKET_LEN + 1 - lenSize;
+		if(len < first)
+			first = len;
+
+		SI446X_ATOMIC()
+		{
+			CHIPSELECT()
+			{
+				spi_transfer_nr(SI446X_CMD_WRITE_TX_FIFO);
+				spi_transfer_block(lenField, NULL, lenSize);
+				spi_transfer_block(packet, NULL, first);
+			}
+		}
+		TRACE(SI446X_TRACE_TX_FIFO, 0, lenSize + first);
+
+#if SI446X_TX_QUEUE
+		// The queue changes the threshold
+		setPropertyNow(SI446X_PKT_TX_THRESHOLD, SI446X_STREAM_TX_THRESH);
+#endif
+
+		txStreamData = (const uint8_t*)packet + first;
+		txStreamLeft = len - first;
+		txLoaded = 0; // Didn't all fit in the FIFO, so can't be retransmitted
+
+		if(txStreamLeft)
+			phInterrupts(_BV(SI446X_TX_FIFO_ALMOST_EMPTY_PEND), 1);
+
+		setStreamLength(len);
+
+		uint8_t data[] = {
+			SI446X_CMD_START_TX,
+			channel,
+			(uint8_t)(onTxFinish<<4),
+			0,
+			0,
+			0,
+			0
+		};
+		doAPI(data, sizeof(data), NULL, 0);
+		currentChannel = channel;
+
+		// Length is used when TX starts, so it can be put back straight away for receiving
+		restoreLength();
+#if SI446X_FAST_TX
+		if(onTxFinish == SI446X_STATE_RX)
+			fifoDirty = 1;
+#endif
+	}
+	return 1;
+}
+#endif
+
+void Si446x_RX(uint8_t channel)
+{
+#if SI446X_STREAM
+	SI446X_NO_INTERRUPT()
+	{
+		if(rxStreamBuff != NULL)
+			rxStreamEnd();
+		restoreLength();
+	}
+#endif
+	startRX(channel);
+}
+
+#if SI446X_STREAM
+void Si446x_RXStream(void* buff, uint16_t size, uint8_t channel)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		uint8_t lenSize = lengthFieldSize();
+		if(size > ((lenSize == 2) ? SI446X_MAX_STREAM_LEN : 255))
+			size = (lenSize == 2) ? SI446X_MAX_STREAM_LEN : 255;
+
+		rxStreamBuff = (uint8_t*)buff;
+		rxStreamSize = size;
+		rxStreamLen = 0;
+		rxStreamSkip = lenSize;
+
+		setStreamLength(size); // Max length, longer packets are rejected
+		phInterrupts(_BV(SI446X_RX_FIFO_ALMOST_FULL_PEND), 1);
+		startRX(channel);
+	}
+}
+#endif
+
+#if SI446X_MAC
+// Send the packet in macTx, returns 0 if the radio is busy
+static uint8_t macTransmit(void)
+{
+	if(!txPrepare())
+		return 0;
+	txLoad(macTx, macTxLen);
+	txStart(macChannel, SI446X_STATE_RX, 0);
+
+	// Wait a bit longer after each try
+	macSentAt = SI446X_CB_TIMESTAMP();
+	macWait = SI446X_MAC_ACK_TIMEOUT + ((((uint32_t)SI446X_MAC_BACKOFF<<macTries) * rand8())>>8);
+	return 1;
+}
+
+// Returns 1 if this is the same packet as last time from this peer (our ACK was lost and it was sent again)
+static uint8_t macDuplicate(uint8_t src, uint8_t seq)
+{
+	for(uint8_t i=0;i<SI446X_MAC_PEERS;i++)
+	{
+		if(macPeers[i].addr == src)
+		{
+			if(macPeers[i].seq == seq)
+				return 1;
+			macPeers[i].seq = seq;
+			return 0;
+		}
+	}
+
+	// New peer, take the place of the oldest one
+	macPeers[macPeerNext].addr = src;
+	macPeers[macPeerNext].seq = seq;
+	if(++macPeerNext >= SI446X_MAC_PEERS)
+		macPeerNext = 0;
+	return 0;
+}
+
+#if SI446X_LINK_STATS
+// Find a peer, or take over the oldest one
+static si446x_link_t* linkPeer(uint8_t addr)
+{
+	for(uint8_t i=0;i<SI446X_LINK_PEERS;i++)
+	{
+		if(linkPeers[i].address == addr)
+			return &linkPeers[i];
+	}
+
+	si446x_link_t* peer = &linkPeers[linkPeerNext];
+	if(++linkPeerNext >= SI446X_LINK_PEERS)
+		linkPeerNext = 0;
+
+	memset(peer, 0, sizeof(si446x_link_t));
+	peer->address = addr;
+	return peer;
+}
+
+// Update stats for a received packet, seq is -1 for ACKs (they have the sequence number of the packet being ACKed)
+static void linkUpdate(uint8_t addr, int16_t seq, int16_t rssi)
+{
+	si446x_link_t* peer = linkPeer(addr);
+
+	if(seq >= 0)
+	{
+		uint8_t gap = (uint8_t)seq - peer->seq;
+		if(peer->seqValid)
+		{
+			if(gap == 0)
+			{
+				peer->duplicates++;
+				return;
+			}
+			if(gap <= LINK_MAX_GAP)
+				peer->lost += gap - 1;
+		}
+		peer->seq = seq;
+		peer->seqValid = 1;
+	}
+
+	// Moving average in 1/16 dBm
+	if(peer->received)
+		peer->rssiAvg += ((rssi * 16) - peer->rssiAvg) / (1<<SI446X_LINK_EWMA);
+	else
+		peer->rssiAvg = rssi * 16;
+	peer->received++;
+
+	// Histogram, halve everything once a bin fills up so it slowly forgets old readings
+	int16_t bin = (rssi - SI446X_LINK_HIST_MIN) / SI446X_LINK_HIST_WIDTH;
+	if(bin < 0)
+		bin = 0;
+	else if(bin >= SI446X_LINK_HIST_BINS)
+		bin = SI446X_LINK_HIST_BINS - 1;
+	if(++peer->histogram[bin] == 0xFF)
+	{
+		for(uint8_t i=0;i<SI446X_LINK_HIST_BINS;i++)
+			peer->histogram[i] /= 2;
+	}
+}
+
+uint8_t Si446x_linkStats(si446x_link_t* stats, uint8_t max)
+{
+	uint8_t count = 0;
+	SI446X_NO_INTERRUPT()
+	{
+		for(uint8_t i=0;i<SI446X_LINK_PEERS && count<max;i++)
+		{
+			if(linkPeers[i].received || linkPeers[i].duplicates)
+				stats[count++] = linkPeers[i];
+		}
+	}
+	return count;
+}
+
+uint16_t Si446x_linkCRCErrors()
+{
+	uint16_t errors = 0;
+	SI446X_NO_INTERRUPT()
+	{
+		errors = linkCRCErrors;
+	}
+	return errors;
+}
+
+void Si446x_linkReset()
+{
+	SI446X_NO_INTERRUPT()
+	{
+		memset(linkPeers, 0, sizeof(linkPeers));
+		for(uint8_t i=0;i<SI446X_LINK_PEERS;i++)
+			linkPeers[i].address = SI446X_MAC_BROADCAST; // Never a source address
+		linkPeerNext = 0;
+		linkCRCErrors = 0;
+	}
+}
+#endif
+
+// Valid packet interrupt with the MAC on
+static void macReceive(void)
+{
+	uint8_t len;
+	SI446X_ATOMIC()
+	{
+		CHIPSELECT()
+		{
+			spi_transfer_nr(SI446X_CMD_READ_RX_FIFO);
+			len = spi_transfer(0xFF);
+			if(len > MAX_PACKET_LEN)
+				len = MAX_PACKET_LEN;
+			spi_transfer_block(NULL, macRx, len);
+		}
+	}
+	TRACE(SI446X_TRACE_RX_FIFO, 0, len + 1);
+	int16_t rssi = isrLatchedRSSI();
+
+	uint8_t dst = macRx[MAC_DST];
+	uint8_t src = macRx[MAC_SRC];
+	uint8_t ctrl = macRx[MAC_CTRL];
+	uint8_t seq = macRx[MAC_SEQ];
+
+#if SI446X_LINK_STATS
+	// Packets for other nodes count too, the sequence number goes up for every packet the peer sends
+	if(len >= SI446X_MAC_HEADER_LEN)
+		linkUpdate(src, (ctrl & MAC_CTRL_ACK) ? -1 : seq, rssi);
+#endif
+
+	// Not for us
+	if(len < SI446X_MAC_HEADER_LEN || (dst != macAddr && dst != SI446X_MAC_BROADCAST))
+	{
+		startRX(macChannel);
+		return;
+	}
+
+	if(ctrl & MAC_CTRL_ACK)
+	{
+		startRX(macChannel);
+		if(macWaiting && src == macTx[MAC_DST] && seq == macTx[MAC_SEQ])
+		{
+			macWaiting = 0;
+			TRACE_CB(SI446X_TRACE_CB_MACSENT, SI446X_CB_MACSENT(src, 1));
+		}
+		return;
+	}
+
+	// Reply straight away, the packet has already been read out of the FIFO so the ACK can go in
+	uint8_t acked = 0;
+	if((ctrl & MAC_CTRL_ACKREQ) && dst == macAddr && txPrepare())
+	{
+		uint8_t ack[SI446X_MAC_HEADER_LEN] = {
+			src,
+			macAddr,
+			MAC_CTRL_ACK,
+			seq
+		};
+		txLoad(ack, sizeof(ack));
+		txStart(macChannel, SI446X_STATE_RX, 0);
+		acked = 1;
+	}
+	if(!acked)
+		startRX(macChannel);
+
+	if(!macDuplicate(src, seq))
+		TRACE_CB(SI446X_TRACE_CB_MACRX, SI446X_CB_MACRX(src, macRx + SI446X_MAC_HEADER_LEN, len - SI446X_MAC_HEADER_LEN, rssi));
+}
+
+void Si446x_macInit(uint8_t address, uint8_t channel)
+{
+	SI446X_NO_INTERRUPT()
+	{
+		macOn = 1;
+		macAddr = address;
+		macChannel = channel;
+		macWaiting = 0;
+		randState ^= address;
+		if(!randState)
+			randState = 1;
+		macSeq = rand8(); // So peers don't think the first packet after a reset is a duplicate
+		for(uint8_t i=0;i<SI446X_MAC_PEERS;i++)
+			macPeers[i].addr = SI446X_MAC_BROADCAST; // Never a source address
+		macPeerNext = 0;
+		startRX(channel);
+	}
+}
+
+void Si446x_macStop()
+{
+	SI446X_NO_INTERRUPT()
+	{
+		macOn = 0;
+		macWaiting = 0;
+	}
+}
+
+uint8_t Si446x_macSend(uint8_t address, const void* data, uint8_t len)
+{
+	if(len > SI446X_MAC_MAX_LEN)
+		return 0;
+
+	SI446X_NO_INTERRUPT()
+	{
+		if(!macOn || macWaiting)
+			return 0;
+
+		macTx[MAC_DST] = address;
+		macTx[MAC_SRC] = macAddr;
+		macTx[MAC_CTRL] = (address == SI446X_MAC_BROADCAST) ? 0 : MAC_CTRL_ACKREQ;
+		macTx[MAC_SEQ] = ++macSeq;
+		memcpy(macTx + SI446X_MAC_HEADER_LEN, data, len);
+		macTxLen = len + SI446X_MAC_HEADER_LEN;
+		macTries = 0;
+
+		if(!macTransmit())
+			return 0;
+		macWaiting = (address != SI446X_MAC_BROADCAST);
+	}
+	return 1;
+}
+
+void Si446x_macPoll()
+{
+	SI446X_NO_INTERRUPT()
+	{
+		if(!macWaiting || (uint32_t)(SI446X_CB_TIMESTAMP() - macSentAt) < macWait)
+			return;
+
+		if(macTries >= SI446X_MAC_RETRIES)
+		{
+			macWaiting = 0;
+			TRACE_CB(SI446X_TRACE_CB_MACSENT, SI446X_CB_MACSENT(macTx[MAC_DST], 0));
+			return;
+		}
+
+		// Radio might be busy sending an ACK, try again next time
+		if(macTransmit())
+			macTries++;
+	}
+}
+#endif
+
+#if SI446X_HOP || SI446X_SCAN
+// Work out the synth setup for a channel from FREQ_CONTROL_INTE - FREQ_CONTROL_VCOCNT_RX_ADJ and the prescaler (2 or 4)
+static void synthCalc(const uint8_t* freq, uint8_t presc, uint8_t channel, si446x_synth_t* synth)
+{
+	// PLL divider * 2^19, FRAC is always between 2^19 and 2^20 so the divider is INTE + FRAC / 2^19
+	uint32_t div = ((uint32_t)freq[0]<<19) + ((uint32_t)freq[1]<<16) + ((uint16_t)freq[2]<<8) + freq[3];
+	div += (uint32_t)channel * (uint16_t)((freq[4]<<8) | freq[5]);
+
+	uint8_t inte = (div>>19) - 1;
+	uint32_t frac = div - ((uint32_t)inte<<19);
+
+	// VCO runs at the divider * prescaler (2 for the high performance synth, 4 for low power) times the XO frequency,
+	// the target count is how many VCO cycles there are in W_SIZE XO cycles
+	uint16_t vcoCnt = ((div>>7) * (presc * freq[6]) + _BV(11))>>12;
+
+	synth->inte = inte;
+	synth->frac[0] = frac>>16;
+	synth->frac[1] = frac>>8;
+	synth->frac[2] = frac;
+	synth->vcoCnt[0] = vcoCnt>>8;
+	synth->vcoCnt[1] = vcoCnt;
+	synth->rxAdj = (int8_t)freq[7];
+	synth->channel = channel;
+}
+
+// Read what synthCalc() needs from the radio, freq must be 8 bytes, returns the prescaler
+static uint8_t synthProps(uint8_t* freq)
 {
-	if(getState() == SI446X_STATE_TX)
-		return 0;
-	setState(SI446X_STATE_SLEEP);
-	return 1;
+	// INTE, FRAC2, FRAC1, FRAC0, CHANNEL_STEP_SIZE1, CHANNEL_STEP_SIZE0, W_SIZE, VCOCNT_RX_ADJ
+	getProperties(SI446X_FREQ_CONTROL_INTE, freq, 8);
+	uint8_t band = getProperty(SI446X_MODEM_CLKGEN_BAND);
+	return (band & SI446X_CLKGEN_SY_SEL) ? 2 : 4;
 }
 
-void Si446x_read(void* buff, uint8_t len)
+// Retune while staying in RX mode
+static void rxHop(const si446x_synth_t* synth)
 {
-	SI446X_ATOMIC()
-	{
-		CHIPSELECT()
-		{
-			spi_transfer_nr(SI446X_CMD_READ_RX_FIFO);
-			for(uint8_t i=0;i<len;i++)
-				((uint8_t*)buff)[i] = spi_transfer(0xFF);
-		}
-	}
+	uint16_t vcoCnt = ((synth->vcoCnt[0]<<8) | synth->vcoCnt[1]) + synth->rxAdj;
+	uint8_t data[] = {
+		SI446X_CMD_RX_HOP,
+		synth->inte,
+		synth->frac[0],
+		synth->frac[1],
+		synth->frac[2],
+		(uint8_t)(vcoCnt>>8),
+		(uint8_t)vcoCnt
+	};
+	doAPI(data, sizeof(data), NULL, 0);
 }
-/*
-// TODO maybe
-void Si446x_write(void* buff, uint8_t len)
+#endif
+
+#if SI446X_HOP
+void Si446x_hopSynth(uint8_t channel, si446x_synth_t* synth)
 {
-	// if we are going to do this then we need dual FIFO so we can stay in RX mode while filling TX FIFO
-	// also need a public clearFIFO for TX and RX
-	// this will also allow multiple transmissions without writing FIFO again
-	// however, we wont know if the packet is corrupt until the whole thing has been transmitted/received - might run out of memory if its a large packet, unless its written to some external SPI RAM as its being received
+	uint8_t freq[8];
+	uint8_t presc = synthProps(freq);
+	synthCalc(freq, presc, channel, synth);
+}
 
-	SI446X_ATOMIC()
+uint8_t Si446x_hop(const si446x_synth_t* synth)
+{
+	uint8_t ok = 0;
+
+	SI446X_NO_INTERRUPT()
 	{
-		// Load data to FIFO
-		CHIPSELECT()
+		si446x_state_t state = getState();
+		if(state == SI446X_STATE_RX)
 		{
-			spi_transfer_nr(SI446X_CMD_WRITE_TX_FIFO);
-			for(uint8_t i=0;i<len;i++)
-				spi_transfer_nr(((uint8_t*)buff)[i]);
+			rxHop(synth);
+			ok = 1;
+		}
+		else if(state == SI446X_STATE_TX)
+		{
+			uint8_t data[] = {
+				SI446X_CMD_TX_HOP,
+				synth->inte,
+				synth->frac[0],
+				synth->frac[1],
+				synth->frac[2],
+				synth->vcoCnt[0],
+				synth->vcoCnt[1],
+				0, // PLL settle time in us, MSB
+				TX_HOP_SETTLE
+			};
+			doAPI(data, sizeof(data), NULL, 0);
+			ok = 1;
 		}
+
+		if(ok)
+			currentChannel = synth->channel;
 	}
-}
-*/
 
-#include <stdio.h>
+	return ok;
+}
+#endif
 
-uint8_t Si446x_TX(void* packet, uint8_t len, uint8_t channel, si446x_state_t onTxFinish)
+#if SI446X_SCAN
+// Wait for RX_TUNE to finish, FRR B is always the current state
+static void waitRXTune(void)
 {
-	// TODO what happens if len is 0?
+	for(uint8_t i=0;i<100 && getFRR(SI446X_CMD_READ_FRR_B) != SI446X_STATE_RX;i++)
+		delay_us(10);
+}
 
-#if SI446X_FIXED_LENGTH
-	// Stop the unused parameter warning
-	((void)(len));
-#endif
+// Sweep channels and pass the raw peak and mean RSSI of each one to each(), returns 0 if already transmitting
+// Interrupts are only held off while hopping and reading, the ISR ignores packet and modem interrupts until the sweep is done
+static uint8_t scanSweep(uint8_t first, uint8_t count, uint8_t samples, void (*each)(uint8_t idx, uint8_t peak, uint8_t mean))
+{
+	uint8_t freq[8];
+	si446x_synth_t synth;
+	uint8_t presc;
+	uint8_t rssiControl;
 
 	SI446X_NO_INTERRUPT()
 	{
-		if(getState() == SI446X_STATE_TX) // Already transmitting
+		if(txBusy(getState()))
 			return 0;
 
-		// TODO collision avoid or maybe just do collision detect (RSSI jump)
+		scanActive = 1;
+		presc = synthProps(freq);
 
-		setState(IDLE_STATE);
-		clearFIFO();
-		interrupt2(NULL, 0, 0, 0xFF);
+		// With the latch off the latched RSSI FRR follows the current RSSI, so each reading is a single FRR read instead of GET_MODEM_STATUS
+		rssiControl = getProperty(SI446X_MODEM_RSSI_CONTROL);
+		setPropertyNow(SI446X_MODEM_RSSI_CONTROL, rssiControl & ~SI446X_RSSI_LATCH);
 
-		SI446X_ATOMIC()
+		// Stay in RX if something is received, the packet handler isn't being used here
+		uint8_t data[] = {
+			SI446X_CMD_START_RX,
+			first,
+			0,
+			0,
+			0,
+			SI446X_STATE_NOCHANGE, // RX Timeout
+			SI446X_STATE_RX, // RX Valid
+			SI446X_STATE_RX // RX Invalid
+		};
+		doAPI(data, sizeof(data), NULL, 0);
+		waitRXTune();
+	}
+
+	for(uint8_t i=0;i<count;i++)
+	{
+		// Only the first channel needs the full tune and VCO calibration
+		if(i)
 		{
-			// Load data to FIFO
-			CHIPSELECT()
+			synthCalc(freq, presc, first + i, &synth);
+			SI446X_NO_INTERRUPT()
 			{
-				spi_transfer_nr(SI446X_CMD_WRITE_TX_FIFO);
-#if !SI446X_FIXED_LENGTH
-				spi_transfer_nr(len);
-				for(uint8_t i=0;i<len;i++)
-					spi_transfer_nr(((uint8_t*)packet)[i]);
-#else
-				for(uint8_t i=0;i<SI446X_FIXED_LENGTH;i++)
-					spi_transfer_nr(((uint8_t*)packet)[i]);
-#endif
+				rxHop(&synth);
+				waitRXTune();
 			}
 		}
 
-#if !SI446X_FIXED_LENGTH
-		// Set packet length
-		setProperty(SI446X_PKT_FIELD_2_LENGTH_LOW, len);
+		delay_us(SI446X_SCAN_SETTLE);
+
+		// Current RSSI, averaged by the radio as set by MODEM_RSSI_CONTROL
+		uint8_t peak = 0;
+		uint16_t sum = 0;
+		for(uint8_t s=0;s<samples;s++)
+		{
+			uint8_t rssi = getFRR(SI446X_CMD_READ_FRR_A);
+			if(rssi > peak)
+				peak = rssi;
+			sum += rssi;
+		}
+
+		each(i, peak, sum / samples);
+	}
+
+	SI446X_NO_INTERRUPT()
+	{
+		setPropertyNow(SI446X_MODEM_RSSI_CONTROL, rssiControl);
+
+		// Leave the radio like it is after receiving a packet
+		setState(IDLE_STATE);
+		if(txLoaded)
+			clearRxFIFO();
+		else
+			clearFIFO();
+#if SI446X_FAST_TX
+		fifoDirty = 1;
 #endif
+		interrupt2(NULL, 0, 0, 0xFF);
+		currentChannel = first + count - 1;
+		scanActive = 0;
+	}
 
-		// Begin transmit
-		uint8_t data[] = {
-			SI446X_CMD_START_TX,
-			channel,
-			(uint8_t)(onTxFinish<<4),
-			0,
-			SI446X_FIXED_LENGTH,
-			0,
-			0
-		};
-		doAPI(data, sizeof(data), NULL, 0);
+	scanSweeps++;
+	return 1;
+}
 
-#if !SI446X_FIXED_LENGTH
-		// Reset packet length back to max for receive mode
-		setProperty(SI446X_PKT_FIELD_2_LENGTH_LOW, MAX_PACKET_LEN);
+// RSSI in dBm, the bottom few values are clamped so it fits in an int8_t
+static int8_t scanDBm(uint8_t raw)
+{
+	if(raw < 12)
+		return -128;
+	return rssi_dBm(raw);
+}
+
+static si446x_scan_t* scanResults;
+
+static void scanStore(uint8_t idx, uint8_t peak, uint8_t mean)
+{
+	scanResults[idx].peak = scanDBm(peak);
+	scanResults[idx].mean = scanDBm(mean);
+}
+
+uint8_t Si446x_scan(uint8_t first, uint8_t count, uint8_t samples, si446x_scan_t* results)
+{
+	if(!count || !samples)
+		return 1;
+
+	scanResults = results;
+	return scanSweep(first, count, samples, scanStore);
+}
+
+uint16_t Si446x_scanRate()
+{
+	uint32_t now = SI446X_CB_TIMESTAMP();
+	uint32_t elapsed = now - scanSince;
+	uint16_t rate = elapsed ? ((uint32_t)scanSweeps * 1000) / elapsed : 0;
+	scanSweeps = 0;
+	scanSince = now;
+	return rate;
+}
 #endif
+
+#if SI446X_WATERFALL
+static int8_t* wfRow; // Last row, for delta encoding
+static uint8_t wfFirst;
+static uint8_t wfCount;
+static uint8_t wfSamples;
+static uint8_t wfRows; // Rows since the last keyframe, 0 = next row is a keyframe
+static uint32_t wfTime; // Timestamp of the last row
+static uint8_t wfBuff[16]; // Output is passed to the callback in chunks of this size
+static uint8_t wfLen;
+
+static void wfFlush(void)
+{
+	if(wfLen)
+	{
+		SI446X_CB_WATERFALL(wfBuff, wfLen);
+		wfLen = 0;
+	}
+}
+
+static void wfPut(uint8_t data)
+{
+	wfBuff[wfLen++] = data;
+	if(wfLen == sizeof(wfBuff))
+		wfFlush();
+}
+
+static void wfBin(uint8_t idx, uint8_t peak, uint8_t mean)
+{
+	(void)(mean);
+	int8_t rssi = scanDBm(peak);
+	wfPut(wfRows ? (uint8_t)(rssi - wfRow[idx]) : (uint8_t)rssi);
+	wfRow[idx] = rssi;
+}
+
+void Si446x_waterfallStart(uint8_t first, uint8_t count, uint8_t samples, int8_t* row)
+{
+	uint8_t header[SI446X_WATERFALL_HEADER_LEN] = {
+		'S', 'I', 'W', 'F',
+		SI446X_WATERFALL_VERSION,
+		SI446X_WATERFALL_HEADER_LEN,
+		first,
+		count,
+		samples,
+		SI446X_WATERFALL_KEYFRAME,
+		(uint8_t)SI446X_SCAN_SETTLE,
+		(uint8_t)(SI446X_SCAN_SETTLE>>8)
+	};
+
+	// Frequency plan and modem profile, so the host can work out the frequencies and data rate
+	getProperties(SI446X_FREQ_CONTROL_INTE, header + 12, 8);
+	header[20] = getProperty(SI446X_MODEM_CLKGEN_BAND);
+	getProperties(SI446X_MODEM_MOD_TYPE, header + 21, 12);
+
+	wfRow = (count && samples) ? row : NULL;
+	wfFirst = first;
+	wfCount = count;
+	wfSamples = samples;
+	wfRows = 0;
+	wfLen = 0;
+
+	SI446X_CB_WATERFALL(header, sizeof(header));
+}
+
+uint8_t Si446x_waterfallRow()
+{
+	if(!wfRow)
+		return 0;
+
+	uint32_t now = SI446X_CB_TIMESTAMP();
+	uint32_t elapsed = now - wfTime;
+
+	// Time since the last row has to fit in 2 bytes
+	if(wfRows >= SI446X_WATERFALL_KEYFRAME || elapsed > 0xFFFF)
+		wfRows = 0;
+
+	if(!wfRows)
+	{
+		wfPut(SI446X_WATERFALL_KEY);
+		for(uint8_t i=0;i<4;i++)
+			wfPut(now>>(i * 8));
+	}
+	else
+	{
+		wfPut(SI446X_WATERFALL_DELTA);
+		wfPut(elapsed);
+		wfPut(elapsed>>8);
+	}
+
+	// The row marker is still in the buffer (the last row was flushed), drop it if the radio is busy
+	if(!scanSweep(wfFirst, wfCount, wfSamples, wfBin))
+	{
+		wfLen = 0;
+		return 0;
 	}
+	wfFlush();
+
+	wfTime = now;
+	wfRows++;
 	return 1;
 }
+#endif
 
-void Si446x_RX(uint8_t channel)
+#if SI446X_HOP
+void Si446x_setupRXHop(si446x_rxhop_t mode, uint8_t rssiTimeout, int16_t rssiThreshold, const uint8_t* channels, uint8_t count)
 {
+	if(count > SI446X_RX_HOP_TABLE_MAX)
+		count = SI446X_RX_HOP_TABLE_MAX;
+	else if(count == 0)
+		mode = SI446X_RXHOP_OFF;
+
 	SI446X_NO_INTERRUPT()
 	{
-		setState(IDLE_STATE);
-		clearFIFO();
-		//fix_invalidSync_irq(0);
-		//Si446x_setupCallback(SI446X_CBS_INVALIDSYNC, 0);
-		//setProperty(SI446X_PKT_FIELD_2_LENGTH_LOW, MAX_PACKET_LEN); // TODO ?
-		interrupt2(NULL, 0, 0, 0xFF); // TODO needed?
+		propBegin();
 
-		// TODO RX timeout to sleep if WUT LDC enabled
+		if(mode != SI446X_RXHOP_OFF)
+		{
+			// Table, 12 entries at a time
+			uint8_t buff[12];
+			for(uint8_t i=0;i<count;i+=sizeof(buff))
+			{
+				uint8_t len = count - i;
+				if(len > sizeof(buff))
+					len = sizeof(buff);
+				memcpy(buff, channels + i, len);
+				setProperties(SI446X_RX_HOP_TABLE_ENTRY_0 + i, buff, len);
+			}
+
+			// MODEM_RSSI_THRESH is in 0.5dB steps from -134dBm
+			if(rssiThreshold < -134)
+				rssiThreshold = -134;
+			else if(rssiThreshold > -7)
+				rssiThreshold = -7;
+			setProperty(SI446X_MODEM_RSSI_THRESH, (rssiThreshold + 134) * 2);
+		}
 
+		// Turn hopping on (or off) last, once the table is there
 		uint8_t data[] = {
-			SI446X_CMD_START_RX,
-			channel,
-			0,
-			0,
-			SI446X_FIXED_LENGTH,
-			SI446X_STATE_NOCHANGE, // RX Timeout
-			IDLE_STATE, // RX Valid
-			SI446X_STATE_SLEEP // IDLE_STATE // RX Invalid (using SI446X_STATE_SLEEP for the INVALID_SYNC fix)
+			(uint8_t)(mode | (rssiTimeout & 0x0F)),
+			count
 		};
-		doAPI(data, sizeof(data), NULL, 0);
+		setProperties(SI446X_RX_HOP_CONTROL, data, (mode != SI446X_RXHOP_OFF) ? 2 : 1);
+
+		propCommit();
+
+		rxHopping = (mode != SI446X_RXHOP_OFF);
 	}
 }
+#endif
 
 uint16_t Si446x_adc_gpio(uint8_t pin)
 {
@@ -883,6 +3548,21 @@ uint8_t Si446x_readGPIO()
 	return states;
 }
 
+void Si446x_beginProperties()
+{
+	propBegin();
+}
+
+void Si446x_setProperty(uint16_t prop, uint8_t value)
+{
+	setProperty(prop, value);
+}
+
+void Si446x_commitProperties()
+{
+	propCommit();
+}
+
 uint8_t Si446x_dump(void* buff, uint8_t group)
 {
 	static const uint8_t groupSizes[] PROGMEM = {
@@ -923,24 +3603,85 @@ uint8_t Si446x_dump(void* buff, uint8_t group)
 		uint8_t count = length - i;
 		if(count > 16)
 			count = 16;
-		getProperties((group<<8) | i, ((uint8_t*)buff) + i, count);
+		readProperties((group<<8) | i, ((uint8_t*)buff) + i, count);
 	}
 	
 	return length;
 }
 
-#if defined(ARDUINO) || SI446X_INTERRUPTS == 0
-void Si446x_SERVICE()
-#else
-ISR(INT_VECTOR)
+#if SI446X_ASYNC
+uint8_t Si446x_submit(si446x_cmd_t* cmd, const void* data, uint8_t len, void* out, uint8_t outLen, void (*callback)(si446x_cmd_t* cmd))
+{
+	if(len == 0 || len > sizeof(cmd->data) || outLen > 16)
+		return 0;
+
+	SI446X_NO_INTERRUPT()
+	{
+		// Already in the queue, looked for instead of trusting cmd->status so the struct doesn't need to be cleared first
+		for(si446x_cmd_t* queued = cmdHead;queued != NULL;queued = queued->next)
+		{
+			if(queued == cmd)
+				return 0;
+		}
+
+		memcpy(cmd->data, data, len);
+		cmd->len = len;
+		cmd->out = out;
+		cmd->outLen = out != NULL ? outLen : 0;
+		cmd->callback = callback;
+		cmd->status = SI446X_ASYNC_QUEUED;
+		cmd->next = NULL;
+
+#if SI446X_PROP_CACHE
+		// Anything that reads properties will wait for this to be sent first, so the cache can be updated now
+		if(cmd->data[0] == SI446X_CMD_SET_PROPERTY && len >= 4 && cmd->data[2] <= len - 4)
+			cacheSet((cmd->data[1]<<8) | cmd->data[3], cmd->data + 4, cmd->data[2]);
+		else if(cmd->data[0] == SI446X_CMD_POWER_UP)
+			cacheClear();
+#endif
+
+		SI446X_ATOMIC()
+		{
+			if(cmdTail != NULL)
+				cmdTail->next = cmd;
+			else
+				cmdHead = cmd;
+			cmdTail = cmd;
+			cmdCount++;
+		}
+	}
+	return 1;
+}
+
+uint8_t Si446x_poll()
+{
+	uint8_t count;
+	SI446X_NO_INTERRUPT()
+	{
+		while(asyncStep());
+	}
+	SI446X_ATOMIC()
+	{
+		count = cmdCount;
+	}
+	return count;
+}
 #endif
+
+// Handle whatever interrupts are pending, ran by the ISR
+static void isrRun(void)
 {
-#if defined(ARDUINO) && (SI446X_INTERRUPTS == 1 || SI446X_INT_SPI_COMMS == 1)
-	isrBusy = 1;
+	STAT_ADD(isrCount, 1);
+#if SI446X_ASYNC || SI446X_PROP_BATCH
+	inISR = 1;
 #endif
 
 	uint8_t interrupts[8];
+#if SI446X_FRR_ISR
+	interruptFRR(interrupts);
+#else
 	interrupt(interrupts);
+#endif
 
 	// TODO remove
 	//SI446X_CB_DEBUG(interrupts);
@@ -951,13 +3692,25 @@ ISR(INT_VECTOR)
 	interrupts[2] &= enabledInterrupts[IRQ_PACKET];
 	interrupts[4] &= enabledInterrupts[IRQ_MODEM];
 	interrupts[6] &= enabledInterrupts[IRQ_CHIP];
+	TRACE(SI446X_TRACE_ISR, interrupts[2], (interrupts[4]<<8) | interrupts[6]);
+
+#if SI446X_SCAN
+	// Anything picked up during a sweep is thrown away once it's finished
+	if(scanActive)
+	{
+		if(interrupts[2] & ((1<<SI446X_PACKET_RX_PEND) | (1<<SI446X_CRC_ERROR_PEND)))
+			txLoaded = 0;
+		interrupts[2] = 0;
+		interrupts[4] = 0;
+	}
+#endif
 
 	// Valid PREAMBLE and SYNC, packet data now begins
 	if(interrupts[4] & (1<<SI446X_SYNC_DETECT_PEND))
 	{
 		//fix_invalidSync_irq(1);
 //		Si446x_setupCallback(SI446X_CBS_INVALIDSYNC, 1); // Enable INVALID_SYNC when a new packet starts, sometimes a corrupted packet will mess the radio up
-		SI446X_CB_RXBEGIN(getLatchedRSSI());
+		TRACE_CB(SI446X_TRACE_CB_RXBEGIN, SI446X_CB_RXBEGIN(isrLatchedRSSI()));
 	}
 /*
 	// Disable INVALID_SYNC
@@ -984,16 +3737,76 @@ ISR(INT_VECTOR)
 		SI446X_CB_ADDRMISS();
 #endif
 
+#if SI446X_STREAM
+	// Keep the FIFO going while a big packet is on the air
+	if((interrupts[2] & (1<<SI446X_TX_FIFO_ALMOST_EMPTY_PEND)) && txStreamLeft)
+		txStreamFill();
+	if((interrupts[2] & (1<<SI446X_RX_FIFO_ALMOST_FULL_PEND)) && rxStreamBuff != NULL)
+		rxStreamDrain();
+#endif
+
+#if SI446X_TX_QUEUE
+	// Room for the next queued packet
+	if(interrupts[2] & (1<<SI446X_TX_FIFO_ALMOST_EMPTY_PEND))
+		txQueuePrefill();
+#endif
+
+	// The FIFOs are shared, so a received packet (valid or not) overwrites anything loaded for transmitting
+	if(interrupts[2] & ((1<<SI446X_PACKET_RX_PEND) | (1<<SI446X_CRC_ERROR_PEND)))
+		txLoaded = 0;
+
 	// Valid packet
+#if SI446X_STREAM
+	if((interrupts[2] & (1<<SI446X_PACKET_RX_PEND)) && rxStreamBuff != NULL)
+	{
+		rxStreamDrain();
+		rxStreamEnd();
+		TRACE_CB(SI446X_TRACE_CB_RXSTREAM, SI446X_CB_RXSTREAM(rxStreamLen, isrLatchedRSSI()));
+	}
+	else
+#endif
+#if SI446X_MAC
+	if((interrupts[2] & (1<<SI446X_PACKET_RX_PEND)) && macOn)
+		macReceive();
+	else
+#endif
 	if(interrupts[2] & (1<<SI446X_PACKET_RX_PEND))
 	{
+#if SI446X_HOP
+		if(rxHopping)
+		{
+			// The radio stays on the channel the packet arrived on
+			uint8_t data[2] = {
+				SI446X_CMD_REQUEST_DEVICE_STATE
+			};
+			doAPI(data, 1, data, sizeof(data));
+			currentChannel = data[1];
+			TRACE_CB(SI446X_TRACE_CB_RXCHANNEL, SI446X_CB_RXCHANNEL(data[1]));
+		}
+#endif
+
+#if SI446X_RX_QUEUE
+		queuePush();
+#else
+#if SI446X_RX_POOL
+		si446x_packet_t* packet = poolTake();
+		if(packet != NULL)
+		{
+			readPacket(packet);
+			TRACE_CB(SI446X_TRACE_CB_RXPACKET, SI446X_CB_RXPACKET(packet));
+		}
+		else // Pool is empty, leave the packet in the FIFO
+#endif
+		{
 #if !SI446X_FIXED_LENGTH
-		uint8_t len = 0;
-		Si446x_read(&len, 1);
+			uint8_t len = 0;
+			Si446x_read(&len, 1);
 #else
-		uint8_t len = SI446X_FIXED_LENGTH;
+			uint8_t len = SI446X_FIXED_LENGTH;
+#endif
+			TRACE_CB(SI446X_TRACE_CB_RXCOMPLETE, SI446X_CB_RXCOMPLETE(len, isrLatchedRSSI()));
+		}
 #endif
-		SI446X_CB_RXCOMPLETE(len, getLatchedRSSI());
 	}
 
 	// Corrupted packet
@@ -1001,24 +3814,78 @@ ISR(INT_VECTOR)
 	// This will not be called if the address missed, but the packet passed CRC
 	if(interrupts[2] & (1<<SI446X_CRC_ERROR_PEND))
 	{
+#if SI446X_STREAM
+		if(rxStreamBuff != NULL)
+			rxStreamEnd();
+#endif
 #if IDLE_STATE == SI446X_STATE_READY
-		if(getState() == SI446X_STATE_SPI_ACTIVE)
+		if(isrGetState() == SI446X_STATE_SPI_ACTIVE)
 			setState(IDLE_STATE); // We're in sleep mode (acually, we're now in SPI active mode) after an invalid packet to fix the INVALID_SYNC issue
 #endif
-		SI446X_CB_RXINVALID(getLatchedRSSI()); // TODO remove RSSI stuff for invalid packets, entering SLEEP mode looses the latched value?
+		TRACE_CB(SI446X_TRACE_CB_RXINVALID, SI446X_CB_RXINVALID(isrLatchedRSSI())); // TODO remove RSSI stuff for invalid packets, entering SLEEP mode looses the latched value?
+#if SI446X_MAC
+		if(macOn)
+		{
+#if SI446X_LINK_STATS
+			linkCRCErrors++;
+#endif
+			startRX(macChannel); // Keep listening
+		}
+#endif
 	}
 
 	// Packet sent
 	if(interrupts[2] & (1<<SI446X_PACKET_SENT_PEND))
-		SI446X_CB_SENT();
+	{
+#if SI446X_TX_QUEUE
+		txQueueSent();
+#endif
+		TRACE_CB(SI446X_TRACE_CB_SENT, SI446X_CB_SENT());
+	}
 
 	if(interrupts[6] & (1<<SI446X_LOW_BATT_PEND))
-		SI446X_CB_LOWBATT();
+		TRACE_CB(SI446X_TRACE_CB_LOWBATT, SI446X_CB_LOWBATT());
 
 	if(interrupts[6] & (1<<SI446X_WUT_PEND))
-		SI446X_CB_WUT();
+		TRACE_CB(SI446X_TRACE_CB_WUT, SI446X_CB_WUT());
+
+#if SI446X_ASYNC || SI446X_PROP_BATCH
+	inISR = 0;
+#endif
+	TRACE(SI446X_TRACE_ISR_END, 0, 0);
+}
+
+#if defined(ARDUINO) || SI446X_HAL != SI446X_HAL_AVR || SI446X_INTERRUPTS == 0
+void Si446x_SERVICE()
+#else
+ISR(INT_VECTOR)
+#endif
+{
+#if defined(ARDUINO) && (SI446X_INTERRUPTS == 1 || SI446X_INT_SPI_COMMS == 1)
+	isrBusy = 1;
+#elif !defined(ARDUINO) && SI446X_HAL != SI446X_HAL_AVR
+	// Nothing to do if NIRQ isn't asserted, saves a GET_INT_STATUS when polling
+	if(si446x_hal_irq())
+		return;
+	si446x_hal_lock();
+#endif
+
+#if SI446X_FRR_ISR && defined(ARDUINO)
+	// The Arduino pin interrupt is on the falling edge, if something became pending after the FRRs were read then NIRQ
+	// will have stayed low and there won't be another edge, so go round again
+	uint8_t pending;
+	do
+	{
+		isrRun();
+		pending = (waitForResponse(NULL, 0, 1) && irqAsserted());
+	} while(pending);
+#else
+	isrRun();
+#endif
 
 #if defined(ARDUINO) && (SI446X_INTERRUPTS == 1 || SI446X_INT_SPI_COMMS == 1)
 	isrBusy = 0;
+#elif !defined(ARDUINO) && SI446X_HAL != SI446X_HAL_AVR
+	si446x_hal_unlock();
 #endif
 }
@@ -17,6 +17,10 @@
 
 #include "Si446x_config.h"
 
+#if !defined(ARDUINO) && SI446X_HAL != SI446X_HAL_AVR && !defined(_BV)
+#define _BV(bit) (1 << (bit))
+#endif
+
 // Address matching doesnt really work very well as the FIFO still needs to be
 // manually cleared after receiving a packet, so the MCU still needs to wakeup and
 // do stuff instead of the radio doing things automatically :/
@@ -25,8 +29,17 @@
 #endif
 
 #define SI446X_MAX_PACKET_LEN	128 ///< Maximum packet length
+#define SI446X_MAC_HEADER_LEN	4 ///< Bytes used by the MAC layer at the start of each packet (destination, source, control, sequence)
+#define SI446X_MAC_MAX_LEN		(SI446X_MAX_PACKET_LEN - SI446X_MAC_HEADER_LEN) ///< Maximum data length for ::Si446x_macSend()
+#define SI446X_MAC_BROADCAST	0xFF ///< MAC address that all nodes receive, broadcasts are not ACKed
+#define SI446X_MAX_STREAM_LEN	8191 ///< Maximum packet length for ::Si446x_TXStream() and ::Si446x_RXStream() with a 2 byte length field, 255 with a 1 byte length field
+#define SI446X_WATERFALL_VERSION	1 ///< Waterfall stream format version, see ::Si446x_waterfallStart()
+#define SI446X_WATERFALL_HEADER_LEN	33 ///< Waterfall stream header length
+#define SI446X_WATERFALL_KEY		'K' ///< Waterfall row with absolute RSSI values
+#define SI446X_WATERFALL_DELTA		'D' ///< Waterfall row with RSSI changes since the last row
 
 #define SI446X_MAX_TX_POWER		127 ///< Maximum TX power (+20dBm/100mW)
+#define SI446X_STATS_OPCODES	0x40 ///< Number of command opcodes ::si446x_stats_t keeps CTS poll counts for, all commands that need CTS are below this
 
 #define SI446X_WUT_RUN	1 ///< Wake the microcontroller when the WUT expires
 #define SI446X_WUT_BATT	2 ///< Take a battery measurement when the WUT expires
@@ -249,6 +262,173 @@ typedef enum
 	SI446X_STATE_RX			= 0x08
 } si446x_state_t;
 
+/**
+* @brief Asynchronous command status, see ::si446x_cmd_t
+*/
+typedef enum
+{
+	SI446X_ASYNC_IDLE		= 0x00, ///< Not queued
+	SI446X_ASYNC_QUEUED		= 0x01, ///< Waiting for commands before it to finish
+	SI446X_ASYNC_SENT		= 0x02, ///< Sent to the radio, waiting for it to finish
+	SI446X_ASYNC_DONE		= 0x03, ///< Finished, response (if any) has been read
+	SI446X_ASYNC_TIMEOUT	= 0x04 ///< The radio didn't respond in time
+} si446x_async_t;
+
+typedef struct si446x_cmd_t si446x_cmd_t;
+
+/**
+* @brief Command for ::Si446x_submit()
+*
+* The struct belongs to the caller and must not be changed or go out of scope until its status is ::SI446X_ASYNC_DONE or ::SI446X_ASYNC_TIMEOUT
+*/
+struct si446x_cmd_t {
+	uint8_t data[16]; ///< Command and arguments
+	uint8_t len; ///< Length of data
+	void* out; ///< Where to put the response, NULL if not needed
+	uint8_t outLen; ///< Length of response to read
+	void (*callback)(si446x_cmd_t* cmd); ///< Ran when the command has finished, can be NULL
+	volatile si446x_async_t status; ///< Command status
+	si446x_cmd_t* next; ///< Used by the library
+};
+
+/**
+* @brief Synthesizer setup for a channel, see ::Si446x_hopSynth() and ::Si446x_hop()
+*/
+typedef struct {
+	uint8_t inte; ///< Integer part of the PLL divider
+	uint8_t frac[3]; ///< Fractional part of the PLL divider, MSB first
+	uint8_t vcoCnt[2]; ///< VCO calibration target count, MSB first
+	int8_t rxAdj; ///< VCO count adjustment in RX mode (FREQ_CONTROL_VCOCNT_RX_ADJ)
+	uint8_t channel; ///< Channel number
+} si446x_synth_t;
+
+/**
+* @brief Automatic RX hopping conditions, see ::Si446x_setupRXHop()
+*/
+typedef enum
+{
+	SI446X_RXHOP_OFF			= 0x00, ///< Automatic hopping off
+	SI446X_RXHOP_PREAMBLE		= 0x10, ///< Hop if a preamble isn't found in time
+	SI446X_RXHOP_RSSI			= 0x20, ///< Hop if the RSSI doesn't go above the threshold in time
+	SI446X_RXHOP_RSSI_PREAMBLE	= 0x30 ///< Hop on either of the above
+} si446x_rxhop_t;
+
+/**
+* @brief Stored IRCAL result, see ::SI446X_IRCAL_CACHE in Si446x_config.h
+*/
+typedef struct {
+	uint8_t amp; ///< IRCAL_AMP from IRCAL_MANUAL
+	uint8_t ph; ///< IRCAL_PH from IRCAL_MANUAL
+	int8_t temperature; ///< Radio temperature in C when the calibration was done
+	uint16_t configSum; ///< Checksum of the startup config, a result for a different config (or erased EEPROM) isn't used
+} si446x_ircal_t;
+
+/**
+* @brief Received packet from the pool or queue, see ::SI446X_RX_POOL and ::SI446X_RX_QUEUE in Si446x_config.h
+*/
+typedef struct {
+	uint32_t timestamp; ///< When the packet arrived, from the ::SI446X_CB_TIMESTAMP() callback (millis() on Arduino, must be provided on other platforms)
+	int16_t rssi; ///< Latched RSSI in dBm
+	uint8_t channel; ///< Channel the packet arrived on
+	uint8_t length; ///< Number of bytes in \p data
+	uint8_t data[SI446X_MAX_PACKET_LEN]; ///< Packet data
+} si446x_packet_t;
+
+/**
+* @brief Receive queue counters, see ::Si446x_queueStats()
+*/
+typedef struct {
+	uint8_t count; ///< Packets waiting in the queue
+	uint8_t highWater; ///< Most packets there has been waiting at once
+	uint16_t dropped; ///< Packets dropped because the queue was full
+} si446x_queue_stats_t;
+
+/**
+* @brief Hot path counters, see ::Si446x_getStats()
+*
+* Counters wrap around, use ::Si446x_resetStats() to start again.
+*/
+typedef struct {
+	uint32_t spiBytes; ///< SPI bytes transferred
+	uint32_t selects; ///< Chip select cycles
+	uint32_t isrCount; ///< Times the ISR (or ::Si446x_SERVICE()) has ran
+	uint16_t timeouts; ///< Commands that timed out waiting for CTS (::SI446X_CB_CMDTIMEOUT())
+	uint16_t ctsMaxWait; ///< Longest wait for CTS in polls
+	uint8_t ctsMaxOpcode; ///< Command that the longest wait was for
+	uint16_t ctsPolls[SI446X_STATS_OPCODES]; ///< CTS polls that found the radio busy, for each command opcode. Each poll is a READ_CMD_BUFF and a 10us delay, or a 1us delay when using the CTS GPIO pin
+} si446x_stats_t;
+
+/**
+* @brief Link quality of a peer, see ::Si446x_linkStats()
+*
+* Packet error rate can be worked out as \p lost / (\p received + \p lost). Counters wrap around, use ::Si446x_linkReset() to start again.
+*/
+typedef struct {
+	uint8_t address; ///< MAC address of the peer
+	uint8_t seq; ///< Last sequence number
+	uint8_t seqValid; ///< 1 once a packet with a sequence number has arrived (ACKs don't have their own)
+	int16_t rssiAvg; ///< Moving average of the RSSI in 1/16 dBm (divide by 16 for dBm)
+	uint16_t received; ///< Packets received, including ACKs and packets for other nodes
+	uint16_t lost; ///< Packets missed, from gaps in the sequence numbers
+	uint16_t duplicates; ///< Packets received more than once (retries after a lost ACK)
+	uint8_t histogram[SI446X_LINK_HIST_BINS]; ///< RSSI histogram, see ::SI446X_LINK_HIST_MIN and ::SI446X_LINK_HIST_WIDTH. Bins are halved when one of them reaches 255
+} si446x_link_t;
+
+/**
+* @brief RSSI of a channel from a spectrum sweep, see ::Si446x_scan()
+*/
+typedef struct {
+	int8_t peak; ///< Highest RSSI in dBm
+	int8_t mean; ///< Average RSSI in dBm
+} si446x_scan_t;
+
+/**
+* @brief Trace record types, see ::si446x_trace_t
+*/
+typedef enum
+{
+	SI446X_TRACE_API		= 0x01, ///< Command about to be sent, \p arg is the opcode and \p data is the length
+	SI446X_TRACE_API_END	= 0x02, ///< Command finished, \p arg is the opcode and \p data is 0 if it timed out waiting for CTS
+	SI446X_TRACE_STATE		= 0x03, ///< State change, \p arg is the new ::si446x_state_t
+	SI446X_TRACE_TX_FIFO	= 0x04, ///< Bytes written to the TX FIFO in \p data
+	SI446X_TRACE_RX_FIFO	= 0x05, ///< Bytes read from the RX FIFO in \p data
+	SI446X_TRACE_ISR		= 0x06, ///< ISR started, \p arg is the packet handler interrupts and \p data is the modem interrupts << 8 | chip interrupts (only the enabled ones)
+	SI446X_TRACE_ISR_END	= 0x07, ///< ISR finished
+	SI446X_TRACE_CB			= 0x08, ///< Callback started, \p arg is a ::si446x_trace_cb_t
+	SI446X_TRACE_CB_END		= 0x09 ///< Callback returned, \p arg is a ::si446x_trace_cb_t
+} si446x_trace_event_t;
+
+/**
+* @brief Callbacks in ::SI446X_TRACE_CB and ::SI446X_TRACE_CB_END trace records
+*/
+typedef enum
+{
+	SI446X_TRACE_CB_CMDTIMEOUT	= 0x00, ///< ::SI446X_CB_CMDTIMEOUT()
+	SI446X_TRACE_CB_RXBEGIN		= 0x01, ///< ::SI446X_CB_RXBEGIN()
+	SI446X_TRACE_CB_RXCOMPLETE	= 0x02, ///< ::SI446X_CB_RXCOMPLETE()
+	SI446X_TRACE_CB_RXINVALID	= 0x03, ///< ::SI446X_CB_RXINVALID()
+	SI446X_TRACE_CB_SENT		= 0x04, ///< ::SI446X_CB_SENT()
+	SI446X_TRACE_CB_LOWBATT		= 0x05, ///< ::SI446X_CB_LOWBATT()
+	SI446X_TRACE_CB_WUT			= 0x06, ///< ::SI446X_CB_WUT()
+	SI446X_TRACE_CB_RXCHANNEL	= 0x07, ///< ::SI446X_CB_RXCHANNEL()
+	SI446X_TRACE_CB_RXPACKET	= 0x08, ///< ::SI446X_CB_RXPACKET()
+	SI446X_TRACE_CB_RXSTREAM	= 0x09, ///< ::SI446X_CB_RXSTREAM()
+	SI446X_TRACE_CB_MACRX		= 0x0A, ///< ::SI446X_CB_MACRX()
+	SI446X_TRACE_CB_MACSENT		= 0x0B ///< ::SI446X_CB_MACSENT()
+} si446x_trace_cb_t;
+
+/**
+* @brief Event trace record, see ::Si446x_traceGet()
+*
+* 8 bytes with no padding, so a buffer of them can be written out as is and read by host/trace.c (little endian)
+*/
+typedef struct {
+	uint32_t time; ///< From the ::SI446X_CB_TRACETIME() callback (micros() on Arduino)
+	uint8_t event; ///< What happened, a ::si446x_trace_event_t
+	uint8_t arg; ///< Opcode, state or callback, depends on \p event
+	uint16_t data; ///< Length or interrupts, depends on \p event
+} si446x_trace_t;
+
 #if SI446X_ENABLE_ADDRMATCHING
 /*-*
 * @brief Address modes (NOT SUPPORTED)
@@ -277,9 +457,11 @@ extern "C" {
 /**
 * @brief Initialise, must be called before anything else!
 *
-* @return (none)
+* The radio is reset and the startup config from radio_config.h is applied. With ::SI446X_WARM_START the reset and most of the config are skipped if the radio is still setup from before.
+*
+* @return 0 if the radio didn't respond after being reset (not connected or no power), otherwise 1
 */
-void Si446x_init(void);
+uint8_t Si446x_init(void);
 
 /**
 * @brief Get chip info, see ::si446x_info_t
@@ -297,6 +479,46 @@ void Si446x_getInfo(si446x_info_t* info);
 */
 int16_t Si446x_getRSSI(void);
 
+#if DOXYGEN || SI446X_STATS
+/**
+* @brief Get a snapshot of the hot path counters (::SI446X_STATS in Si446x_config.h)
+*
+* Polls are counted against the last command sent, which is the one the radio is busy with.
+*
+* @param [stats] Where to put the counters
+* @return (none)
+*/
+void Si446x_getStats(si446x_stats_t* stats);
+
+/**
+* @brief Set all of the hot path counters back to 0
+*
+* @return (none)
+*/
+void Si446x_resetStats(void);
+#endif
+
+#if DOXYGEN || SI446X_TRACE
+/**
+* @brief Get the most recent event trace records (::SI446X_TRACE in Si446x_config.h)
+*
+* Records are added for each command (start and finish), state change, FIFO read and write, ISR run and callback (start and finish).
+* Once the ring is full the oldest records are overwritten, so the trace is always of what happened last.
+*
+* @param [buff] Where to put the records, oldest first
+* @param [max] Size of \p buff in records
+* @return Number of records put into \p buff
+*/
+uint8_t Si446x_traceGet(si446x_trace_t* buff, uint8_t max);
+
+/**
+* @brief Empty the event trace ring
+*
+* @return (none)
+*/
+void Si446x_traceClear(void);
+#endif
+
 /**
 * @brief Set the transmit power. The output power does not follow the \p pwr value, see the Si446x datasheet for a pretty graph
 *
@@ -330,6 +552,44 @@ void Si446x_setupCallback(uint16_t callbacks, uint8_t state);
 */
 void Si446x_read(void* buff, uint8_t len);
 
+#if DOXYGEN || SI446X_RX_POOL
+/**
+* @brief Give a received packet back to the pool (::SI446X_RX_POOL in Si446x_config.h)
+*
+* Packets are passed to the ::SI446X_CB_RXPACKET() callback, they can be kept and used from anywhere until they're released. If the callback isn't used then the packet is released straight away.
+*
+* @param [packet] Packet from ::SI446X_CB_RXPACKET()
+* @return (none)
+*/
+void Si446x_release(si446x_packet_t* packet);
+#endif
+
+#if DOXYGEN || SI446X_RX_QUEUE
+/**
+* @brief Get the oldest packet from the receive queue (::SI446X_RX_QUEUE in Si446x_config.h)
+*
+* The packet stays in the queue and can be used until ::Si446x_queuePop() is called. Only call this from one place (usually the main loop), it's not safe to call from the ISR.
+*
+* @return The oldest packet, or NULL if the queue is empty
+*/
+si446x_packet_t* Si446x_queuePeek(void);
+
+/**
+* @brief Remove the oldest packet from the receive queue, making room for another one
+*
+* @return (none)
+*/
+void Si446x_queuePop(void);
+
+/**
+* @brief Get the receive queue counters
+*
+* @param [stats] Where to put the counters
+* @return (none)
+*/
+void Si446x_queueStats(si446x_queue_stats_t* stats);
+#endif
+
 /**
 * @brief Transmit a packet
 *
@@ -341,6 +601,47 @@ void Si446x_read(void* buff, uint8_t len);
 */
 uint8_t Si446x_TX(void* packet, uint8_t len, uint8_t channel, si446x_state_t onTxFinish);
 
+#if DOXYGEN || SI446X_CCA
+/**
+* @brief See if the last ::Si446x_TX() failed because the channel was busy (::SI446X_CCA in Si446x_config.h)
+*
+* @return 1 if the channel was busy, 0 if it failed for some other reason or succeeded
+*/
+uint8_t Si446x_channelBusy(void);
+#endif
+
+/**
+* @brief Load a packet into the TX FIFO without transmitting it
+*
+* The packet can then be sent with ::Si446x_fire(), and sent again with ::Si446x_retransmit() without writing it over SPI again. Packets sent with ::Si446x_TX() can also be retransmitted.\n
+* The TX and RX FIFOs are shared, so the loaded packet is lost once a packet starts being received. ::Si446x_RX() on its own keeps it, so RX mode can be used while waiting for an ACK.
+*
+* @param [packet] Pointer to packet data
+* @param [len] Number of bytes to load, maximum of ::SI446X_MAX_PACKET_LEN If configured for fixed length packets then this parameter is ignored and the length is set by ::SI446X_FIXED_LENGTH in Si446x_config.h
+* @return 0 on failure (already transmitting), 1 on success
+*/
+uint8_t Si446x_load(const void* packet, uint8_t len);
+
+/**
+* @brief Transmit the packet loaded by ::Si446x_load()
+*
+* @param [channel] Channel to transmit data on (0 - 255)
+* @param [onTxFinish] What state to enter when the packet has finished transmitting. Usually ::SI446X_STATE_SLEEP or ::SI446X_STATE_RX
+* @return 0 on failure (already transmitting, nothing loaded or the packet was overwritten by a received one), 1 on success (has begun transmitting). If a packet is being received the radio is left in RX mode receiving it, otherwise nothing is changed on failure
+*/
+uint8_t Si446x_fire(uint8_t channel, si446x_state_t onTxFinish);
+
+/**
+* @brief Transmit the last packet again without reloading the FIFO
+*
+* Uses the RETRANSMIT option of START_TX, only a single command is sent over SPI no matter how long the packet is. Useful for beacons and resending unacknowledged packets.
+*
+* @param [channel] Channel to transmit data on (0 - 255)
+* @param [onTxFinish] What state to enter when the packet has finished transmitting. Usually ::SI446X_STATE_SLEEP or ::SI446X_STATE_RX
+* @return 0 on failure (already transmitting, nothing loaded or the packet was overwritten by a received one), 1 on success (has begun transmitting). If a packet is being received the radio is left in RX mode receiving it, otherwise nothing is changed on failure
+*/
+uint8_t Si446x_retransmit(uint8_t channel, si446x_state_t onTxFinish);
+
 /**
 * @brief Enter receive mode
 *
@@ -351,6 +652,237 @@ uint8_t Si446x_TX(void* packet, uint8_t len, uint8_t channel, si446x_state_t onT
 */
 void Si446x_RX(uint8_t channel);
 
+#if DOXYGEN || SI446X_TX_QUEUE
+/**
+* @brief Add a packet to the transmit queue (::SI446X_TX_QUEUE in Si446x_config.h)
+*
+* If nothing is being sent then the packet starts transmitting straight away, otherwise the ISR sends it once the packets before it have gone.
+* The ::SI446X_CB_SENT() callback is ran after each packet and is turned on by this function. ::Si446x_TX() and friends can't be used until the queue is empty.\n
+* \p packet isn't copied, it must not be changed until its ::SI446X_CB_SENT() callback.
+*
+* @param [packet] Pointer to packet data
+* @param [len] Number of bytes to transmit, maximum of ::SI446X_MAX_PACKET_LEN If configured for fixed length packets then this parameter is ignored and the length is set by ::SI446X_FIXED_LENGTH in Si446x_config.h
+* @param [channel] Channel to transmit data on (0 - 255)
+* @param [onTxFinish] What state to enter when the packet has finished transmitting and there's nothing else in the queue. Usually ::SI446X_STATE_SLEEP or ::SI446X_STATE_RX
+* @return 0 if the queue is full or something else is being transmitted, 1 on success
+*/
+uint8_t Si446x_TXQueue(const void* packet, uint8_t len, uint8_t channel, si446x_state_t onTxFinish);
+
+/**
+* @brief Get the number of free places in the transmit queue
+*
+* @return Number of packets that can be added with ::Si446x_TXQueue()
+*/
+uint8_t Si446x_TXQueueFree(void);
+#endif
+
+#if DOXYGEN || SI446X_MAC
+/**
+* @brief Turn on the MAC layer and start listening (::SI446X_MAC in Si446x_config.h)
+*
+* Packets are received by the ::SI446X_CB_MACRX() callback instead of ::SI446X_CB_RXCOMPLETE(). Packets for other addresses are ignored, packets that want an ACK are ACKed straight away by the ISR and duplicates are dropped.
+* The radio is kept in RX mode when it's not transmitting.
+*
+* @param [address] Address of this node (0 - 254)
+* @param [channel] Channel to send and receive on
+* @return (none)
+*/
+void Si446x_macInit(uint8_t address, uint8_t channel);
+
+/**
+* @brief Turn off the MAC layer, received packets go to ::SI446X_CB_RXCOMPLETE() again
+*
+* @return (none)
+*/
+void Si446x_macStop(void);
+
+/**
+* @brief Send data to another node
+*
+* The ::SI446X_CB_MACSENT() callback is ran once the packet has been ACKed, or once all of the retries have failed. ::Si446x_macPoll() must be called regularly to do the retries.
+* Only one packet can be waiting for an ACK at a time. Broadcasts don't get a callback.
+*
+* @param [address] Address to send to, or ::SI446X_MAC_BROADCAST
+* @param [data] Data to send, copied so it can be reused straight away
+* @param [len] Length of \p data, up to ::SI446X_MAC_MAX_LEN
+* @return 0 if the MAC isn't on, a packet is still waiting for an ACK, or the radio is busy transmitting, otherwise 1
+*/
+uint8_t Si446x_macSend(uint8_t address, const void* data, uint8_t len);
+
+/**
+* @brief Check for ACK timeouts and send again if needed, call this regularly from the main loop
+*
+* @return (none)
+*/
+void Si446x_macPoll(void);
+#endif
+
+#if DOXYGEN || SI446X_LINK_STATS
+/**
+* @brief Get link quality stats for each peer that has been heard from (::SI446X_LINK_STATS in Si446x_config.h)
+*
+* Stats are updated by the ISR as packets arrive, so this takes a copy with interrupts off.
+*
+* @param [stats] Where to put the stats
+* @param [max] Number of entries \p stats has room for
+* @return Number of peers copied into \p stats
+*/
+uint8_t Si446x_linkStats(si446x_link_t* stats, uint8_t max);
+
+/**
+* @brief Get the number of packets that failed the CRC while the MAC was on
+*
+* These can't be counted for each peer since the address is in the corrupted part of the packet.
+*
+* @return Number of CRC failures
+*/
+uint16_t Si446x_linkCRCErrors(void);
+
+/**
+* @brief Forget all peers and clear the counters
+*
+* @return (none)
+*/
+void Si446x_linkReset(void);
+#endif
+
+#if DOXYGEN || SI446X_STREAM
+/**
+* @brief Transmit a packet that's bigger than the FIFO (::SI446X_STREAM in Si446x_config.h)
+*
+* As much of the packet as will fit is loaded into the FIFO, then the ISR tops it up as it empties. \p packet must not be changed until the ::SI446X_CB_SENT() callback.\n
+* If interrupts are held off for too long the FIFO will run out and the packet will be cut short, see ::SI446X_STREAM_TX_THRESH.
+*
+* @param [packet] Pointer to packet data
+* @param [len] Number of bytes to transmit, up to 255 with a 1 byte length field or ::SI446X_MAX_STREAM_LEN with a 2 byte length field
+* @param [channel] Channel to transmit data on (0 - 255)
+* @param [onTxFinish] What state to enter when the packet has finished transmitting. Usually ::SI446X_STATE_SLEEP or ::SI446X_STATE_RX
+* @return 0 on failure (already transmitting or too long), 1 on success (has begun transmitting)
+*/
+uint8_t Si446x_TXStream(const void* packet, uint16_t len, uint8_t channel, si446x_state_t onTxFinish);
+
+/**
+* @brief Enter receive mode for a packet that might be bigger than the FIFO (::SI446X_STREAM in Si446x_config.h)
+*
+* The ISR moves the packet into \p buff as it arrives. Once it's all there the ::SI446X_CB_RXSTREAM() callback is ran instead of ::SI446X_CB_RXCOMPLETE(), no need to call ::Si446x_read().
+* Packets that fail the CRC run ::SI446X_CB_RXINVALID() as usual. Only one packet is received this way, ::Si446x_RX() goes back to normal receiving.
+*
+* @param [buff] Where to put the packet, must not be used until the callback
+* @param [size] Size of \p buff, longer packets are rejected by the radio
+* @param [channel] Channel to listen to (0 - 255)
+* @return (none)
+*/
+void Si446x_RXStream(void* buff, uint16_t size, uint8_t channel);
+#endif
+
+#if DOXYGEN || SI446X_HOP
+/**
+* @brief Work out the synthesizer setup for a channel so it can be used with ::Si446x_hop() (::SI446X_HOP in Si446x_config.h)
+*
+* Uses the base frequency and channel step from the startup config, so it gives the same frequency as passing \p channel to ::Si446x_RX() or ::Si446x_TX(). This reads a few properties from the radio, so do it once at startup for each channel in the hop schedule.\n
+* The VCO count is worked out from the divider and FREQ_CONTROL_W_SIZE. If WDS gives different hop table values for your setup then fill in ::si446x_synth_t with those instead.
+*
+* @param [channel] Channel (0 - 255)
+* @param [synth] Where to put the synthesizer setup
+* @return (none)
+*/
+void Si446x_hopSynth(uint8_t channel, si446x_synth_t* synth);
+
+/**
+* @brief Change frequency without leaving RX or TX mode
+*
+* Uses RX_HOP or TX_HOP, which skip the idle, FIFO clear, interrupt clear and VCO calibration that ::Si446x_RX() does when changing channel, so the radio is listening again much sooner.\n
+* A packet that is being received when this is called is lost.
+*
+* @param [synth] Synthesizer setup from ::Si446x_hopSynth()
+* @return 0 if the radio isn't in RX or TX mode (use ::Si446x_RX() instead), 1 on success
+*/
+uint8_t Si446x_hop(const si446x_synth_t* synth);
+
+/**
+* @brief Let the radio scan a list of channels by itself while in RX mode
+*
+* After calling this, start receiving with ::Si446x_RX(). The radio then moves through the table on its own whenever the hop condition is met, without waking the microcontroller.
+* It stops on a channel once a packet starts arriving and, as usual, leaves RX mode once the packet has been received. Before ::SI446X_CB_RXCOMPLETE() the ::SI446X_CB_RXCHANNEL() callback is ran with the channel the packet arrived on.\n
+* Call ::Si446x_RX() again to carry on scanning.
+*
+* @param [mode] Hop condition, ::SI446X_RXHOP_OFF to stop hopping
+* @param [rssiTimeout] How long to wait for the RSSI or preamble before hopping (0 - 15, see RX_HOP_CONTROL in the Si446x API docs)
+* @param [rssiThreshold] RSSI threshold in dBm for ::SI446X_RXHOP_RSSI (-134 to -7, this is MODEM_RSSI_THRESH, which is also used for other RSSI features)
+* @param [channels] Channels to scan, can be NULL if \p mode is ::SI446X_RXHOP_OFF
+* @param [count] Number of channels (1 - 64)
+* @return (none)
+*/
+void Si446x_setupRXHop(si446x_rxhop_t mode, uint8_t rssiTimeout, int16_t rssiThreshold, const uint8_t* channels, uint8_t count);
+#endif
+
+#if DOXYGEN || SI446X_SCAN
+/**
+* @brief Sweep a range of channels and measure the RSSI of each one (::SI446X_SCAN in Si446x_config.h)
+*
+* The radio is moved between channels with RX_HOP, then after ::SI446X_SCAN_SETTLE the current RSSI is read \p samples times from the latched RSSI fast response register, with the MODEM_RSSI_CONTROL latch turned off for the sweep so it follows the current RSSI. The radio averages the RSSI itself as set by MODEM_RSSI_CONTROL in the radio config.\n
+* This blocks until the sweep is done and stops whatever the radio was doing, unless it's transmitting or the TX queue is sending. Interrupts are only held off while hopping and reading the RSSI, but the ISR ignores packet and modem interrupts until the sweep is done, so anything received during the sweep is thrown away. Afterwards the radio is in ::SI446X_IDLE_MODE, call ::Si446x_RX() to go back to receiving.\n
+* Automatic RX hopping (::Si446x_setupRXHop()) must be off.
+*
+* @param [first] First channel
+* @param [count] Number of channels, \p first + \p count must not go past 256
+* @param [samples] Number of RSSI readings to take on each channel (1 - 255), each one is a single FRR read
+* @param [results] Where to put the RSSI of each channel, must have room for \p count entries
+* @return 0 if the radio is transmitting (\p results is left alone), otherwise 1
+*/
+uint8_t Si446x_scan(uint8_t first, uint8_t count, uint8_t samples, si446x_scan_t* results);
+
+/**
+* @brief Get how many sweeps per second ::Si446x_scan() has been doing since the last time this was called
+*
+* Timing comes from the ::SI446X_CB_TIMESTAMP() callback, which must return milliseconds.
+*
+* @return Sweeps per second, 0 if no time has passed
+*/
+uint16_t Si446x_scanRate(void);
+#endif
+
+#if DOXYGEN || SI446X_WATERFALL
+/**
+* @brief Start a waterfall capture (::SI446X_WATERFALL in Si446x_config.h)
+*
+* Writes the stream header to the ::SI446X_CB_WATERFALL() callback, then each call to ::Si446x_waterfallRow() sweeps the channels with ::Si446x_scan() and writes a row.\n
+* The stream is little endian. The header is:
+* - 0: "SIWF"
+* - 4: Format version (::SI446X_WATERFALL_VERSION)
+* - 5: Header length (::SI446X_WATERFALL_HEADER_LEN), rows start after this many bytes
+* - 6: First channel, 7: Channel count, 8: RSSI samples per channel
+* - 9: Rows between keyframes (::SI446X_WATERFALL_KEYFRAME)
+* - 10: Settle time in us (::SI446X_SCAN_SETTLE), 2 bytes
+* - 12: FREQ_CONTROL_INTE - FREQ_CONTROL_VCOCNT_RX_ADJ properties, 8 bytes
+* - 20: MODEM_CLKGEN_BAND property
+* - 21: MODEM_MOD_TYPE - MODEM_FREQ_DEV properties, 12 bytes (modulation, data rate and XO frequency from TX_NCO_MODE)
+*
+* Each row is a sweep of peak RSSI values, 1 byte per channel:
+* - Keyframe: ::SI446X_WATERFALL_KEY, 4 byte timestamp, then RSSI in dBm as int8_t
+* - Delta: ::SI446X_WATERFALL_DELTA, 2 byte time since the last row, then the change in RSSI since the last row as int8_t
+*
+* Timestamps come from ::SI446X_CB_TIMESTAMP(). A keyframe is written every ::SI446X_WATERFALL_KEYFRAME rows, or if more than 65535 has passed since the last row.
+* host/waterfall.c reads the stream back.
+*
+* @param [first] First channel
+* @param [count] Number of channels, \p first + \p count must not go past 256
+* @param [samples] Number of RSSI readings to take on each channel (1 - 255)
+* @param [row] Buffer of \p count bytes for the last row, used for working out the changes. Must not be used until the capture is finished
+* @return (none)
+*/
+void Si446x_waterfallStart(uint8_t first, uint8_t count, uint8_t samples, int8_t* row);
+
+/**
+* @brief Sweep the channels and write a waterfall row to the ::SI446X_CB_WATERFALL() callback
+*
+* Blocks until the sweep is done, like ::Si446x_scan(). The callback is ran between channels with interrupts on, the ISR ignores packet and modem interrupts until the sweep is done.
+*
+* @return 0 if there's no capture started or the radio is transmitting (nothing is written), otherwise 1
+*/
+uint8_t Si446x_waterfallRow(void);
+#endif
+
 /*-*
 * @brief Changes will be applied next time the radio enters RX mode (NOT SUPPORTED)
 *
@@ -443,7 +975,7 @@ float Si446x_adc_temperature(void);
 /**
 * @brief Configure GPIO/NIRQ/SDO pin
 *
-* @note NIRQ and SDO pins should not be changed, unless you really know what you're doing. 2 of the GPIO pins (usually 0 and 1) are also usually used for the RX/TX RF switch and should also be left alone.
+* @note NIRQ and SDO pins should not be changed, unless you really know what you're doing. 2 of the GPIO pins (usually 0 and 1) are also usually used for the RX/TX RF switch and should also be left alone, as should the CTS pin if SI446X_GPIO_CTS is used.
 *
 * @param [pin] The pin, this can only take a single pin (don't use bitwise OR), see ::si446x_gpio_t
 * @param [value] The new pin mode, this can be bitwise OR'd with the ::SI446X_PIN_PULL_EN option, see ::si446x_gpio_mode_t ::si446x_nirq_mode_t ::si446x_sdo_mode_t
@@ -467,12 +999,77 @@ uint8_t Si446x_readGPIO(void);
 */
 uint8_t Si446x_dump(void* buff, uint8_t group);
 
+/**
+* @brief Start holding back property writes (::SI446X_PROP_BATCH in Si446x_config.h)
+*
+* Writes from ::Si446x_setProperty() and the library's own property changes are held back until ::Si446x_commitProperties(), then merged into as few SET_PROPERTY commands as possible.\n
+* Begin and commit can be nested, the writes are only sent by the outermost commit.
+*
+* @note Other commands sent before the commit (changing state etc) will go to the radio before the held back properties. Reading a property sends everything that's been held back.
+* @note Writes the library needs in place before its next command (packet length, TX threshold and packet handler interrupts when transmitting, receiving or streaming) always go straight to the radio and replace any held back write to the same property.
+* So do all writes made from the ISR (callbacks, MAC ACKs), and property reads in the ISR don't send the held back writes, they get what the radio currently has.
+*
+* @return (none)
+*/
+void Si446x_beginProperties(void);
+
+/**
+* @brief Set a property, see the Si446x API docs for what they all do
+*
+* If ::Si446x_beginProperties() has been called then the write is held back, a later write to the same property replaces it.
+*
+* @param [prop] The property (group << 8 | index)
+* @param [value] New value
+* @return (none)
+*/
+void Si446x_setProperty(uint16_t prop, uint8_t value);
+
+/**
+* @brief Send the property writes held back since ::Si446x_beginProperties()
+*
+* @return (none)
+*/
+void Si446x_commitProperties(void);
+
+#if DOXYGEN || SI446X_ASYNC
+/**
+* @brief Queue a command to be sent to the radio without waiting for it (::SI446X_ASYNC in Si446x_config.h)
+*
+* Nothing is sent until ::Si446x_poll() is called. Commands are sent in the order they were submitted. See the Si446x API docs and Si446x_defs.h for the commands.\n
+* Commands waiting for the radio don't have a timeout, but any blocking function (::Si446x_TX() etc) will finish off queued commands first and those do time out.\n
+* If the radio interrupt happens while a command is with the radio then the ISR waits for it (with a timeout, even for IRCAL) and reads its response, but the callback is still left for ::Si446x_poll(). Commands that haven't been sent yet stay queued.
+*
+* @note ::Si446x_init() drops anything that's still queued
+*
+* @param [cmd] Command struct to use, see ::si446x_cmd_t
+* @param [data] Command and arguments, this is copied into \p cmd
+* @param [len] Length of \p data (1 - 16)
+* @param [out] Where to put the response, NULL if the response isn't needed
+* @param [outLen] Length of response to read (0 - 16)
+* @param [callback] Function to run when the command has finished, NULL for none. This is ran from whatever calls ::Si446x_poll() or a blocking function, never from the ISR
+* @return 0 on failure (\p cmd is already queued or lengths are invalid), 1 on success
+*/
+uint8_t Si446x_submit(si446x_cmd_t* cmd, const void* data, uint8_t len, void* out, uint8_t outLen, void (*callback)(si446x_cmd_t* cmd));
+
+/**
+* @brief Move queued commands along, this does not wait for the radio
+*
+* Sends the next command if the radio is ready for it and reads responses of finished commands.\n
+* With ::SI446X_GPIO_CTS this only checks the CTS pin until the radio is ready, otherwise each call does a READ_CMD_BUFF over SPI.
+*
+* @return Number of commands still queued (including the one being processed by the radio)
+*/
+uint8_t Si446x_poll(void);
+#endif
+
 /**
 * @brief If interrupts are disabled (::SI446X_INTERRUPTS in Si446x_config.h) then this function should be called as often as possible to process any events
 *
+* When using the Linux or mock transports (::SI446X_HAL in Si446x_config.h) this should be called whenever the NIRQ pin goes low, usually from a thread that waits with si446x_hal_waitIRQ()
+*
 * @return (none)
 */
-#if DOXYGEN || defined(ARDUINO) || SI446X_INTERRUPTS == 0
+#if DOXYGEN || defined(ARDUINO) || SI446X_HAL != SI446X_HAL_AVR || SI446X_INTERRUPTS == 0
 void Si446x_SERVICE(void);
 #else
 #define Si446x_SERVICE() ((void)(0))
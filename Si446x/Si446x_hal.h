@@ -0,0 +1,94 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+#ifndef SI446X_HAL_H_
+#define SI446X_HAL_H_
+
+// Transport interface for non-AVR, non-Arduino builds (SI446X_HAL in Si446x_config.h)
+// AVR and Arduino builds don't use this, they keep using the inline register/Arduino stuff in Si446x.c and Si446x_spi.h
+
+#include <stdint.h>
+#include "Si446x_config.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Open devices, setup pins etc
+void si446x_hal_init(void);
+
+// Chip select
+void si446x_hal_select(void);
+void si446x_hal_deselect(void);
+
+// Transfer a single byte
+uint8_t si446x_hal_transfer(uint8_t data);
+
+// Transfer a block of bytes, out can be NULL to send 0xFF and in can be NULL to throw away what's received
+void si446x_hal_transferBlock(const void* out, void* in, uint8_t len);
+
+// Delay for some microseconds
+void si446x_hal_delay_us(uint32_t us);
+
+// Set the level of the SDN pin (1 = shutdown)
+void si446x_hal_sdn(uint8_t level);
+
+// Get the level of the NIRQ pin (0 = interrupt pending)
+uint8_t si446x_hal_irq(void);
+
+// Get the level of the pin connected to the radio GPIO used for CTS (1 = ready for command), only used if SI446X_GPIO_CTS is not -1
+uint8_t si446x_hal_cts(void);
+
+// Stop Si446x_SERVICE() from running while normal code is using the radio (recursive)
+// This does the job of SI446X_NO_INTERRUPT() when Si446x_SERVICE() is ran from another thread
+void si446x_hal_lock(void);
+void si446x_hal_unlock(void);
+
+#if SI446X_HAL == SI446X_HAL_LINUX
+
+// Wait for the NIRQ pin to go low, returns 1 if it's low or 0 on timeout
+// Use -1 for no timeout
+// Usually used in a loop in its own thread which calls Si446x_SERVICE()
+uint8_t si446x_hal_waitIRQ(int timeout_ms);
+
+#elif SI446X_HAL == SI446X_HAL_MOCK
+
+// Device on the other end of the mock bus
+// Any of these can be NULL
+typedef struct {
+	void (*select)(void);
+	void (*deselect)(void);
+	uint8_t (*transfer)(uint8_t data);
+	void (*delay)(uint32_t us);
+	void (*sdn)(uint8_t level);
+	uint8_t (*irq)(void);
+	uint8_t (*cts)(void);
+} si446x_mock_dev_t;
+
+// Bus activity
+typedef struct {
+	uint32_t bytes; // Bytes transferred
+	uint32_t selects; // Chip select cycles
+	uint32_t delay_us; // Total time spent in delays
+} si446x_mock_stats_t;
+
+// Connect a device to the bus, NULL to disconnect
+// With nothing connected MISO reads as 0xFF and NIRQ stays high
+void si446x_mock_attach(const si446x_mock_dev_t* dev);
+
+// Get and reset bus activity counts
+void si446x_mock_stats(si446x_mock_stats_t* stats);
+void si446x_mock_resetStats(void);
+
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SI446X_HAL_H_ */
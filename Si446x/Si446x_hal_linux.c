@@ -0,0 +1,240 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+#include "Si446x_config.h"
+
+#if SI446X_HAL == SI446X_HAL_LINUX
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
+#include "Si446x_hal.h"
+
+// Delays shorter than this are busy-waited since sleeping would take far longer than asked for
+#define SPIN_DELAY_MAX_US	100
+
+static int spiFd = -1;
+static int csnFd = -1;
+static int sdnFd = -1;
+static int irqFd = -1;
+#if SI446X_GPIO_CTS != -1
+static int ctsFd = -1;
+#endif
+
+static pthread_mutex_t lock;
+
+// There's no way of returning errors from si446x_hal_init(), and carrying on without the radio would just make a mess
+static void fail(const char* what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+static int requestLine(int chipFd, uint32_t offset, uint64_t flags, uint8_t value, const char* what)
+{
+	struct gpio_v2_line_request req;
+	memset(&req, 0, sizeof(req));
+	req.offsets[0] = offset;
+	req.num_lines = 1;
+	req.config.flags = flags;
+	if(flags & GPIO_V2_LINE_FLAG_OUTPUT)
+	{
+		req.config.num_attrs = 1;
+		req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+		req.config.attrs[0].attr.values = value;
+		req.config.attrs[0].mask = 1;
+	}
+	strncpy(req.consumer, "Si446x", sizeof(req.consumer) - 1);
+
+	if(ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+		fail(what);
+	return req.fd;
+}
+
+static void setLine(int fd, uint8_t value)
+{
+	struct gpio_v2_line_values vals = {
+		.bits = value,
+		.mask = 1
+	};
+	ioctl(fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &vals);
+}
+
+static uint8_t getLine(int fd)
+{
+	struct gpio_v2_line_values vals = {
+		.bits = 0,
+		.mask = 1
+	};
+	ioctl(fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals);
+	return vals.bits & 1;
+}
+
+void si446x_hal_init()
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	spiFd = open(SI446X_LINUX_SPIDEV, O_RDWR);
+	if(spiFd < 0)
+		fail(SI446X_LINUX_SPIDEV);
+
+	uint32_t mode = SPI_MODE_0 | SPI_NO_CS;
+	uint8_t bits = 8;
+	uint32_t speed = SI446X_LINUX_SPI_SPEED;
+	if(ioctl(spiFd, SPI_IOC_WR_MODE32, &mode) < 0)
+		fail("SPI_IOC_WR_MODE32");
+	if(ioctl(spiFd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0)
+		fail("SPI_IOC_WR_BITS_PER_WORD");
+	if(ioctl(spiFd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+		fail("SPI_IOC_WR_MAX_SPEED_HZ");
+
+	int chipFd = open(SI446X_LINUX_GPIOCHIP, O_RDWR);
+	if(chipFd < 0)
+		fail(SI446X_LINUX_GPIOCHIP);
+
+	csnFd = requestLine(chipFd, SI446X_LINUX_CSN, GPIO_V2_LINE_FLAG_OUTPUT, 1, "CSN");
+	sdnFd = requestLine(chipFd, SI446X_LINUX_SDN, GPIO_V2_LINE_FLAG_OUTPUT, 0, "SDN"); // Low so a radio that is already running isn't reset, resetDevice() does that when needed
+	irqFd = requestLine(chipFd, SI446X_LINUX_IRQ, GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_BIAS_PULL_UP, 0, "IRQ");
+#if SI446X_GPIO_CTS != -1
+	ctsFd = requestLine(chipFd, SI446X_LINUX_CTS, GPIO_V2_LINE_FLAG_INPUT, 0, "CTS");
+#endif
+
+	close(chipFd);
+}
+
+void si446x_hal_select()
+{
+	setLine(csnFd, 0);
+}
+
+void si446x_hal_deselect()
+{
+	setLine(csnFd, 1);
+}
+
+uint8_t si446x_hal_transfer(uint8_t data)
+{
+	uint8_t in = 0xFF;
+	struct spi_ioc_transfer xfer;
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)&data;
+	xfer.rx_buf = (unsigned long)&in;
+	xfer.len = 1;
+	ioctl(spiFd, SPI_IOC_MESSAGE(1), &xfer);
+	return in;
+}
+
+void si446x_hal_transferBlock(const void* out, void* in, uint8_t len)
+{
+	// spidev sends 0s if there's no TX buffer, the radio doesn't care but keep MOSI high like the other backends
+	uint8_t fill[255];
+	if(out == NULL)
+	{
+		memset(fill, 0xFF, len);
+		out = fill;
+	}
+
+	struct spi_ioc_transfer xfer;
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.tx_buf = (unsigned long)out;
+	xfer.rx_buf = (unsigned long)in;
+	xfer.len = len;
+	if(len)
+		ioctl(spiFd, SPI_IOC_MESSAGE(1), &xfer);
+}
+
+void si446x_hal_delay_us(uint32_t us)
+{
+	struct timespec ts;
+	if(us < SPIN_DELAY_MAX_US)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += us * 1000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		do
+		{
+			clock_gettime(CLOCK_MONOTONIC, &now);
+		} while(now.tv_sec < ts.tv_sec || (now.tv_sec == ts.tv_sec && now.tv_nsec < ts.tv_nsec));
+	}
+	else
+	{
+		ts.tv_sec = us / 1000000;
+		ts.tv_nsec = (us % 1000000) * 1000L;
+		while(clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) != 0);
+	}
+}
+
+void si446x_hal_sdn(uint8_t level)
+{
+	setLine(sdnFd, level);
+}
+
+uint8_t si446x_hal_irq()
+{
+	return getLine(irqFd);
+}
+
+uint8_t si446x_hal_cts()
+{
+#if SI446X_GPIO_CTS != -1
+	return getLine(ctsFd);
+#else
+	return 1;
+#endif
+}
+
+uint8_t si446x_hal_waitIRQ(int timeout_ms)
+{
+	while(getLine(irqFd))
+	{
+		struct pollfd pfd = {
+			.fd = irqFd,
+			.events = POLLIN
+		};
+		if(poll(&pfd, 1, timeout_ms) <= 0)
+			return !getLine(irqFd);
+
+		// Throw away the event, the line level is what matters
+		struct gpio_v2_line_event event;
+		if(read(irqFd, &event, sizeof(event)) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+void si446x_hal_lock()
+{
+	pthread_mutex_lock(&lock);
+}
+
+void si446x_hal_unlock()
+{
+	// Si446x_init() turns the interrupt on without turning it off first, a recursive mutex refuses (EPERM) to unlock if this thread doesn't hold it
+	// so unlocks that don't have a matching lock are ignored without having to keep track of the owner here
+	pthread_mutex_unlock(&lock);
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+#include "Si446x_config.h"
+
+#if SI446X_HAL == SI446X_HAL_MOCK
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Si446x_hal.h"
+
+static const si446x_mock_dev_t* device;
+static si446x_mock_stats_t stats;
+
+void si446x_mock_attach(const si446x_mock_dev_t* dev)
+{
+	device = dev;
+}
+
+void si446x_mock_stats(si446x_mock_stats_t* out)
+{
+	*out = stats;
+}
+
+void si446x_mock_resetStats()
+{
+	stats.bytes = 0;
+	stats.selects = 0;
+	stats.delay_us = 0;
+}
+
+void si446x_hal_init()
+{
+}
+
+void si446x_hal_select()
+{
+	stats.selects++;
+	if(device != NULL && device->select != NULL)
+		device->select();
+}
+
+void si446x_hal_deselect()
+{
+	if(device != NULL && device->deselect != NULL)
+		device->deselect();
+}
+
+uint8_t si446x_hal_transfer(uint8_t data)
+{
+	stats.bytes++;
+	if(device != NULL && device->transfer != NULL)
+		return device->transfer(data);
+	return 0xFF; // MISO pulled up
+}
+
+void si446x_hal_transferBlock(const void* out, void* in, uint8_t len)
+{
+	for(uint8_t i=0;i<len;i++)
+	{
+		uint8_t data = si446x_hal_transfer((out != NULL) ? ((const uint8_t*)out)[i] : 0xFF);
+		if(in != NULL)
+			((uint8_t*)in)[i] = data;
+	}
+}
+
+void si446x_hal_delay_us(uint32_t us)
+{
+	stats.delay_us += us;
+	if(device != NULL && device->delay != NULL)
+		device->delay(us);
+}
+
+void si446x_hal_sdn(uint8_t level)
+{
+	if(device != NULL && device->sdn != NULL)
+		device->sdn(level);
+}
+
+uint8_t si446x_hal_irq()
+{
+	if(device != NULL && device->irq != NULL)
+		return device->irq();
+	return 1;
+}
+
+uint8_t si446x_hal_cts()
+{
+	if(device != NULL && device->cts != NULL)
+		return device->cts();
+	return 1;
+}
+
+// Everything runs in the one thread, so there's nothing to lock
+void si446x_hal_lock()
+{
+}
+
+void si446x_hal_unlock()
+{
+}
+
+#endif
@@ -43,3 +43,19 @@ void spi_init()
 	SPCR = _BV(SPE)|_BV(MSTR); // SPI enable + Master mode
 	SPSR = _BV(SPI2X); // Double speed
 }
+
+void spi_transfer_block(const void* out, void* in, uint8_t len)
+{
+	const uint8_t* o = (const uint8_t*)out;
+	uint8_t* i = (uint8_t*)in;
+
+	// The next byte is ready to go as soon as SPIF is set, so this keeps the bus busier than a spi_transfer() per byte
+	for(;len;len--)
+	{
+		SPDR = (o != NULL) ? *o++ : 0xFF;
+		loop_until_bit_is_set(SPSR, SPIF);
+		uint8_t data = SPDR;
+		if(i != NULL)
+			*i++ = data;
+	}
+}
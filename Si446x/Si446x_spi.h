@@ -13,6 +13,9 @@
 
 void spi_init(void);
 
+// Transfer a block of bytes, out can be NULL to send 0xFF and in can be NULL to throw away what's received
+void spi_transfer_block(const void* out, void* in, uint8_t len);
+
 inline void spi_transfer_nr(uint8_t data)
 {
 	SPDR = data;
@@ -9,7 +9,8 @@
 /*
  * Channel scanner
  *
- * Listen to each channel, record the highest RSSI value and print a pretty graph
+ * Sweep through all of the channels, record the highest and average RSSI values and print a pretty graph
+ * Needs SI446X_SCAN set to 1 in Si446x_config.h
  */
 
 #define BAUD 1000000
@@ -24,7 +25,14 @@
 #include <stdio.h>
 #include "Si446x.h"
 
-static volatile uint8_t channel;
+#if !SI446X_SCAN
+#error "SI446X_SCAN must be set to 1 in Si446x_config.h"
+#endif
+
+// Channels to sweep at a time, 2 bytes of RAM each
+#define BLOCK_SIZE 32
+
+static si446x_scan_t results[BLOCK_SIZE];
 
 static int put(char c, FILE* stream)
 {
@@ -37,19 +45,10 @@ static int put(char c, FILE* stream)
 
 static FILE uart_io = FDEV_SETUP_STREAM(put, NULL, _FDEV_SETUP_WRITE);
 
-void SI446X_CB_RXCOMPLETE(uint8_t length, int16_t rssi)
-{
-	(void)(length); // Stop warnings about unused parameters
-	(void)(rssi);
-
-	Si446x_RX(channel);
-}
-
-void SI446X_CB_RXINVALID(int16_t rssi)
+// Milliseconds for the library, only Si446x_scanRate() needs it and that isn't used here
+uint32_t SI446X_CB_TIMESTAMP(void)
 {
-	(void)(rssi);
-
-	Si446x_RX(channel);
+	return 0;
 }
 
 void main(void)
@@ -79,27 +78,23 @@ void main(void)
 
 	while(1)
 	{
-		// Receive mode on selected channel
-		Si446x_RX(channel);
-		
-		// Check the RSSI value and store the highest, do this for about 2 seconds
-		int16_t peakRssi = -999;
-		for(uint16_t i=0;i<1800;i++)
+		// Sweep a block of channels, 200 RSSI readings each
+		for(uint16_t first=0;first<256;first+=BLOCK_SIZE)
 		{
-			_delay_ms(1);
-			int16_t rssi = Si446x_getRSSI();
-			if(rssi > peakRssi)
-				peakRssi = rssi;
+			if(!Si446x_scan(first, BLOCK_SIZE, 200, results))
+				continue; // Radio is busy transmitting
+
+			// Print out a pretty graph
+			for(uint8_t i=0;i<BLOCK_SIZE;i++)
+			{
+				int16_t peakRssi = results[i].peak;
+				uint16_t bars = (130 - (peakRssi * -1)) / 4;
+
+				printf_P(PSTR("%03hhu: "), (uint8_t)(first + i));
+				for(uint16_t j=0;j<bars;j++)
+					printf_P(PSTR("|"));
+				printf_P(PSTR(" (%d, avg %d)\n"), peakRssi, results[i].mean);
+			}
 		}
-
-		// Print out a pretty graph
-		uint16_t bars = (130 - (peakRssi * -1)) / 4;
-
-		printf_P(PSTR("%03hhu: "), channel);
-		for(uint16_t i=0;i<bars;i++)
-			printf_P(PSTR("|"));
-		printf_P(PSTR(" (%d)\n"), peakRssi);
-
-		channel++;
 	}
 }
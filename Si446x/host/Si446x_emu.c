@@ -0,0 +1,1078 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "Si446x.h"
+#include "Si446x_defs.h"
+#include "Si446x_hal.h"
+#include "Si446x_emu.h"
+
+#if SI446X_HAL != SI446X_HAL_MOCK
+	#error "The emulator needs SI446X_HAL to be SI446X_HAL_MOCK"
+#endif
+
+#define FIFO_SIZE_SHARED	129
+#define FIFO_SIZE_SPLIT		64
+#define AIR_SLOTS			8
+#define AIR_MAX_LEN			4096
+#define STEP_NS				10000 // Longest amount of time to let pass before updating the radio state
+
+// Pending bits (see GET_INT_STATUS in the API docs)
+#define PH_FILTER_MATCH		7
+#define PH_FILTER_MISS		6
+#define PH_PACKET_SENT		5
+#define PH_PACKET_RX		4
+#define PH_CRC_ERROR		3
+#define PH_TX_ALMOST_EMPTY	1
+#define PH_RX_ALMOST_FULL	0
+#define MODEM_INVALID_SYNC	5
+#define MODEM_PREAMBLE		1
+#define MODEM_SYNC			0
+#define CHIP_FIFO_ERROR		5
+#define CHIP_STATE_CHANGE	4
+#define CHIP_CMD_ERROR		3
+#define CHIP_READY			2
+
+#define PROP(group, index)	((uint16_t)((group)<<8 | (index)))
+#define DBM_TO_RAW(dbm)		((uint8_t)(((dbm) + 134) * 2))
+
+// Property group sizes, same as Si446x_dump()
+static const uint8_t groupSizes[] = {
+	SI446X_PROP_GROUP_GLOBAL,	0x0A,
+	SI446X_PROP_GROUP_INT,		0x04,
+	SI446X_PROP_GROUP_FRR,		0x04,
+	SI446X_PROP_GROUP_PREAMBLE,	0x0E,
+	SI446X_PROP_GROUP_SYNC,		0x06,
+	SI446X_PROP_GROUP_PKT,		0x40,
+	SI446X_PROP_GROUP_MODEM,	0x60,
+	SI446X_PROP_GROUP_MODEM_CHFLT,	0x24,
+	SI446X_PROP_GROUP_PA,		0x07,
+	SI446X_PROP_GROUP_SYNTH,	0x08,
+	SI446X_PROP_GROUP_MATCH,	0x0C,
+	SI446X_PROP_GROUP_FREQ_CONTROL,	0x08,
+	SI446X_PROP_GROUP_RX_HOP,	0x42,
+	SI446X_PROP_GROUP_PTI,		0x04
+};
+
+// Packet on its way to the radio
+typedef struct {
+	uint8_t used;
+	uint8_t seen; // Preamble has started, either being received or missed
+	uint8_t channel;
+	uint8_t crcOk;
+	int16_t rssi;
+	uint16_t len;
+	uint64_t start;
+	uint8_t data[AIR_MAX_LEN];
+} air_t;
+
+static struct {
+	si446x_emu_config_t cfg;
+	si446x_emu_stats_t stats;
+	uint64_t now; // ns
+
+	// Power
+	uint8_t sdn;
+	uint8_t booted;
+	uint64_t bootDone;
+
+	// SPI transaction
+	uint8_t selected;
+	uint8_t spiCmd;
+	uint16_t spiPos;
+	uint8_t cmd[32];
+	uint8_t cmdLen;
+	uint8_t frrIdx;
+	uint8_t ctsByte;
+
+	// Command processing
+	uint64_t busyUntil;
+	uint8_t lastCmd;
+	uint8_t resp[16];
+	uint8_t cmdErr;
+
+	uint8_t props[256][256];
+	uint8_t gpioCfg[7];
+	uint8_t phPend;
+	uint8_t modemPend;
+	uint8_t chipPend;
+
+	uint8_t state;
+	uint8_t channel;
+	uint8_t latchedRssi;
+	uint16_t lastRxLen;
+
+	uint8_t txFifo[FIFO_SIZE_SHARED];
+	uint8_t txCount;
+	uint8_t rxFifo[FIFO_SIZE_SHARED];
+	uint8_t rxCount;
+
+	// TX in progress
+	uint64_t txStart; // Tuned and started sending preamble
+	uint64_t txPayloadStart;
+	uint64_t txEnd;
+	uint16_t txLen;
+	uint16_t txSent;
+	uint8_t txComplete;
+	uint8_t txArmed; // START_TX given, TX_TUNE moves on to TX (TX_TUNE can also be a TXCOMPLETE_STATE)
+	uint8_t lastTx[FIFO_SIZE_SHARED]; // For RETRANSMIT
+	uint8_t lastTxLen;
+	uint8_t txRecord[AIR_MAX_LEN]; // What went out on air, for echo
+	uint16_t txRecordLen;
+
+	// RX setup and reception in progress
+	uint64_t rxStart; // Tuned
+	uint64_t hopAt; // When automatic RX hopping moves on to the next channel
+	uint8_t rxValidState;
+	uint8_t rxInvalidState;
+	int8_t rxSlot;
+	uint8_t rxSynced;
+	uint16_t rxDone;
+
+	air_t air[AIR_SLOTS];
+
+	uint32_t echoDelay;
+	int16_t echoRssi;
+
+	int16_t chRssi[256];
+
+	uint8_t ircalAmp;
+	uint8_t ircalPh;
+} emu;
+
+static void update(void);
+
+static uint64_t byteTimeNs(void)
+{
+	return 8000000000ULL / emu.cfg.bitrate;
+}
+
+static void advance(uint64_t ns)
+{
+	while(ns)
+	{
+		uint64_t step = (ns > STEP_NS) ? STEP_NS : ns;
+		emu.now += step;
+		ns -= step;
+		update();
+	}
+	emu.stats.time = emu.now / 1000;
+}
+
+static uint8_t ready(void)
+{
+	return emu.booted && !emu.sdn && emu.now >= emu.busyUntil;
+}
+
+static uint8_t fifoSize(void)
+{
+	return (emu.props[SI446X_PROP_GROUP_GLOBAL][0x03] & SI446X_FIFO_MODE_HALF_DUPLEX) ? FIFO_SIZE_SHARED : FIFO_SIZE_SPLIT;
+}
+
+static uint16_t prop16(uint8_t group, uint8_t index)
+{
+	return (uint16_t)(emu.props[group][index]<<8 | emu.props[group][index + 1]);
+}
+
+static uint8_t groupSize(uint8_t group)
+{
+	for(uint8_t i=0;i<sizeof(groupSizes);i+=2)
+	{
+		if(groupSizes[i] == group)
+			return groupSizes[i + 1];
+	}
+	return 0;
+}
+
+static void cmdError(void)
+{
+	emu.cmdErr = 0x10; // BAD_COMMAND
+	emu.chipPend |= _BV(CHIP_CMD_ERROR);
+}
+
+static void setState(uint8_t state)
+{
+	if(state != emu.state)
+		emu.chipPend |= _BV(CHIP_STATE_CHANGE);
+	emu.state = state;
+}
+
+static int16_t currentRSSI(void)
+{
+	// Anything on the air on our channel?
+	for(uint8_t i=0;i<AIR_SLOTS;i++)
+	{
+		air_t* air = &emu.air[i];
+		if(air->used && air->channel == emu.channel && emu.now >= air->start)
+			return air->rssi;
+	}
+	return emu.chRssi[emu.channel];
+}
+
+static uint8_t frrValue(uint8_t mode)
+{
+	switch(mode)
+	{
+		case 1:
+		case 2:
+			return (emu.phPend ? 1 : 0) | (emu.modemPend ? 2 : 0) | (emu.chipPend ? 4 : 0);
+		case 3:
+		case 4:
+			return emu.phPend;
+		case 5:
+		case 6:
+			return emu.modemPend;
+		case 7:
+		case 8:
+			return emu.chipPend;
+		case 9:
+			return emu.state;
+		case 10:
+			// With the MODEM_RSSI_CONTROL latch off it follows the current RSSI
+			if(!(emu.props[SI446X_PROP_GROUP_MODEM][0x4C] & 0x07))
+				return DBM_TO_RAW(currentRSSI());
+			return emu.latchedRssi;
+		default:
+			break;
+	}
+	return 0;
+}
+
+static void powerOnReset(void)
+{
+	memset(emu.props, 0, sizeof(emu.props));
+	emu.props[SI446X_PROP_GROUP_GLOBAL][0x00] = 0x40; // GLOBAL_XO_TUNE
+	emu.props[SI446X_PROP_GROUP_GLOBAL][0x03] = 0x20; // GLOBAL_CONFIG
+	emu.props[SI446X_PROP_GROUP_INT][0x00] = 0x04; // INT_CTL_ENABLE
+	emu.props[SI446X_PROP_GROUP_INT][0x03] = 0x04; // INT_CTL_CHIP_ENABLE
+	emu.props[SI446X_PROP_GROUP_FRR][0x00] = 0x01;
+	emu.props[SI446X_PROP_GROUP_FRR][0x01] = 0x02;
+	emu.props[SI446X_PROP_GROUP_FRR][0x02] = 0x09;
+	emu.props[SI446X_PROP_GROUP_PKT][0x0B] = 0x30; // PKT_TX_THRESHOLD
+	emu.props[SI446X_PROP_GROUP_PKT][0x0C] = 0x30; // PKT_RX_THRESHOLD
+	emu.props[SI446X_PROP_GROUP_PKT][0x0E] = 0x04; // PKT_FIELD_1_LENGTH
+	emu.props[SI446X_PROP_GROUP_PA][0x01] = 0x7F; // PA_PWR_LVL
+
+	memset(emu.gpioCfg, 0, sizeof(emu.gpioCfg));
+	emu.gpioCfg[1] = SI446X_GPIO_MODE_CTS;
+	emu.gpioCfg[4] = SI446X_NIRQ_MODE_NIRQ;
+	emu.gpioCfg[5] = SI446X_SDO_MODE_SDO;
+
+	emu.phPend = 0;
+	emu.modemPend = 0;
+	emu.chipPend = 0;
+	emu.cmdErr = 0;
+	emu.state = SI446X_STATE_SPI_ACTIVE;
+	emu.channel = 0;
+	emu.latchedRssi = 0;
+	emu.txCount = 0;
+	emu.rxCount = 0;
+	emu.lastTxLen = 0;
+	emu.rxSlot = -1;
+	emu.busyUntil = 0;
+	emu.ircalAmp = 0;
+	emu.ircalPh = 0;
+}
+
+static void txFifoPop(uint8_t count)
+{
+	// Almost empty once the number of free bytes reaches PKT_TX_THRESHOLD
+	uint8_t thresh = emu.props[SI446X_PROP_GROUP_PKT][0x0B];
+	uint8_t wasBelow = fifoSize() - emu.txCount < thresh;
+	memmove(emu.txFifo, emu.txFifo + count, emu.txCount - count);
+	emu.txCount -= count;
+	if(wasBelow && fifoSize() - emu.txCount >= thresh)
+		emu.phPend |= _BV(PH_TX_ALMOST_EMPTY);
+}
+
+static void rxFifoPush(uint8_t data)
+{
+	if(emu.rxCount >= fifoSize())
+	{
+		emu.chipPend |= _BV(CHIP_FIFO_ERROR);
+		return;
+	}
+	if(fifoSize() == FIFO_SIZE_SHARED && emu.rxCount < emu.lastTxLen)
+		emu.lastTx[emu.rxCount] = data; // Same memory, a retransmit would send what was received
+	emu.rxFifo[emu.rxCount++] = data;
+	if(emu.rxCount == emu.props[SI446X_PROP_GROUP_PKT][0x0C] + 1)
+		emu.phPend |= _BV(PH_RX_ALMOST_FULL);
+}
+
+static void startRX(uint8_t channel)
+{
+	emu.channel = channel;
+	emu.rxSlot = -1;
+	emu.rxStart = emu.now + emu.cfg.tuneTime * 1000ULL;
+	setState(SI446X_STATE_RX_TUNE);
+}
+
+// Automatic RX hopping is on (RX_HOP_CONTROL HOP_EN)
+static uint8_t autoHop(void)
+{
+	return (emu.props[SI446X_PROP_GROUP_RX_HOP][0x00] & 0x70) && emu.props[SI446X_PROP_GROUP_RX_HOP][0x01];
+}
+
+// Move on to the next channel in the RX hop table
+static void nextHop(void)
+{
+	uint8_t* table = &emu.props[SI446X_PROP_GROUP_RX_HOP][0x02];
+	uint8_t size = emu.props[SI446X_PROP_GROUP_RX_HOP][0x01];
+	if(size > 64)
+		size = 64;
+
+	uint8_t next = 0;
+	for(uint8_t i=0;i<size;i++)
+	{
+		if(table[i] == emu.channel)
+		{
+			next = (i + 1) % size;
+			break;
+		}
+	}
+
+	emu.channel = table[next];
+	emu.rxStart = emu.now + emu.cfg.hopTime * 1000ULL;
+	setState(SI446X_STATE_RX_TUNE);
+}
+
+// Work out which channel a RX_HOP/TX_HOP synth setup is for
+static uint8_t hopChannel(const uint8_t* c)
+{
+	uint8_t* freq = emu.props[SI446X_PROP_GROUP_FREQ_CONTROL];
+	uint32_t base = ((uint32_t)freq[0]<<19) + ((uint32_t)freq[1]<<16) + ((uint32_t)freq[2]<<8) + freq[3];
+	uint32_t div = ((uint32_t)c[1]<<19) + ((uint32_t)c[2]<<16) + ((uint32_t)c[3]<<8) + c[4];
+	uint16_t step = prop16(SI446X_PROP_GROUP_FREQ_CONTROL, 0x04);
+	if(step == 0 || div < base)
+		return 0xFF;
+	return (uint8_t)((div - base) / step);
+}
+
+static void txFinished(void)
+{
+	emu.stats.packetsSent++;
+	emu.txArmed = 0;
+	emu.phPend |= _BV(PH_PACKET_SENT);
+
+	if(emu.echoDelay)
+		si446x_emu_inject(emu.txRecord, emu.txRecordLen, emu.channel, emu.echoRssi, 1, emu.echoDelay);
+
+	uint8_t next = emu.txComplete;
+	if(next == SI446X_STATE_NOCHANGE)
+		next = SI446X_STATE_READY;
+	if(next == SI446X_STATE_RX)
+		startRX(emu.channel);
+	else
+		setState(next);
+}
+
+static void rxFinished(air_t* air)
+{
+	uint8_t next;
+	if(air->crcOk)
+	{
+		emu.stats.packetsReceived++;
+		emu.phPend |= _BV(PH_PACKET_RX);
+		emu.lastRxLen = air->len;
+		next = emu.rxValidState;
+	}
+	else
+	{
+		emu.phPend |= _BV(PH_CRC_ERROR);
+		next = emu.rxInvalidState;
+	}
+	air->used = 0;
+	emu.rxSlot = -1;
+
+	if(next == SI446X_STATE_NOCHANGE || next == SI446X_STATE_RX)
+		startRX(emu.channel);
+	else
+		setState(next);
+}
+
+static void update(void)
+{
+	if(!emu.booted && !emu.sdn && emu.now >= emu.bootDone)
+	{
+		emu.booted = 1;
+		powerOnReset();
+	}
+
+	if(!emu.booted)
+		return;
+
+	// TX
+	if(emu.state == SI446X_STATE_TX_TUNE && emu.txArmed && emu.now >= emu.txStart)
+		setState(SI446X_STATE_TX);
+
+	if(emu.state == SI446X_STATE_TX)
+	{
+		if(emu.now >= emu.txPayloadStart)
+		{
+			uint64_t due = (emu.now - emu.txPayloadStart) / byteTimeNs();
+			if(due > emu.txLen)
+				due = emu.txLen;
+			while(emu.txSent < due)
+			{
+				if(emu.txCount == 0)
+				{
+					// Underflow, give up
+					emu.chipPend |= _BV(CHIP_FIFO_ERROR);
+					emu.txArmed = 0;
+					setState(SI446X_STATE_READY);
+					return;
+				}
+				if(emu.txRecordLen < AIR_MAX_LEN)
+					emu.txRecord[emu.txRecordLen++] = emu.txFifo[0];
+				txFifoPop(1);
+				emu.txSent++;
+			}
+		}
+
+		if(emu.now >= emu.txEnd)
+			txFinished();
+	}
+
+	// RX
+	if(emu.state == SI446X_STATE_RX_TUNE && emu.now >= emu.rxStart)
+	{
+		setState(SI446X_STATE_RX);
+
+		// Stay for RSSI_TIMEOUT * 4 bit periods (not quite the real thing, the preamble timeout isn't modelled separately)
+		uint8_t timeout = emu.props[SI446X_PROP_GROUP_RX_HOP][0x00] & 0x0F;
+		emu.hopAt = emu.now + (timeout ? timeout : 1) * byteTimeNs() / 2;
+	}
+	else if(emu.state == SI446X_STATE_RX && emu.rxSlot == -1 && autoHop() && emu.now >= emu.hopAt)
+		nextHop();
+
+	for(uint8_t i=0;i<AIR_SLOTS;i++)
+	{
+		air_t* air = &emu.air[i];
+		if(!air->used || air->seen || emu.now < air->start)
+			continue;
+
+		if(emu.state == SI446X_STATE_RX && emu.rxSlot == -1 && air->channel == emu.channel)
+		{
+			air->seen = 1;
+			emu.rxSlot = i;
+			emu.rxSynced = 0;
+			emu.rxDone = 0;
+			emu.modemPend |= _BV(MODEM_PREAMBLE);
+		}
+		else if(autoHop() && (emu.state == SI446X_STATE_RX || emu.state == SI446X_STATE_RX_TUNE) && emu.now < air->start + (emu.cfg.overhead - 2) * byteTimeNs())
+			continue; // Still sending preamble, might hop onto its channel in time
+		else
+		{
+			air->seen = 1;
+			emu.stats.packetsMissed++;
+			air->used = 0;
+		}
+	}
+
+	if(emu.rxSlot != -1)
+	{
+		air_t* air = &emu.air[(uint8_t)emu.rxSlot];
+		uint64_t syncTime = air->start + (emu.cfg.overhead - 2) * byteTimeNs();
+
+		if(emu.state != SI446X_STATE_RX)
+		{
+			// Left RX mode while receiving
+			air->used = 0;
+			emu.rxSlot = -1;
+		}
+		else if(emu.now >= syncTime)
+		{
+			if(!emu.rxSynced)
+			{
+				emu.rxSynced = 1;
+				emu.latchedRssi = DBM_TO_RAW(air->rssi);
+				emu.modemPend |= _BV(MODEM_SYNC);
+			}
+
+			uint64_t due = (emu.now - syncTime) / byteTimeNs();
+			if(due > air->len)
+				due = air->len;
+			while(emu.rxDone < due)
+				rxFifoPush(air->data[emu.rxDone++]);
+
+			if(emu.now >= syncTime + (air->len + 2) * byteTimeNs())
+				rxFinished(air);
+		}
+	}
+}
+
+static void cmdStartTX(void)
+{
+	uint8_t condition = emu.cmd[2];
+	uint16_t len = (uint16_t)((emu.cmd[3] & 0x1F)<<8 | emu.cmd[4]);
+
+	if(len == 0)
+	{
+		// Length from the packet handler fields
+		len = prop16(SI446X_PROP_GROUP_PKT, 0x0D) & 0x1FFF;
+		if(emu.props[SI446X_PROP_GROUP_PKT][0x08] & 0x07) // Variable length field
+			len += prop16(SI446X_PROP_GROUP_PKT, 0x11) & 0x1FFF;
+	}
+
+	if(condition & 0x04)
+	{
+		// Retransmit what was in the FIFO last time
+		memcpy(emu.txFifo, emu.lastTx, emu.lastTxLen);
+		emu.txCount = emu.lastTxLen;
+	}
+	else
+	{
+		emu.lastTxLen = emu.txCount;
+		memcpy(emu.lastTx, emu.txFifo, emu.txCount);
+	}
+
+	uint8_t tuned = (emu.state == SI446X_STATE_TX_TUNE && emu.channel == emu.cmd[1]); // Synth is already tuned after a TXCOMPLETE_STATE of TX_TUNE
+
+	emu.channel = emu.cmd[1];
+	emu.txComplete = condition>>4;
+	emu.txLen = len;
+	emu.txSent = 0;
+	emu.txRecordLen = 0;
+	emu.rxSlot = -1;
+	emu.txArmed = 1;
+	emu.txStart = emu.now + (tuned ? 0 : emu.cfg.tuneTime * 1000ULL);
+	emu.txPayloadStart = emu.txStart + (emu.cfg.overhead - 2) * byteTimeNs();
+	emu.txEnd = emu.txPayloadStart + (len + 2) * byteTimeNs();
+	setState(SI446X_STATE_TX_TUNE);
+}
+
+static void cmdGetIntStatus(void)
+{
+	uint8_t* r = emu.resp;
+	uint8_t ph = emu.phPend;
+	uint8_t modem = emu.modemPend;
+	uint8_t chip = emu.chipPend;
+
+	r[0] = (ph ? 1 : 0) | (modem ? 2 : 0) | (chip ? 4 : 0);
+	r[1] = r[0];
+	r[2] = ph;
+	r[3] = ph;
+	r[4] = modem;
+	r[5] = modem;
+	r[6] = chip;
+	r[7] = chip;
+
+	// 0 bits clear pending interrupts, no args clears everything
+	if(emu.cmdLen == 1)
+	{
+		emu.phPend = 0;
+		emu.modemPend = 0;
+		emu.chipPend = 0;
+	}
+	else
+	{
+		emu.phPend &= (emu.cmdLen > 1) ? emu.cmd[1] : 0xFF;
+		emu.modemPend &= (emu.cmdLen > 2) ? emu.cmd[2] : 0xFF;
+		emu.chipPend &= (emu.cmdLen > 3) ? emu.cmd[3] : 0xFF;
+	}
+}
+
+static uint16_t adcTemp(void)
+{
+	return (uint16_t)((emu.cfg.temperature + 293) * 4096 / 899);
+}
+
+// Run a command, returns how long it takes in us
+static uint32_t execute(void)
+{
+	uint8_t* c = emu.cmd;
+	uint8_t* r = emu.resp;
+	uint32_t time = emu.cfg.cmdTime;
+
+	memset(r, 0, sizeof(emu.resp));
+
+	if(!emu.booted)
+		return 0;
+
+	emu.stats.commands++;
+	emu.stats.cmdCount[c[0]]++;
+	emu.lastCmd = c[0];
+
+	switch(c[0])
+	{
+		case SI446X_CMD_NOP:
+			break;
+		case SI446X_CMD_POWER_UP:
+			powerOnReset();
+			emu.chipPend |= _BV(CHIP_READY);
+			time = emu.cfg.powerUpTime;
+			break;
+		case SI446X_CMD_PART_INFO:
+			r[0] = 0x11;
+			r[1] = 0x44;
+			r[2] = 0x63;
+			r[3] = 0x00;
+			r[4] = 0x00;
+			r[5] = 0x00;
+			r[6] = 0x00;
+			r[7] = 0x06;
+			break;
+		case SI446X_CMD_FUNC_INFO:
+			r[0] = 0x06;
+			r[1] = 0x00;
+			r[2] = 0x02;
+			r[3] = 0x00;
+			r[4] = 0x00;
+			r[5] = 0x01;
+			break;
+		case SI446X_CMD_SET_PROPERTY:
+		{
+			uint8_t group = c[1];
+			uint8_t num = c[2];
+			uint8_t index = c[3];
+			if(num > 12 || emu.cmdLen < 4 + num || index + num > groupSize(group))
+				cmdError();
+			else
+				memcpy(&emu.props[group][index], &c[4], num);
+		}
+			break;
+		case SI446X_CMD_GET_PROPERTY:
+		{
+			uint8_t group = c[1];
+			uint8_t num = c[2];
+			uint8_t index = c[3];
+			if(num > 16 || index + num > groupSize(group))
+				cmdError();
+			else
+				memcpy(r, &emu.props[group][index], num);
+		}
+			break;
+		case SI446X_CMD_GPIO_PIN_CFG:
+			for(uint8_t i=0;i<7;i++)
+			{
+				if(emu.cmdLen > i + 1 && (c[i + 1] & 0x3F) != 0)
+					emu.gpioCfg[i] = c[i + 1];
+			}
+			for(uint8_t i=0;i<7;i++)
+			{
+				uint8_t mode = emu.gpioCfg[i] & 0x3F;
+				uint8_t level = (mode == SI446X_GPIO_MODE_DRIVE1) || (mode == SI446X_GPIO_MODE_CTS);
+				r[i] = emu.gpioCfg[i] | (level<<7);
+			}
+			break;
+		case SI446X_CMD_FIFO_INFO:
+			if(emu.cmdLen > 1)
+			{
+				if(c[1] & SI446X_FIFO_CLEAR_RX)
+					emu.rxCount = 0;
+				if(c[1] & SI446X_FIFO_CLEAR_TX)
+					emu.txCount = 0;
+			}
+			r[0] = emu.rxCount;
+			r[1] = fifoSize() - emu.txCount;
+			break;
+		case SI446X_CMD_PACKET_INFO:
+			r[0] = emu.lastRxLen>>8;
+			r[1] = emu.lastRxLen;
+			break;
+		case SI446X_CMD_GET_INT_STATUS:
+			cmdGetIntStatus();
+			break;
+		case SI446X_CMD_GET_PH_STATUS:
+			r[0] = emu.phPend;
+			r[1] = emu.phPend;
+			emu.phPend &= (emu.cmdLen > 1) ? c[1] : 0;
+			break;
+		case SI446X_CMD_GET_MODEM_STATUS:
+			r[0] = emu.modemPend;
+			r[1] = emu.modemPend;
+			r[2] = DBM_TO_RAW(currentRSSI());
+			r[3] = emu.latchedRssi;
+			r[4] = r[2];
+			r[5] = r[2];
+			emu.modemPend &= (emu.cmdLen > 1) ? c[1] : 0;
+			break;
+		case SI446X_CMD_GET_CHIP_STATUS:
+			r[0] = emu.chipPend;
+			r[1] = emu.chipPend;
+			r[2] = emu.cmdErr;
+			emu.chipPend &= (emu.cmdLen > 1) ? c[1] : 0;
+			break;
+		case SI446X_CMD_GET_ADC_READING:
+		{
+			uint8_t en = (emu.cmdLen > 1) ? c[1] : 0;
+			uint16_t batt = (uint16_t)(emu.cfg.battery * 32UL / 75);
+			uint16_t temp = adcTemp();
+			r[0] = 0;
+			r[1] = 0;
+			r[2] = batt>>8;
+			r[3] = batt;
+			r[4] = temp>>8;
+			r[5] = temp;
+			if(en & 0x18)
+				time = 12UL * (2UL<<((emu.cmdLen > 2) ? (c[2]>>4) : 0)) / 30 + emu.cfg.cmdTime;
+		}
+			break;
+		case SI446X_CMD_REQUEST_DEVICE_STATE:
+			r[0] = emu.state;
+			r[1] = emu.channel;
+			break;
+		case SI446X_CMD_CHANGE_STATE:
+			time = emu.cfg.stateTime;
+			if(c[1] == SI446X_STATE_RX)
+				startRX(emu.channel);
+			else if(c[1] != SI446X_STATE_NOCHANGE)
+				setState(c[1] == SI446X_STATE_READY2 ? SI446X_STATE_READY : c[1]);
+			break;
+		case SI446X_CMD_START_TX:
+			time = emu.cfg.stateTime;
+			cmdStartTX();
+			break;
+		case SI446X_CMD_START_RX:
+			time = emu.cfg.stateTime;
+			emu.rxValidState = (emu.cmdLen > 6) ? c[6] : 0;
+			emu.rxInvalidState = (emu.cmdLen > 7) ? c[7] : 0;
+			startRX(c[1]);
+			break;
+		case SI446X_CMD_RX_HOP:
+			if(emu.cmdLen < 7 || (emu.state != SI446X_STATE_RX && emu.state != SI446X_STATE_RX_TUNE))
+				cmdError();
+			else
+			{
+				// Same as startRX(), but without the VCO calibration
+				emu.channel = hopChannel(c);
+				emu.rxSlot = -1;
+				emu.rxStart = emu.now + emu.cfg.hopTime * 1000ULL;
+				setState(SI446X_STATE_RX_TUNE);
+			}
+			break;
+		case SI446X_CMD_TX_HOP:
+			if(emu.cmdLen < 7 || (emu.state != SI446X_STATE_TX && emu.state != SI446X_STATE_TX_TUNE))
+				cmdError();
+			else
+				emu.channel = hopChannel(c); // Rest of the packet goes out on the new channel
+			break;
+		case SI446X_CMD_IRCAL:
+			time = emu.cfg.ircalTime;
+			emu.ircalAmp = 0x1C;
+			emu.ircalPh = 0x02;
+			break;
+		case SI446X_CMD_IRCAL_MANUAL:
+			if(emu.cmdLen > 2)
+			{
+				if(c[1] & 0x80) // IRCAL_AMP_REPLACE
+					emu.ircalAmp = c[1] & 0x1F;
+				if(c[2] & 0x80) // IRCAL_PH_REPLACE
+					emu.ircalPh = c[2] & 0x3F;
+			}
+			r[0] = emu.ircalAmp;
+			r[1] = emu.ircalPh;
+			break;
+		default:
+			cmdError();
+			break;
+	}
+
+	return time;
+}
+
+static void emuSelect(void)
+{
+	advance(emu.cfg.csTime / 2);
+	emu.stats.selects++;
+	emu.selected = 1;
+	emu.spiPos = 0;
+	emu.cmdLen = 0;
+
+	// SPI activity wakes the radio up
+	if(emu.booted && emu.state == SI446X_STATE_SLEEP)
+		setState(SI446X_STATE_SPI_ACTIVE);
+}
+
+static void emuDeselect(void)
+{
+	if(emu.selected && emu.spiPos > 0)
+	{
+		switch(emu.spiCmd)
+		{
+			case SI446X_CMD_READ_CMD_BUFF:
+			case SI446X_CMD_READ_FRR_A:
+			case SI446X_CMD_READ_FRR_B:
+			case SI446X_CMD_READ_FRR_C:
+			case SI446X_CMD_READ_FRR_D:
+			case SI446X_CMD_WRITE_TX_FIFO:
+			case SI446X_CMD_READ_RX_FIFO:
+				break;
+			default:
+				if(!ready())
+				{
+					emu.stats.overlaps++;
+					if(emu.booted)
+						cmdError();
+				}
+				else
+					emu.busyUntil = emu.now + execute() * 1000ULL;
+				break;
+		}
+	}
+	emu.selected = 0;
+	advance(emu.cfg.csTime / 2);
+}
+
+static uint8_t emuTransfer(uint8_t data)
+{
+	uint8_t out = 0xFF;
+
+	advance(8000000000ULL / emu.cfg.spiHz);
+	emu.stats.bytes++;
+
+	if(!emu.selected || emu.sdn)
+		return 0xFF; // SDO tri-stated, pulled up
+	if(!emu.booted)
+		return 0x00;
+
+	uint16_t pos = emu.spiPos++;
+	if(pos == 0)
+	{
+		emu.spiCmd = data;
+		switch(data)
+		{
+			case SI446X_CMD_READ_CMD_BUFF:
+				emu.stats.ctsReads++;
+				emu.ctsByte = ready() ? 0xFF : 0x00;
+				if(!emu.ctsByte)
+				{
+					emu.stats.ctsPolls++;
+					emu.stats.cmdPolls[emu.lastCmd]++;
+				}
+				break;
+			case SI446X_CMD_READ_FRR_A:
+				emu.frrIdx = 0;
+				break;
+			case SI446X_CMD_READ_FRR_B:
+				emu.frrIdx = 1;
+				break;
+			case SI446X_CMD_READ_FRR_C:
+				emu.frrIdx = 2;
+				break;
+			case SI446X_CMD_READ_FRR_D:
+				emu.frrIdx = 3;
+				break;
+			default:
+				break;
+		}
+		if(emu.cmdLen < sizeof(emu.cmd))
+			emu.cmd[emu.cmdLen++] = data;
+		return 0xFF;
+	}
+
+	switch(emu.spiCmd)
+	{
+		case SI446X_CMD_READ_CMD_BUFF:
+			if(pos == 1)
+				out = emu.ctsByte;
+			else if(emu.ctsByte && pos - 2 < (int)sizeof(emu.resp))
+				out = emu.resp[pos - 2];
+			else
+				out = 0x00;
+			break;
+		case SI446X_CMD_READ_FRR_A:
+		case SI446X_CMD_READ_FRR_B:
+		case SI446X_CMD_READ_FRR_C:
+		case SI446X_CMD_READ_FRR_D:
+			emu.stats.frrReads++;
+			out = (emu.frrIdx < 4) ? frrValue(emu.props[SI446X_PROP_GROUP_FRR][emu.frrIdx]) : 0;
+			emu.frrIdx++;
+			break;
+		case SI446X_CMD_WRITE_TX_FIFO:
+			emu.stats.fifoBytes++;
+			if(emu.txCount < fifoSize())
+				emu.txFifo[emu.txCount++] = data;
+			else
+				emu.chipPend |= _BV(CHIP_FIFO_ERROR);
+			break;
+		case SI446X_CMD_READ_RX_FIFO:
+			emu.stats.fifoBytes++;
+			if(emu.rxCount)
+			{
+				out = emu.rxFifo[0];
+				memmove(emu.rxFifo, emu.rxFifo + 1, --emu.rxCount);
+			}
+			else
+			{
+				emu.chipPend |= _BV(CHIP_FIFO_ERROR);
+				out = 0x00;
+			}
+			break;
+		default:
+			if(emu.cmdLen < sizeof(emu.cmd))
+				emu.cmd[emu.cmdLen++] = data;
+			break;
+	}
+
+	return out;
+}
+
+static void emuDelay(uint32_t us)
+{
+	advance(us * 1000ULL);
+}
+
+static void emuSdn(uint8_t level)
+{
+	if(level)
+	{
+		emu.booted = 0;
+		emu.sdn = 1;
+	}
+	else if(emu.sdn)
+	{
+		emu.sdn = 0;
+		emu.bootDone = emu.now + emu.cfg.porTime * 1000ULL;
+	}
+}
+
+static uint8_t emuIrq(void)
+{
+	if(!emu.booted)
+		return 1;
+	uint8_t enable = emu.props[SI446X_PROP_GROUP_INT][0x00];
+	uint8_t pending =
+		((enable & 0x01) && (emu.phPend & emu.props[SI446X_PROP_GROUP_INT][0x01])) ||
+		((enable & 0x02) && (emu.modemPend & emu.props[SI446X_PROP_GROUP_INT][0x02])) ||
+		((enable & 0x04) && (emu.chipPend & emu.props[SI446X_PROP_GROUP_INT][0x03]));
+	return !pending;
+}
+
+static uint8_t emuCts(void)
+{
+#if SI446X_GPIO_CTS != -1
+	// Level of the GPIO pin as seen by the microcontroller
+	uint8_t mode = emu.gpioCfg[SI446X_GPIO_CTS] & 0x3F;
+	if(mode == SI446X_GPIO_MODE_CTS)
+		return ready();
+	return (mode == SI446X_GPIO_MODE_DRIVE1);
+#else
+	return 1;
+#endif
+}
+
+static const si446x_mock_dev_t device = {
+	.select = emuSelect,
+	.deselect = emuDeselect,
+	.transfer = emuTransfer,
+	.delay = emuDelay,
+	.sdn = emuSdn,
+	.irq = emuIrq,
+	.cts = emuCts
+};
+
+void si446x_emu_defaults(si446x_emu_config_t* cfg)
+{
+	cfg->spiHz = 4000000;
+	cfg->csTime = 500;
+	cfg->bitrate = 100000;
+	cfg->overhead = 8;
+	cfg->cmdTime = 20;
+	cfg->stateTime = 60;
+	cfg->tuneTime = 80;
+	cfg->hopTime = 20;
+	cfg->porTime = 6000;
+	cfg->powerUpTime = 15000;
+	cfg->ircalTime = 250000;
+	cfg->noise = -115;
+	cfg->temperature = 25;
+	cfg->battery = 3300;
+}
+
+void si446x_emu_init(const si446x_emu_config_t* cfg)
+{
+	memset(&emu, 0, sizeof(emu));
+	if(cfg != NULL)
+		emu.cfg = *cfg;
+	else
+		si446x_emu_defaults(&emu.cfg);
+
+	for(uint16_t i=0;i<256;i++)
+		emu.chRssi[i] = emu.cfg.noise;
+
+	// Powered, but SDN not used yet
+	emu.bootDone = emu.cfg.porTime * 1000ULL;
+	emu.rxSlot = -1;
+
+	si446x_mock_attach(&device);
+}
+
+void si446x_emu_run(uint32_t us)
+{
+	advance(us * 1000ULL);
+}
+
+uint64_t si446x_emu_time()
+{
+	return emu.now / 1000;
+}
+
+uint8_t si446x_emu_inject(const void* data, uint16_t len, uint8_t channel, int16_t rssi, uint8_t crcOk, uint32_t delay)
+{
+	if(len > AIR_MAX_LEN)
+		return 0;
+
+	for(uint8_t i=0;i<AIR_SLOTS;i++)
+	{
+		air_t* air = &emu.air[i];
+		if(air->used)
+			continue;
+		air->used = 1;
+		air->seen = 0;
+		air->channel = channel;
+		air->rssi = rssi;
+		air->crcOk = crcOk;
+		air->len = len;
+		air->start = emu.now + delay * 1000ULL;
+		memcpy(air->data, data, len);
+		return 1;
+	}
+	return 0;
+}
+
+void si446x_emu_echo(uint32_t delay, int16_t rssi)
+{
+	emu.echoDelay = delay;
+	emu.echoRssi = rssi;
+}
+
+void si446x_emu_setRSSI(uint8_t channel, int16_t rssi)
+{
+	emu.chRssi[channel] = rssi;
+}
+
+uint8_t si446x_emu_property(uint16_t prop)
+{
+	return emu.props[prop>>8][prop & 0xFF];
+}
+
+uint8_t si446x_emu_state()
+{
+	return emu.state;
+}
+
+uint16_t si446x_emu_lastTX(void* buff, uint16_t size)
+{
+	uint16_t len = emu.txRecordLen;
+	memcpy(buff, emu.txRecord, (len < size) ? len : size);
+	return len;
+}
+
+void si446x_emu_stats(si446x_emu_stats_t* stats)
+{
+	*stats = emu.stats;
+}
+
+void si446x_emu_resetStats()
+{
+	memset(&emu.stats, 0, sizeof(emu.stats));
+	emu.stats.time = emu.now / 1000;
+}
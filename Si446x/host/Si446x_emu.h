@@ -0,0 +1,171 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+#ifndef SI446X_EMU_H_
+#define SI446X_EMU_H_
+
+// Command-level Si4463 emulator for the mock transport (SI446X_HAL_MOCK)
+// Models the SPI command protocol (CTS, READ_CMD_BUFF, FRRs, properties, FIFOs, states and interrupts) closely enough
+// for the library to run unchanged on a PC. Timing is simulated and advances with SPI transfers and library delays,
+// so results are repeatable. Timings are rough figures from the datasheet/API docs, good for comparing library changes
+// but not for predicting exact on-target numbers.
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/**
+* @brief Emulator settings, see ::si446x_emu_init()
+*/
+typedef struct {
+	uint32_t spiHz; ///< SPI clock, used for working out how long transfers take
+	uint32_t csTime; ///< Time in ns to select and deselect the chip
+	uint32_t bitrate; ///< Over-the-air data rate in bps
+	uint8_t overhead; ///< Preamble + sync + CRC bytes added to each packet
+	uint16_t cmdTime; ///< Processing time of most commands in us
+	uint16_t stateTime; ///< CHANGE_STATE/START_TX/START_RX processing time in us
+	uint16_t tuneTime; ///< Synth tune time when entering TX/RX in us
+	uint16_t hopTime; ///< Synth retune time for RX_HOP/TX_HOP in us (no VCO calibration)
+	uint32_t porTime; ///< Power on reset time after SDN goes low in us
+	uint32_t powerUpTime; ///< POWER_UP command time in us
+	uint32_t ircalTime; ///< IRCAL command time in us
+	int16_t noise; ///< RSSI of channels with nothing on them in dBm
+	int16_t temperature; ///< Chip temperature in C
+	uint16_t battery; ///< Supply voltage in mV
+} si446x_emu_config_t;
+
+/**
+* @brief Counts of everything that happened on the bus, see ::si446x_emu_stats()
+*/
+typedef struct {
+	uint64_t time; ///< Simulated time in us
+	uint32_t bytes; ///< SPI bytes transferred
+	uint32_t selects; ///< Chip select cycles
+	uint32_t commands; ///< Commands executed
+	uint32_t ctsPolls; ///< READ_CMD_BUFF transactions while the chip was busy (CTS low)
+	uint32_t ctsReads; ///< All READ_CMD_BUFF transactions
+	uint32_t frrReads; ///< Fast response register reads
+	uint32_t fifoBytes; ///< Bytes written to/read from the FIFOs
+	uint32_t overlaps; ///< Commands sent while the chip was busy (ignored by the chip)
+	uint32_t packetsSent; ///< Packets transmitted
+	uint32_t packetsReceived; ///< Packets received without errors
+	uint32_t packetsMissed; ///< Injected packets that arrived while not listening on their channel
+	uint32_t cmdCount[256]; ///< Commands executed for each opcode
+	uint32_t cmdPolls[256]; ///< CTS polls while waiting for each opcode to finish
+} si446x_emu_stats_t;
+
+/**
+* @brief Fill in the default settings (30MHz XO, 100kbps, 4MHz SPI)
+*
+* @param [cfg] Settings to fill in
+* @return (none)
+*/
+void si446x_emu_defaults(si446x_emu_config_t* cfg);
+
+/**
+* @brief Reset the emulator and connect it to the mock bus
+*
+* @param [cfg] Settings, or NULL for defaults
+* @return (none)
+*/
+void si446x_emu_init(const si446x_emu_config_t* cfg);
+
+/**
+* @brief Let simulated time pass without any SPI activity (microcontroller doing something else)
+*
+* @param [us] Microseconds to wait
+* @return (none)
+*/
+void si446x_emu_run(uint32_t us);
+
+/**
+* @brief Get the simulated time
+*
+* @return Time since ::si446x_emu_init() in us
+*/
+uint64_t si446x_emu_time(void);
+
+/**
+* @brief Send a packet to the radio, as if something else had transmitted it
+*
+* The preamble starts \p delay us from now. The packet is only received if the radio is in RX mode on \p channel when the preamble starts.
+*
+* @param [data] On-air packet data after the sync word (for variable length packets this includes the length byte)
+* @param [len] Length of \p data
+* @param [channel] Channel the packet is sent on
+* @param [rssi] Signal strength of the packet in dBm
+* @param [crcOk] 0 to make the packet fail its CRC check
+* @param [delay] Microseconds until the preamble starts
+* @return 0 if there's no room to queue the packet, otherwise 1
+*/
+uint8_t si446x_emu_inject(const void* data, uint16_t len, uint8_t channel, int16_t rssi, uint8_t crcOk, uint32_t delay);
+
+/**
+* @brief Reply to every transmitted packet with a copy of it, like the ping_server example
+*
+* @param [delay] Turnaround time in us of the other end, 0 to disable
+* @param [rssi] Signal strength of the replies
+* @return (none)
+*/
+void si446x_emu_echo(uint32_t delay, int16_t rssi);
+
+/**
+* @brief Set the background RSSI of a channel
+*
+* @param [channel] Channel
+* @param [rssi] RSSI in dBm
+* @return (none)
+*/
+void si446x_emu_setRSSI(uint8_t channel, int16_t rssi);
+
+/**
+* @brief Get a property value
+*
+* @param [prop] Property (group << 8 | index)
+* @return Property value
+*/
+uint8_t si446x_emu_property(uint16_t prop);
+
+/**
+* @brief Get current radio state (::si446x_state_t values)
+*
+* @return State
+*/
+uint8_t si446x_emu_state(void);
+
+/**
+* @brief Get the last packet that was transmitted, as it went out on air (for variable length packets this includes the length byte)
+*
+* @param [buff] Where to put the packet
+* @param [size] Size of \p buff
+* @return Length of the packet
+*/
+uint16_t si446x_emu_lastTX(void* buff, uint16_t size);
+
+/**
+* @brief Get bus and command counts
+*
+* @param [stats] Where to put the counts
+* @return (none)
+*/
+void si446x_emu_stats(si446x_emu_stats_t* stats);
+
+/**
+* @brief Reset the counts (simulated time keeps going)
+*
+* @return (none)
+*/
+void si446x_emu_resetStats(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SI446X_EMU_H_ */
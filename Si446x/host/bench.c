@@ -0,0 +1,1133 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino (Host benchmark)
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+/*
+ * Host benchmark
+ *
+ * Run the library against the emulator and count the SPI bytes, chip select cycles,
+ * CTS polls and simulated time used by each public API call.
+ * Everything is simulated, so the numbers are the same every run.
+ * Results are checked along the way, any that are wrong are printed and the exit status is nonzero.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Si446x.h"
+#include "Si446x_hal.h"
+#include "Si446x_defs.h"
+#include "Si446x_emu.h"
+
+#define CHANNEL 20
+#define PACKET_SIZE 10
+#define TIMEOUT_US 100000
+
+typedef struct {
+	const char* name;
+	uint32_t runs;
+	uint64_t bytes;
+	uint64_t selects;
+	uint64_t ctsPolls;
+	uint64_t commands;
+	uint64_t time;
+} result_t;
+
+static volatile uint8_t gotPacket;
+static volatile uint8_t gotSent;
+static volatile uint8_t sentCount;
+static result_t* sentLatency; // Stop counting when the sent callback runs
+static uint8_t rxBuffer[SI446X_MAX_PACKET_LEN];
+static si446x_emu_stats_t before;
+static uint32_t failures;
+
+// Something didn't do what it should have
+static void fail(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	failures++;
+}
+
+void SI446X_CB_RXCOMPLETE(uint8_t length, int16_t rssi)
+{
+	(void)(rssi);
+	Si446x_read(rxBuffer, length);
+	gotPacket = 1;
+}
+
+#if SI446X_RX_QUEUE
+#define RX_BURST ((SI446X_RX_QUEUE < 4) ? SI446X_RX_QUEUE : 4) // Packets sent back to back
+#define RX_BURST_GAP 2000 // us from the start of one packet to the next, PACKET_SIZE takes 1680us at 100kbps
+#endif
+
+#if SI446X_SCAN
+#define SCAN_SPEEDUP 2 // Si446x_scan() must be at least this many times faster than a sweep with Si446x_RX() and Si446x_getRSSI()
+#endif
+
+#if SI446X_STREAM
+#define STREAM_SIZE 255 // Biggest with the 1 byte length field
+
+static uint8_t streamBuffer[STREAM_SIZE];
+static uint16_t streamLen;
+
+void SI446X_CB_RXSTREAM(uint16_t length, int16_t rssi)
+{
+	(void)(rssi);
+	streamLen = length;
+	gotPacket = 1;
+}
+#endif
+
+#if SI446X_RX_POOL
+void SI446X_CB_RXPACKET(si446x_packet_t* packet)
+{
+	Si446x_release(packet);
+	gotPacket = 1;
+}
+#endif
+
+#if SI446X_HOP
+static uint8_t rxChannel;
+#endif
+
+#if SI446X_RX_POOL || SI446X_RX_QUEUE || SI446X_MAC || SI446X_SCAN
+// Milliseconds, like millis() on Arduino
+uint32_t SI446X_CB_TIMESTAMP(void)
+{
+	return (uint32_t)(si446x_emu_time() / 1000);
+}
+#endif
+
+#if SI446X_MAC
+static volatile uint8_t macAcked;
+static volatile uint8_t macGot;
+
+void SI446X_CB_MACSENT(uint8_t to, uint8_t ok)
+{
+	(void)(to);
+	macAcked = ok ? 1 : 2;
+}
+
+void SI446X_CB_MACRX(uint8_t from, uint8_t* data, uint8_t len, int16_t rssi)
+{
+	(void)(from);
+	(void)(data);
+	(void)(len);
+	(void)(rssi);
+	macGot++;
+}
+#endif
+
+#if SI446X_ASYNC
+static uint8_t asyncCallbacks;
+
+static void asyncCallback(si446x_cmd_t* cmd)
+{
+	(void)(cmd);
+	asyncCallbacks++;
+}
+#endif
+
+// Main loop side of the receive queue
+static void checkQueue(void)
+{
+#if SI446X_RX_QUEUE
+	si446x_packet_t* packet = Si446x_queuePeek();
+	if(packet != NULL)
+	{
+#if SI446X_HOP
+		rxChannel = packet->channel;
+#endif
+		Si446x_queuePop();
+		gotPacket = 1;
+	}
+#endif
+}
+
+#if SI446X_HOP
+void SI446X_CB_RXCHANNEL(uint8_t channel)
+{
+	rxChannel = channel;
+}
+#endif
+
+static void begin(void)
+{
+	si446x_emu_stats(&before);
+}
+
+static void end(result_t* result)
+{
+	si446x_emu_stats_t after;
+	si446x_emu_stats(&after);
+	result->runs++;
+	result->bytes += after.bytes - before.bytes;
+	result->selects += after.selects - before.selects;
+	result->ctsPolls += after.ctsPolls - before.ctsPolls;
+	result->commands += after.commands - before.commands;
+	result->time += after.time - before.time;
+}
+
+void SI446X_CB_SENT(void)
+{
+	if(sentLatency != NULL)
+	{
+		end(sentLatency);
+		sentLatency = NULL;
+	}
+	gotSent = 1;
+	sentCount++;
+}
+
+#if SI446X_IRCAL_CACHE
+// Pretend EEPROM
+static si446x_ircal_t storedCal;
+static uint8_t haveCal;
+
+uint8_t SI446X_CB_IRCAL_LOAD(si446x_ircal_t* cal)
+{
+	*cal = storedCal;
+	return haveCal;
+}
+
+void SI446X_CB_IRCAL_SAVE(si446x_ircal_t* cal)
+{
+	storedCal = *cal;
+	haveCal = 1;
+}
+#endif
+
+// Let time pass until NIRQ goes low or the flag is set, running the ISR when needed
+static uint8_t waitFor(volatile uint8_t* flag)
+{
+	uint64_t start = si446x_emu_time();
+	while(!*flag)
+	{
+		if(si446x_emu_time() - start > TIMEOUT_US)
+			return 0;
+		if(!si446x_hal_irq())
+			Si446x_SERVICE();
+		else
+			si446x_emu_run(1);
+		checkQueue();
+	}
+	return 1;
+}
+
+#if SI446X_MAC
+// Longest the MAC can keep sending for, every retry with the most backoff (ms)
+#define MAC_GIVE_UP ((SI446X_MAC_RETRIES + 1) * (SI446X_MAC_ACK_TIMEOUT + (SI446X_MAC_BACKOFF<<SI446X_MAC_RETRIES) + 1))
+
+// Same as waitFor() but with Si446x_macPoll() in the main loop so retries happen
+static uint8_t waitMAC(volatile uint8_t* flag)
+{
+	uint64_t start = si446x_emu_time();
+	while(!*flag)
+	{
+		if(si446x_emu_time() - start > (MAC_GIVE_UP * 1000ULL) + TIMEOUT_US)
+			return 0;
+		Si446x_macPoll();
+		if(!si446x_hal_irq())
+			Si446x_SERVICE();
+		else
+			si446x_emu_run(1);
+	}
+	return 1;
+}
+#endif
+
+static void waitIRQ(void)
+{
+	uint64_t start = si446x_emu_time();
+	while(si446x_hal_irq() && si446x_emu_time() - start < TIMEOUT_US)
+		si446x_emu_run(1);
+}
+
+// Let time pass until the radio is listening again after changing channel
+static void waitListening(void)
+{
+	uint64_t start = si446x_emu_time();
+	while(si446x_emu_state() != SI446X_STATE_RX && si446x_emu_time() - start < TIMEOUT_US)
+		si446x_emu_run(1);
+}
+
+#if SI446X_RX_QUEUE || SI446X_LINK_STATS
+// Let time pass, running the ISR when needed
+static void serviceFor(uint32_t us)
+{
+	uint64_t until = si446x_emu_time() + us;
+	while(si446x_emu_time() < until)
+	{
+		if(!si446x_hal_irq())
+			Si446x_SERVICE();
+		else
+			si446x_emu_run(1);
+	}
+}
+#endif
+
+#if SI446X_LINK_STATS
+// MAC frame from src to another node, runs until it's been received
+static void linkInject(uint8_t src, uint8_t ctrl, uint8_t seq, int16_t rssi, uint8_t crcOk)
+{
+	uint8_t frame[1 + SI446X_MAC_HEADER_LEN] = {SI446X_MAC_HEADER_LEN, 9, src, ctrl, seq};
+	si446x_emu_inject(frame, sizeof(frame), CHANNEL, rssi, crcOk, 100);
+	serviceFor(2000);
+}
+
+// What the library should do with the RSSI of a packet it has counted
+static void linkExpect(si446x_link_t* link, int16_t rssi)
+{
+	if(link->received)
+		link->rssiAvg += ((rssi * 16) - link->rssiAvg) / (1<<SI446X_LINK_EWMA);
+	else
+		link->rssiAvg = rssi * 16;
+	link->received++;
+
+	int16_t bin = (rssi - SI446X_LINK_HIST_MIN) / SI446X_LINK_HIST_WIDTH;
+	if(bin < 0)
+		bin = 0;
+	else if(bin >= SI446X_LINK_HIST_BINS)
+		bin = SI446X_LINK_HIST_BINS - 1;
+	if(++link->histogram[bin] == 0xFF)
+	{
+		for(uint8_t i=0;i<SI446X_LINK_HIST_BINS;i++)
+			link->histogram[i] /= 2;
+	}
+}
+
+// Compare the library's stats for a peer against what they should be
+static void linkCheck(const char* what, const si446x_link_t* expect)
+{
+	si446x_link_t links[SI446X_LINK_PEERS];
+	uint8_t count = Si446x_linkStats(links, SI446X_LINK_PEERS);
+	for(uint8_t i=0;i<count;i++)
+	{
+		const si446x_link_t* link = &links[i];
+		if(link->address != expect->address)
+			continue;
+
+		if(link->seq != expect->seq || link->seqValid != expect->seqValid)
+			fail("Link %s: seq %u/%u, expected %u/%u\n", what, link->seq, link->seqValid, expect->seq, expect->seqValid);
+		if(link->rssiAvg != expect->rssiAvg)
+			fail("Link %s: RSSI average %d, expected %d\n", what, link->rssiAvg, expect->rssiAvg);
+		if(link->received != expect->received || link->lost != expect->lost || link->duplicates != expect->duplicates)
+			fail("Link %s: %u received, %u lost, %u duplicates, expected %u, %u, %u\n", what, link->received, link->lost, link->duplicates, expect->received, expect->lost, expect->duplicates);
+		for(uint8_t j=0;j<SI446X_LINK_HIST_BINS;j++)
+		{
+			if(link->histogram[j] != expect->histogram[j])
+				fail("Link %s: histogram bin %u is %u, expected %u\n", what, j, link->histogram[j], expect->histogram[j]);
+		}
+		return;
+	}
+	fail("Link %s: peer %u missing\n", what, expect->address);
+}
+#endif
+
+static void print(const result_t* result)
+{
+	uint32_t n = result->runs ? result->runs : 1;
+	printf("%-22s %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+		result->name,
+		(double)result->bytes / n,
+		(double)result->selects / n,
+		(double)result->ctsPolls / n,
+		(double)result->commands / n,
+		(double)result->time / n
+	);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t iterations = (argc > 1) ? (uint32_t)atoi(argv[1]) : 100;
+	if(iterations == 0)
+		iterations = 1;
+
+	si446x_emu_init(NULL);
+
+	result_t init = {.name = "Si446x_init"};
+	result_t reinit = {.name = "Si446x_init (again)"};
+	result_t getInfo = {.name = "Si446x_getInfo"};
+	result_t getState = {.name = "Si446x_getState"};
+	result_t setTxPower = {.name = "Si446x_setTxPower"};
+	result_t setupCallback = {.name = "Si446x_setupCallback"};
+	result_t adcTemp = {.name = "Si446x_adc_temperature"};
+	result_t wut = {.name = "Si446x_setupWUT"};
+	result_t disableWut = {.name = "Si446x_disableWUT"};
+	result_t rx = {.name = "Si446x_RX"};
+	result_t getRSSI = {.name = "Si446x_getRSSI"};
+	result_t rxChange = {.name = "RX channel change"};
+#if SI446X_HOP
+	result_t hop = {.name = "Si446x_hop"};
+	result_t rxHopSetup = {.name = "Si446x_setupRXHop"};
+	result_t rxHopScan = {.name = "RX hop scan to packet"};
+#endif
+	result_t tx = {.name = "Si446x_TX"};
+	result_t load = {.name = "Si446x_load"};
+	result_t fire = {.name = "Si446x_fire"};
+	result_t retransmit = {.name = "Si446x_retransmit"};
+	result_t isrSent = {.name = "ISR (sent)"};
+	result_t cbSent = {.name = "ISR to sent callback"};
+	result_t isrRx = {.name = "ISR (rx + read)"};
+	result_t ping = {.name = "Ping round trip"};
+#if SI446X_ASYNC
+	result_t async = {.name = "Async ADC (poll 100us)"};
+#endif
+#if SI446X_CCA
+	result_t txBusy = {.name = "Si446x_TX busy channel"};
+#endif
+#if SI446X_MAC
+	result_t macSend = {.name = "MAC send until ACKed"};
+	result_t macAck = {.name = "MAC receive and ACK"};
+#if SI446X_MAC_RETRIES
+	result_t macRetry = {.name = "MAC ACK lost, retry"};
+#endif
+	result_t macGiveUp = {.name = "MAC no ACK, give up"};
+	result_t macDup = {.name = "MAC duplicate dropped"};
+#if SI446X_PROP_BATCH
+	result_t macBatch = {.name = "MAC ACK with a batch open"};
+#endif
+#endif
+#if SI446X_RX_QUEUE
+	result_t rxBurst = {.name = "RX queue burst"};
+	result_t rxOverflow = {.name = "ISR (rx, queue full)"};
+#endif
+#if SI446X_TX_QUEUE
+	result_t txBurst = {.name = "4x128B Si446x_TX"};
+	result_t txQueued = {.name = "4x128B Si446x_TXQueue"};
+#endif
+#if SI446X_STREAM
+	result_t txSplit = {.name = "255B as 2x Si446x_TX"};
+	result_t txStream = {.name = "255B Si446x_TXStream"};
+	result_t rxStream = {.name = "255B Si446x_RXStream"};
+#endif
+#if SI446X_SCAN
+	result_t scanPoll = {.name = "16ch x8 RX + getRSSI"};
+	result_t scan = {.name = "16ch x8 Si446x_scan"};
+#endif
+
+	begin();
+	Si446x_init();
+	end(&init);
+
+	// Radio is still setup, like after a watchdog reset (SI446X_WARM_START), and the IRCAL result has been stored (SI446X_IRCAL_CACHE)
+	begin();
+	Si446x_init();
+	end(&reinit);
+
+#if SI446X_HOP
+	si446x_synth_t synth[2];
+	Si446x_hopSynth(CHANNEL + 1, &synth[0]);
+	Si446x_hopSynth(CHANNEL, &synth[1]);
+#endif
+
+	uint8_t packet[PACKET_SIZE] = "ping";
+
+#if SI446X_STATS
+	// The library's own counters should see the same bus traffic as the emulator
+	si446x_emu_stats_t statsStart;
+	si446x_emu_stats(&statsStart);
+	Si446x_resetStats();
+#endif
+
+	for(uint32_t i=0;i<iterations;i++)
+	{
+		si446x_info_t info;
+		begin();
+		Si446x_getInfo(&info);
+		end(&getInfo);
+
+		begin();
+		Si446x_getState();
+		end(&getState);
+
+		begin();
+		Si446x_setTxPower(SI446X_MAX_TX_POWER);
+		end(&setTxPower);
+
+		begin();
+		Si446x_setupCallback(SI446X_CBS_SENT, 1);
+		end(&setupCallback);
+
+		begin();
+		Si446x_adc_temperature();
+		end(&adcTemp);
+
+		begin();
+		Si446x_setupWUT(1, 8000, 0, SI446X_WUT_RUN);
+		end(&wut);
+
+		begin();
+		Si446x_disableWUT();
+		end(&disableWut);
+
+		begin();
+		Si446x_RX(CHANNEL);
+		end(&rx);
+
+		si446x_emu_run(200);
+
+		begin();
+		Si446x_getRSSI();
+		end(&getRSSI);
+
+		// Channel change until listening again, the normal way and then hopping back
+		begin();
+		Si446x_RX(CHANNEL + 1);
+		waitListening();
+		end(&rxChange);
+
+#if SI446X_HOP
+		begin();
+		Si446x_hop(&synth[1]);
+		waitListening();
+		end(&hop);
+
+		// Radio scans 4 channels by itself, packet turns up on the 3rd one
+		static const uint8_t hopTable[] = {CHANNEL, CHANNEL + 10, CHANNEL + 20, CHANNEL + 30};
+		begin();
+		Si446x_setupRXHop(SI446X_RXHOP_RSSI, 2, -100, hopTable, sizeof(hopTable));
+		end(&rxHopSetup);
+
+		uint8_t hopPacket[PACKET_SIZE + 1] = {PACKET_SIZE, 'h', 'o', 'p'};
+		Si446x_RX(CHANNEL);
+		si446x_emu_inject(hopPacket, sizeof(hopPacket), CHANNEL + 20, -60, 1, 1000);
+		gotPacket = 0;
+		begin();
+		if(!waitFor(&gotPacket) || rxChannel != CHANNEL + 20)
+			fail("RX hop scan failed\n");
+		end(&rxHopScan);
+		Si446x_setupRXHop(SI446X_RXHOP_OFF, 0, 0, NULL, 0);
+#endif
+		Si446x_RX(CHANNEL);
+		si446x_emu_run(200);
+
+		// Transmit and handle the sent interrupt
+		gotSent = 0;
+		begin();
+		Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_RX);
+		end(&tx);
+
+		waitIRQ();
+		begin();
+		sentLatency = &cbSent;
+		Si446x_SERVICE();
+		end(&isrSent);
+
+		// Load once, then send it twice (beacon/ARQ retry)
+		uint8_t bigPacket[SI446X_MAX_PACKET_LEN] = "beacon";
+		begin();
+		Si446x_load(bigPacket, sizeof(bigPacket));
+		end(&load);
+
+		gotSent = 0;
+		begin();
+		Si446x_fire(CHANNEL, SI446X_STATE_SLEEP);
+		end(&fire);
+		waitFor(&gotSent);
+
+		gotSent = 0;
+		begin();
+		if(!Si446x_retransmit(CHANNEL, SI446X_STATE_RX))
+			fail("Retransmit failed\n");
+		end(&retransmit);
+		waitFor(&gotSent);
+
+		// Receive a packet
+		uint8_t onAir[PACKET_SIZE + 1] = {PACKET_SIZE, 'p', 'o', 'n', 'g'};
+		si446x_emu_run(200);
+		si446x_emu_inject(onAir, sizeof(onAir), CHANNEL, -60, 1, 0);
+		gotPacket = 0;
+		while(!gotPacket)
+		{
+			waitIRQ();
+			begin();
+			Si446x_SERVICE();
+			end(&isrRx);
+			checkQueue();
+		}
+
+		// Firing while a packet is half way in fails, but the radio carries on receiving it
+		Si446x_load(packet, sizeof(packet));
+		Si446x_RX(CHANNEL);
+		waitListening();
+		si446x_emu_inject(onAir, sizeof(onAir), CHANNEL, -60, 1, 0);
+		si446x_emu_run(1000);
+		gotPacket = 0;
+		if(Si446x_fire(CHANNEL, SI446X_STATE_RX) || si446x_emu_state() != SI446X_STATE_RX)
+			fail("Fire during RX: state %u\n", si446x_emu_state());
+		if(!waitFor(&gotPacket))
+			fail("Fire during RX lost the packet being received\n");
+
+		// Ping, the other end replies after 500us
+		si446x_emu_echo(500, -60);
+		gotPacket = 0;
+		begin();
+		Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_RX);
+		if(!waitFor(&gotPacket))
+			fail("Ping timed out\n");
+		end(&ping);
+		si446x_emu_echo(0, 0);
+
+#if SI446X_RX_QUEUE
+		// Packets back to back with the main loop busy, the ISR has to queue them all without missing any
+		static uint8_t burst[RX_BURST][PACKET_SIZE + 1];
+		for(uint8_t j=0;j<RX_BURST;j++)
+		{
+			burst[j][0] = PACKET_SIZE;
+			burst[j][1] = 'q';
+			burst[j][2] = (uint8_t)('0' + j);
+			si446x_emu_inject(burst[j], sizeof(burst[j]), CHANNEL, -60, 1, 200 + (j * RX_BURST_GAP));
+		}
+		begin();
+		serviceFor(200 + (RX_BURST * RX_BURST_GAP));
+		end(&rxBurst);
+
+		uint8_t queued = 0;
+		si446x_packet_t* queuedPacket;
+		while((queuedPacket = Si446x_queuePeek()) != NULL)
+		{
+			if(queued >= RX_BURST || queuedPacket->length != PACKET_SIZE || memcmp(queuedPacket->data, burst[queued] + 1, PACKET_SIZE))
+				fail("RX queue burst packet %u wrong\n", queued);
+			queued++;
+			Si446x_queuePop();
+		}
+		if(queued != RX_BURST)
+			fail("RX queue burst: %u of %u packets\n", queued, RX_BURST);
+
+		// Queue fills up and the ISR is late for the next packet, only that one is dropped and not the one arriving behind it
+		si446x_queue_stats_t overflowBefore, overflowAfter;
+		Si446x_queueStats(&overflowBefore);
+		static uint8_t fill[SI446X_RX_QUEUE + 2][PACKET_SIZE + 1];
+		for(uint8_t j=0;j<SI446X_RX_QUEUE + 2;j++)
+		{
+			fill[j][0] = PACKET_SIZE;
+			fill[j][1] = 'f';
+			fill[j][2] = j;
+		}
+		for(uint8_t j=0;j<SI446X_RX_QUEUE;j++)
+		{
+			si446x_emu_inject(fill[j], sizeof(fill[j]), CHANNEL, -60, 1, 200);
+			serviceFor(200 + RX_BURST_GAP);
+		}
+		si446x_emu_inject(fill[SI446X_RX_QUEUE], sizeof(fill[0]), CHANNEL, -60, 1, 200);
+		si446x_emu_inject(fill[SI446X_RX_QUEUE + 1], sizeof(fill[0]), CHANNEL, -60, 1, 200 + RX_BURST_GAP);
+		si446x_emu_run(200 + RX_BURST_GAP + 1200);
+		begin();
+		Si446x_SERVICE();
+		end(&rxOverflow);
+		Si446x_queuePop();
+		serviceFor(RX_BURST_GAP);
+		Si446x_queueStats(&overflowAfter);
+		if(overflowAfter.dropped != overflowBefore.dropped + 1)
+			fail("RX queue overflow: %u dropped, expected 1\n", overflowAfter.dropped - overflowBefore.dropped);
+
+		queued = 0;
+		while((queuedPacket = Si446x_queuePeek()) != NULL)
+		{
+			uint8_t expect = (queued < SI446X_RX_QUEUE - 1) ? queued + 1 : SI446X_RX_QUEUE + 1;
+			if(queued >= SI446X_RX_QUEUE || queuedPacket->length != PACKET_SIZE || memcmp(queuedPacket->data, fill[expect] + 1, PACKET_SIZE))
+				fail("RX queue overflow packet %u wrong\n", queued);
+			queued++;
+			Si446x_queuePop();
+		}
+		if(queued != SI446X_RX_QUEUE)
+			fail("RX queue overflow: %u of %u packets\n", queued, SI446X_RX_QUEUE);
+#endif
+
+#if SI446X_CCA
+		// Something else is using the channel, back off until giving up
+		si446x_emu_setRSSI(CHANNEL, -60);
+		begin();
+		if(Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_RX) || !Si446x_channelBusy())
+			fail("TX on a busy channel\n");
+		end(&txBusy);
+
+		// Giving up puts the radio back how it was, asleep or listening on another channel
+		// (Asleep and SPI active look the same once the state has been read, so it can only tell them apart if the idle mode isn't SPI active)
+		uint8_t asleep = (SI446X_IDLE_MODE == SI446X_STATE_SPI_ACTIVE) ? SI446X_STATE_SPI_ACTIVE : SI446X_STATE_SLEEP;
+		Si446x_sleep();
+		if(Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_RX) || si446x_emu_state() != asleep)
+			fail("Busy channel didn't go back to sleep: %u\n", si446x_emu_state());
+		Si446x_RX(CHANNEL + 1);
+		waitListening();
+		if(Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_RX))
+			fail("TX on a busy channel\n");
+		si446x_emu_inject(onAir, sizeof(onAir), CHANNEL + 1, -60, 1, 200);
+		gotPacket = 0;
+		if(!waitFor(&gotPacket))
+			fail("Busy channel didn't go back to RX on the other channel\n");
+		si446x_emu_setRSSI(CHANNEL, -115); // Default noise floor
+
+		// Already sending, mustn't start listening over the top of it
+		gotSent = 0;
+		Si446x_TX(bigPacket, sizeof(bigPacket), CHANNEL, SI446X_STATE_RX);
+		if(Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_RX) || Si446x_channelBusy())
+			fail("TX while already transmitting\n");
+		uint8_t sent[1 + sizeof(bigPacket)];
+		if(!waitFor(&gotSent) || si446x_emu_lastTX(sent, sizeof(sent)) != sizeof(sent) || memcmp(sent + 1, bigPacket, sizeof(bigPacket)))
+			fail("Packet being sent was stopped\n");
+		Si446x_RX(CHANNEL);
+#endif
+
+#if SI446X_MAC
+		// Other end ACKs 500us after the packet, like the ping round trip
+		Si446x_macInit(1, CHANNEL);
+		uint8_t macData[PACKET_SIZE] = "mac";
+		macAcked = 0;
+		gotSent = 0;
+		begin();
+		Si446x_macSend(2, macData, sizeof(macData));
+		waitFor(&gotSent);
+		uint8_t frame[1 + SI446X_MAC_HEADER_LEN + PACKET_SIZE];
+		si446x_emu_lastTX(frame, sizeof(frame));
+		uint8_t ack[1 + SI446X_MAC_HEADER_LEN] = {SI446X_MAC_HEADER_LEN, frame[2], frame[1], 0x01, frame[4]};
+		si446x_emu_inject(ack, sizeof(ack), CHANNEL, -60, 1, 500);
+		if(!waitFor(&macAcked) || macAcked != 1)
+			fail("MAC send failed\n");
+		end(&macSend);
+
+		// Packet to us wanting an ACK, until the ACK has been sent
+		static uint8_t macIn[1 + SI446X_MAC_HEADER_LEN + PACKET_SIZE] = {SI446X_MAC_HEADER_LEN + PACKET_SIZE, 1, 2, 0x02};
+		macIn[4]++;
+		si446x_emu_inject(macIn, sizeof(macIn), CHANNEL, -60, 1, 500);
+		macGot = 0;
+		gotSent = 0;
+		begin();
+		if(!waitFor(&gotSent) || macGot != 1)
+			fail("MAC ACK failed\n");
+		end(&macAck);
+
+#if SI446X_MAC_RETRIES
+		// First ACK doesn't arrive, the same frame is sent again and that one gets ACKed
+		macAcked = 0;
+		gotSent = 0;
+		sentCount = 0;
+		begin();
+		Si446x_macSend(2, macData, sizeof(macData));
+		waitFor(&gotSent);
+		uint8_t retryFrame[sizeof(frame)];
+		si446x_emu_lastTX(frame, sizeof(frame));
+		gotSent = 0;
+		if(!waitMAC(&gotSent))
+			fail("MAC didn't retry\n");
+		si446x_emu_lastTX(retryFrame, sizeof(retryFrame));
+		if(memcmp(frame, retryFrame, sizeof(frame)))
+			fail("MAC retry isn't the same frame\n");
+		ack[1] = frame[2];
+		ack[2] = frame[1];
+		ack[4] = frame[4];
+		si446x_emu_inject(ack, sizeof(ack), CHANNEL, -60, 1, 500);
+		if(!waitMAC(&macAcked) || macAcked != 1 || sentCount != 2)
+			fail("MAC retry failed: %u, sent %u times\n", macAcked, sentCount);
+		end(&macRetry);
+#endif
+
+		// Nothing ACKs, the MAC gives up after all of its retries
+		macAcked = 0;
+		sentCount = 0;
+		begin();
+		Si446x_macSend(2, macData, sizeof(macData));
+		if(!waitMAC(&macAcked) || macAcked != 2 || sentCount != SI446X_MAC_RETRIES + 1)
+			fail("MAC give up failed: %u, sent %u times\n", macAcked, sentCount);
+		end(&macGiveUp);
+
+		// Our ACK was lost so the same packet turns up again, it's ACKed again but only passed on once
+		macIn[4]++;
+		macGot = 0;
+		sentCount = 0;
+		begin();
+		for(uint8_t j=0;j<2;j++)
+		{
+			gotSent = 0;
+			si446x_emu_inject(macIn, sizeof(macIn), CHANNEL, -60, 1, 500);
+			if(!waitFor(&gotSent))
+				fail("MAC duplicate not ACKed\n");
+		}
+		if(macGot != 1 || sentCount != 2)
+			fail("MAC duplicate: passed on %u times, %u ACKs\n", macGot, sentCount);
+
+		// Then the next one isn't a duplicate
+		macIn[4]++;
+		gotSent = 0;
+		si446x_emu_inject(macIn, sizeof(macIn), CHANNEL, -60, 1, 500);
+		if(!waitFor(&gotSent) || macGot != 2)
+			fail("MAC packet after a duplicate: %u passed on, expected 2\n", macGot);
+		end(&macDup);
+
+#if SI446X_PROP_BATCH
+		// The ACK goes out while the app is half way through a batch, its length and TX can't wait for the commit
+		si446x_emu_stats_t batchBefore, batchAfter;
+		si446x_emu_stats(&batchBefore);
+		macIn[4]++;
+		gotSent = 0;
+		begin();
+		Si446x_beginProperties();
+		Si446x_setProperty(SI446X_PA_PWR_LVL, 0x20);
+		si446x_emu_inject(macIn, sizeof(macIn), CHANNEL, -60, 1, 500);
+		if(!waitFor(&gotSent))
+			fail("MAC ACK with a batch open wasn't sent\n");
+		waitListening();
+		si446x_emu_stats(&batchAfter);
+		uint8_t sentAck[sizeof(frame)];
+		uint16_t sentLen = si446x_emu_lastTX(sentAck, sizeof(sentAck));
+		uint8_t expectAck[1 + SI446X_MAC_HEADER_LEN] = {SI446X_MAC_HEADER_LEN, macIn[2], 1, 0x01, macIn[4]};
+		if(batchAfter.packetsSent != batchBefore.packetsSent + 1 || sentLen != sizeof(expectAck) || memcmp(sentAck, expectAck, sizeof(expectAck)))
+			fail("MAC ACK with a batch open: %u sent, %u bytes\n", batchAfter.packetsSent - batchBefore.packetsSent, sentLen);
+		if(si446x_emu_state() != SI446X_STATE_RX)
+			fail("MAC ACK with a batch open didn't go back to RX: %u\n", si446x_emu_state());
+		Si446x_commitProperties();
+		end(&macBatch);
+#endif
+		Si446x_macStop();
+		Si446x_RX(CHANNEL);
+#endif
+
+#if SI446X_TX_QUEUE
+		// Bulk upload, 4 full packets back to back until the last one has been sent
+		static uint8_t bulk[4][SI446X_MAX_PACKET_LEN] = {"bulk"};
+		begin();
+		for(uint8_t j=0;j<4;j++)
+		{
+			gotSent = 0;
+			Si446x_TX(bulk[j], sizeof(bulk[j]), CHANNEL, SI446X_STATE_SLEEP);
+			waitFor(&gotSent);
+		}
+		end(&txBurst);
+
+		begin();
+		sentCount = 0;
+		for(uint8_t j=0;j<4;j++)
+		{
+			if(!Si446x_TXQueue(bulk[j], sizeof(bulk[j]), CHANNEL, SI446X_STATE_SLEEP))
+				fail("TX queue full\n");
+		}
+		if(Si446x_TX(packet, sizeof(packet), CHANNEL, SI446X_STATE_SLEEP))
+			fail("TX while the TX queue is sending\n");
+		while(sentCount < 4)
+		{
+			gotSent = 0;
+			if(!waitFor(&gotSent))
+			{
+				fail("TX queue stalled\n");
+				break;
+			}
+		}
+		end(&txQueued);
+
+		// Once the queue has drained the radio is in the last packet's finish state and the queue can be used again
+		// Asleep, the sent interrupt's SPI traffic will have woken it into SPI_ACTIVE
+		if(si446x_emu_state() != SI446X_STATE_SLEEP && si446x_emu_state() != SI446X_STATE_SPI_ACTIVE)
+			fail("TX queue drained into state %u\n", si446x_emu_state());
+		sentCount = 0;
+		for(uint8_t j=0;j<2;j++)
+		{
+			if(!Si446x_TXQueue(bulk[j], sizeof(bulk[j]), CHANNEL, SI446X_STATE_SLEEP))
+				fail("TX queue refused after draining\n");
+		}
+		while(sentCount < 2)
+		{
+			gotSent = 0;
+			if(!waitFor(&gotSent))
+			{
+				fail("TX queue stalled after draining\n");
+				break;
+			}
+		}
+#endif
+
+#if SI446X_STREAM
+		// 255 bytes until sent, split into 2 packets and then streamed as 1
+		static uint8_t big[STREAM_SIZE] = "stream";
+		begin();
+		for(uint8_t j=0;j<2;j++)
+		{
+			gotSent = 0;
+			Si446x_TX(big + (j * SI446X_MAX_PACKET_LEN), j ? (STREAM_SIZE - SI446X_MAX_PACKET_LEN) : SI446X_MAX_PACKET_LEN, CHANNEL, SI446X_STATE_SLEEP);
+			waitFor(&gotSent);
+		}
+		end(&txSplit);
+
+		gotSent = 0;
+		begin();
+		if(!Si446x_TXStream(big, sizeof(big), CHANNEL, SI446X_STATE_SLEEP) || !waitFor(&gotSent))
+			fail("TX stream failed\n");
+		end(&txStream);
+
+		// Receive 255 bytes
+		static uint8_t bigOnAir[STREAM_SIZE + 1] = {STREAM_SIZE, 'b', 'i', 'g'};
+		Si446x_RXStream(streamBuffer, sizeof(streamBuffer), CHANNEL);
+		si446x_emu_inject(bigOnAir, sizeof(bigOnAir), CHANNEL, -60, 1, 200);
+		gotPacket = 0;
+		begin();
+		if(!waitFor(&gotPacket) || streamLen != STREAM_SIZE || memcmp(streamBuffer, bigOnAir + 1, STREAM_SIZE))
+			fail("RX stream failed\n");
+		end(&rxStream);
+		Si446x_RX(CHANNEL);
+#endif
+
+#if SI446X_SCAN
+		// Sweep 16 channels with one busy one, 8 RSSI readings each
+		si446x_emu_setRSSI(CHANNEL, -60);
+		int16_t peaks[16];
+		begin();
+		for(uint8_t ch=0;ch<16;ch++)
+		{
+			Si446x_RX(CHANNEL - 8 + ch);
+			waitListening();
+			peaks[ch] = -999;
+			for(uint8_t j=0;j<8;j++)
+			{
+				int16_t rssi = Si446x_getRSSI();
+				if(rssi > peaks[ch])
+					peaks[ch] = rssi;
+			}
+		}
+		end(&scanPoll);
+
+		si446x_scan_t sweep[16];
+		begin();
+		if(!Si446x_scan(CHANNEL - 8, 16, 8, sweep))
+			fail("Scan failed\n");
+		end(&scan);
+		for(uint8_t ch=0;ch<16;ch++)
+		{
+			if(sweep[ch].peak != peaks[ch] || sweep[ch].mean != peaks[ch])
+				fail("Scan channel %u: %d/%d, expected %d\n", CHANNEL - 8 + ch, sweep[ch].peak, sweep[ch].mean, peaks[ch]);
+		}
+		si446x_emu_setRSSI(CHANNEL, -115);
+
+		// Mustn't sweep while a packet is going out
+		gotSent = 0;
+		Si446x_TX(bigPacket, sizeof(bigPacket), CHANNEL, SI446X_STATE_RX);
+		if(Si446x_scan(CHANNEL - 8, 16, 8, sweep))
+			fail("Scan while transmitting\n");
+		uint8_t scanSent[1 + sizeof(bigPacket)];
+		if(!waitFor(&gotSent) || si446x_emu_lastTX(scanSent, sizeof(scanSent)) != sizeof(scanSent) || memcmp(scanSent + 1, bigPacket, sizeof(bigPacket)))
+			fail("Scan stopped the packet being sent\n");
+		Si446x_RX(CHANNEL);
+#endif
+
+#if SI446X_ASYNC
+		// Temperature reading while the main loop does something else, checking back every 100us
+		static const uint8_t adc[] = {SI446X_CMD_GET_ADC_READING, SI446X_ADC_CONV_TEMP, (SI446X_ADC_SPEED<<4)};
+		uint8_t adcOut[6];
+		si446x_cmd_t cmd = {.status = SI446X_ASYNC_IDLE};
+		begin();
+		Si446x_submit(&cmd, adc, sizeof(adc), adcOut, sizeof(adcOut), NULL);
+		while(Si446x_poll())
+			si446x_emu_run(100);
+		end(&async);
+
+		// Packet arrives while a command is with the radio, the ISR reads the response but the callback waits for Si446x_poll()
+		Si446x_RX(CHANNEL);
+		si446x_cmd_t isrCmd;
+		memset(&isrCmd, 0x55, sizeof(isrCmd)); // Doesn't need clearing first
+		asyncCallbacks = 0;
+		if(!Si446x_submit(&isrCmd, adc, sizeof(adc), adcOut, sizeof(adcOut), asyncCallback))
+			fail("Async submit refused\n");
+		Si446x_poll();
+		si446x_emu_inject(onAir, sizeof(onAir), CHANNEL, -60, 1, 200);
+		gotPacket = 0;
+		if(!waitFor(&gotPacket))
+			fail("Packet lost with an async command sent\n");
+		if(asyncCallbacks)
+			fail("Async callback ran from the ISR\n");
+		while(Si446x_poll())
+			si446x_emu_run(100);
+		if(asyncCallbacks != 1 || isrCmd.status != SI446X_ASYNC_DONE)
+			fail("Async command after the ISR: %u callbacks, status %u\n", asyncCallbacks, isrCmd.status);
+#endif
+	}
+
+#if SI446X_STATS
+	si446x_emu_stats_t statsEnd;
+	si446x_emu_stats(&statsEnd);
+	si446x_stats_t libStats;
+	Si446x_getStats(&libStats);
+	uint32_t libPolls = 0;
+	for(uint8_t i=0;i<SI446X_STATS_OPCODES;i++)
+		libPolls += libStats.ctsPolls[i];
+#if SI446X_GPIO_CTS != -1
+	libPolls = statsEnd.ctsPolls - statsStart.ctsPolls; // Counts pin checks instead
+#endif
+	if(libStats.spiBytes != statsEnd.bytes - statsStart.bytes || libStats.selects != statsEnd.selects - statsStart.selects || libPolls != statsEnd.ctsPolls - statsStart.ctsPolls)
+		fail("Library counters don't match the emulator: %u/%u bytes, %u/%u selects, %u/%u polls\n", libStats.spiBytes, statsEnd.bytes - statsStart.bytes, libStats.selects, statsEnd.selects - statsStart.selects, libPolls, statsEnd.ctsPolls - statsStart.ctsPolls);
+#endif
+
+#if SI446X_LINK_STATS
+	// Only once, filling a histogram bin takes a while
+	Si446x_macInit(1, CHANNEL);
+	Si446x_linkReset();
+	si446x_link_t links[SI446X_LINK_PEERS + 1];
+	if(Si446x_linkStats(links, SI446X_LINK_PEERS) || Si446x_linkCRCErrors())
+		fail("Link stats not cleared\n");
+
+	// A packet in each histogram bin, then below the first and above the last
+	si446x_link_t expect = {.address = 5, .seqValid = 1};
+	uint8_t seq = 10;
+	for(int8_t bin=0;bin<SI446X_LINK_HIST_BINS + 2;bin++)
+	{
+		int16_t rssi = SI446X_LINK_HIST_MIN + (bin * SI446X_LINK_HIST_WIDTH) + (SI446X_LINK_HIST_WIDTH / 2);
+		if(bin == SI446X_LINK_HIST_BINS)
+			rssi = SI446X_LINK_HIST_MIN - SI446X_LINK_HIST_WIDTH;
+		linkInject(5, 0, seq, rssi, 1);
+		expect.seq = seq++;
+		linkExpect(&expect, rssi);
+	}
+	linkCheck("histogram", &expect);
+
+	// 3 packets missed
+	seq += 3;
+	linkInject(5, 0, seq, -60, 1);
+	expect.seq = seq++;
+	expect.lost += 3;
+	linkExpect(&expect, -60);
+	linkCheck("lost", &expect);
+
+	// Same one again, only counted as a duplicate
+	linkInject(5, 0, expect.seq, -60, 1);
+	expect.duplicates++;
+	linkCheck("duplicate", &expect);
+
+	// Sequence number jumps too far (the peer restarted), not counted as lost
+	seq += 100;
+	linkInject(5, 0, seq, -60, 1);
+	expect.seq = seq++;
+	linkExpect(&expect, -60);
+	linkCheck("restart", &expect);
+
+	// ACKs have the sequence number of the packet being ACKed, so they're counted without touching the sequence number
+	linkInject(5, 0x01, 0, -60, 1);
+	linkExpect(&expect, -60);
+	linkCheck("ACK", &expect);
+
+	// Corrupted packets can't be put down to a peer
+	linkInject(5, 0, seq, -60, 0);
+	if(Si446x_linkCRCErrors() != 1)
+		fail("Link CRC errors %u, expected 1\n", Si446x_linkCRCErrors());
+	linkCheck("CRC error", &expect);
+
+	// Fill a bin up, everything gets halved
+	uint8_t filling;
+	do
+	{
+		filling = expect.histogram[3];
+		int16_t rssi = SI446X_LINK_HIST_MIN + (3 * SI446X_LINK_HIST_WIDTH);
+		linkInject(5, 0, seq, rssi, 1);
+		expect.seq = seq++;
+		linkExpect(&expect, rssi);
+	}
+	while(expect.histogram[3] > filling);
+	if(expect.histogram[3] != 0xFF / 2)
+		fail("Link histogram test didn't halve\n");
+	linkCheck("halved", &expect);
+
+	// More peers than there's room for, the oldest (5) is forgotten
+	for(uint8_t i=0;i<SI446X_LINK_PEERS;i++)
+		linkInject(20 + i, 0, 0, -60, 1);
+	uint8_t peers = Si446x_linkStats(links, SI446X_LINK_PEERS + 1);
+	if(peers != SI446X_LINK_PEERS)
+		fail("Link peers %u, expected %u\n", peers, SI446X_LINK_PEERS);
+	for(uint8_t i=0;i<peers;i++)
+	{
+		if(links[i].address == 5)
+			fail("Link oldest peer not forgotten\n");
+	}
+	if(Si446x_linkStats(links, 1) != 1)
+		fail("Link stats went past max\n");
+
+	Si446x_linkReset();
+	if(Si446x_linkStats(links, SI446X_LINK_PEERS) || Si446x_linkCRCErrors())
+		fail("Link stats not reset\n");
+	Si446x_macStop();
+#endif
+
+	// The receive ISR counts get spread over the SERVICE calls, so count per packet instead
+	isrRx.runs = iterations;
+
+	printf("%-22s %10s %10s %10s %10s %12s\n", "Call", "SPI bytes", "CS cycles", "CTS polls", "Commands", "Time (us)");
+	print(&init);
+	print(&reinit);
+	print(&getInfo);
+	print(&getState);
+	print(&setTxPower);
+	print(&setupCallback);
+	print(&adcTemp);
+	print(&wut);
+	print(&disableWut);
+	print(&rx);
+	print(&getRSSI);
+	print(&rxChange);
+#if SI446X_HOP
+	print(&hop);
+	print(&rxHopSetup);
+	print(&rxHopScan);
+#endif
+	print(&tx);
+	print(&load);
+	print(&fire);
+	print(&retransmit);
+	print(&isrSent);
+	print(&cbSent);
+	print(&isrRx);
+	print(&ping);
+#if SI446X_ASYNC
+	print(&async);
+#endif
+#if SI446X_CCA
+	print(&txBusy);
+#endif
+#if SI446X_MAC
+	print(&macSend);
+	print(&macAck);
+#if SI446X_MAC_RETRIES
+	print(&macRetry);
+#endif
+	print(&macGiveUp);
+	print(&macDup);
+#if SI446X_PROP_BATCH
+	print(&macBatch);
+#endif
+#endif
+#if SI446X_RX_QUEUE
+	print(&rxBurst);
+	print(&rxOverflow);
+#endif
+#if SI446X_TX_QUEUE
+	print(&txBurst);
+	print(&txQueued);
+#endif
+#if SI446X_STREAM
+	print(&txSplit);
+	print(&txStream);
+	print(&rxStream);
+#endif
+#if SI446X_SCAN
+	print(&scanPoll);
+	print(&scan);
+	// Hopping and reading the RSSI FRR has to beat retuning and GET_MODEM_STATUS on every channel by a good margin
+	if(scan.time * SCAN_SPEEDUP > scanPoll.time)
+		fail("Si446x_scan is only %.1fx faster than RX + getRSSI, expected %ux\n", (double)scanPoll.time / scan.time, SCAN_SPEEDUP);
+#endif
+
+#if SI446X_STATS
+	printf("Library counters: %u ISR runs, %u timeouts, longest CTS wait %u polls (command 0x%02x)\n", libStats.isrCount, libStats.timeouts, libStats.ctsMaxWait, libStats.ctsMaxOpcode);
+#endif
+
+	if(failures)
+	{
+		fprintf(stderr, "%u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
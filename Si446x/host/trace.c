@@ -0,0 +1,352 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino (Host trace tool)
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+/*
+ * Event trace decoder
+ *
+ * trace dump <file>
+ *   Read trace records (see Si446x_traceGet(), 8 bytes each, little endian) and print them as a timeline.
+ *   Use - for stdin. Callbacks and the ISR are indented, command durations are shown when they finish.
+ *
+ * trace record <file> [ms]
+ *   Receive for a while (default 100ms) then save the trace (needs SI446X_TRACE), packets are echoed back like the ping_server example.
+ *   With the mock transport the emulator is used and sends a good packet followed by a corrupted one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "Si446x.h"
+#include "Si446x_hal.h"
+#include "Si446x_defs.h"
+#if SI446X_HAL == SI446X_HAL_MOCK
+#include "Si446x_emu.h"
+#endif
+
+#define RECORD_LEN	8
+#define CHANNEL		0
+
+static const char* cmdName(uint8_t opcode)
+{
+	switch(opcode)
+	{
+		case SI446X_CMD_NOP:					return "NOP";
+		case SI446X_CMD_PART_INFO:				return "PART_INFO";
+		case SI446X_CMD_POWER_UP:				return "POWER_UP";
+		case SI446X_CMD_FUNC_INFO:				return "FUNC_INFO";
+		case SI446X_CMD_SET_PROPERTY:			return "SET_PROPERTY";
+		case SI446X_CMD_GET_PROPERTY:			return "GET_PROPERTY";
+		case SI446X_CMD_GPIO_PIN_CFG:			return "GPIO_PIN_CFG";
+		case SI446X_CMD_GET_ADC_READING:		return "GET_ADC_READING";
+		case SI446X_CMD_FIFO_INFO:				return "FIFO_INFO";
+		case SI446X_CMD_PACKET_INFO:			return "PACKET_INFO";
+		case SI446X_CMD_IRCAL:					return "IRCAL";
+		case SI446X_CMD_IRCAL_MANUAL:			return "IRCAL_MANUAL";
+		case SI446X_CMD_GET_INT_STATUS:			return "GET_INT_STATUS";
+		case SI446X_CMD_GET_PH_STATUS:			return "GET_PH_STATUS";
+		case SI446X_CMD_GET_MODEM_STATUS:		return "GET_MODEM_STATUS";
+		case SI446X_CMD_GET_CHIP_STATUS:		return "GET_CHIP_STATUS";
+		case SI446X_CMD_START_TX:				return "START_TX";
+		case SI446X_CMD_START_RX:				return "START_RX";
+		case SI446X_CMD_REQUEST_DEVICE_STATE:	return "REQUEST_DEVICE_STATE";
+		case SI446X_CMD_CHANGE_STATE:			return "CHANGE_STATE";
+		case SI446X_CMD_RX_HOP:					return "RX_HOP";
+		case SI446X_CMD_TX_HOP:					return "TX_HOP";
+		default:								return NULL;
+	}
+}
+
+static const char* const stateNames[] = {
+	"NOCHANGE", "SLEEP", "SPI_ACTIVE", "READY", "READY2", "TX_TUNE", "RX_TUNE", "TX", "RX"
+};
+
+static const char* const cbNames[] = {
+	"CMDTIMEOUT", "RXBEGIN", "RXCOMPLETE", "RXINVALID", "SENT", "LOWBATT", "WUT", "RXCHANNEL", "RXPACKET", "RXSTREAM", "MACRX", "MACSENT"
+};
+
+// Interrupt pending bits, MSB first
+static const char* const phNames[] = {
+	"FILTER_MATCH", "FILTER_MISS", "PACKET_SENT", "PACKET_RX", "CRC_ERROR", "ALT_CRC_ERROR", "TX_FIFO_ALMOST_EMPTY", "RX_FIFO_ALMOST_FULL"
+};
+static const char* const modemNames[] = {
+	"RSSI_LATCH", "POSTAMBLE_DETECT", "INVALID_SYNC", "RSSI_JUMP", "RSSI", "INVALID_PREAMBLE", "PREAMBLE_DETECT", "SYNC_DETECT"
+};
+static const char* const chipNames[] = {
+	"-", "CAL", "FIFO_UNDERFLOW_OVERFLOW", "STATE_CHANGE", "CMD_ERROR", "CHIP_READY", "LOW_BATT", "WUT"
+};
+
+static void printBits(const char* group, uint8_t bits, const char* const* names)
+{
+	if(!bits)
+		return;
+	printf(" %s=", group);
+	const char* sep = "";
+	for(uint8_t i=0;i<8;i++)
+	{
+		if(bits & (0x80>>i))
+		{
+			printf("%s%s", sep, names[i]);
+			sep = "|";
+		}
+	}
+}
+
+static int dump(const char* path)
+{
+	FILE* f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if(!f)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t r[RECORD_LEN];
+	uint32_t count = 0;
+	uint32_t start = 0;
+	uint32_t prev = 0;
+	uint32_t apiStart = 0;
+	uint32_t timeouts = 0;
+	uint32_t longest = 0;
+	uint8_t longestOpcode = 0;
+	uint8_t depth = 0;
+
+	printf("%12s %8s  event\n", "time_us", "delta");
+
+	while(fread(r, RECORD_LEN, 1, f) == 1)
+	{
+		uint32_t time = r[0] | (r[1]<<8) | ((uint32_t)r[2]<<16) | ((uint32_t)r[3]<<24);
+		uint8_t event = r[4];
+		uint8_t arg = r[5];
+		uint16_t data = r[6] | (r[7]<<8);
+
+		if(!count)
+			start = prev = time;
+
+		if(event == SI446X_TRACE_ISR_END || event == SI446X_TRACE_CB_END)
+		{
+			if(depth)
+				depth--;
+		}
+
+		printf("%12u %8u  %*s", time - start, time - prev, depth * 2, "");
+		prev = time;
+		count++;
+
+		const char* cmd = cmdName(arg);
+		switch(event)
+		{
+			case SI446X_TRACE_API:
+				apiStart = time;
+				if(cmd)
+					printf("%s", cmd);
+				else
+					printf("cmd 0x%02x", arg);
+				printf(" (%u bytes)\n", data);
+				break;
+			case SI446X_TRACE_API_END:
+				if(cmd)
+					printf("%s", cmd);
+				else
+					printf("cmd 0x%02x", arg);
+				printf(" %s, %uus\n", data ? "done" : "TIMEOUT", time - apiStart);
+				if(!data)
+					timeouts++;
+				if(time - apiStart > longest)
+				{
+					longest = time - apiStart;
+					longestOpcode = arg;
+				}
+				break;
+			case SI446X_TRACE_STATE:
+				if(arg < sizeof(stateNames) / sizeof(stateNames[0]))
+					printf("state -> %s\n", stateNames[arg]);
+				else
+					printf("state -> 0x%02x\n", arg);
+				break;
+			case SI446X_TRACE_TX_FIFO:
+				printf("TX FIFO <- %u bytes\n", data);
+				break;
+			case SI446X_TRACE_RX_FIFO:
+				printf("RX FIFO -> %u bytes\n", data);
+				break;
+			case SI446X_TRACE_ISR:
+				printf("ISR");
+				if(!arg && !data)
+					printf(" (nothing pending)");
+				printBits("ph", arg, phNames);
+				printBits("modem", data>>8, modemNames);
+				printBits("chip", data, chipNames);
+				printf("\n");
+				depth++;
+				break;
+			case SI446X_TRACE_ISR_END:
+				printf("ISR end\n");
+				break;
+			case SI446X_TRACE_CB:
+			case SI446X_TRACE_CB_END:
+				if(arg < sizeof(cbNames) / sizeof(cbNames[0]))
+					printf("SI446X_CB_%s()", cbNames[arg]);
+				else
+					printf("callback 0x%02x", arg);
+				printf("%s\n", (event == SI446X_TRACE_CB_END) ? " returned" : "");
+				if(event == SI446X_TRACE_CB)
+					depth++;
+				break;
+			default:
+				printf("event 0x%02x arg 0x%02x data 0x%04x\n", event, arg, data);
+				break;
+		}
+	}
+
+	fprintf(stderr, "%u records over %uus, %u command timeouts", count, prev - start, timeouts);
+	if(longest)
+		fprintf(stderr, ", longest command %uus (0x%02x)", longest, longestOpcode);
+	fprintf(stderr, "\n");
+
+	if(f != stdin)
+		fclose(f);
+	return EXIT_SUCCESS;
+}
+
+#if SI446X_RX_POOL || SI446X_RX_QUEUE || SI446X_MAC || SI446X_SCAN
+// Milliseconds, like millis() on Arduino
+uint32_t SI446X_CB_TIMESTAMP(void)
+{
+#if SI446X_HAL == SI446X_HAL_MOCK
+	return (uint32_t)(si446x_emu_time() / 1000);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+#endif
+
+#if SI446X_TRACE
+static volatile uint8_t gotPacket;
+static volatile uint8_t gotInvalid;
+static uint8_t packetLen;
+
+// Microseconds, like micros() on Arduino
+uint32_t SI446X_CB_TRACETIME(void)
+{
+#if SI446X_HAL == SI446X_HAL_MOCK
+	return (uint32_t)si446x_emu_time();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+}
+
+void SI446X_CB_RXCOMPLETE(uint8_t length, int16_t rssi)
+{
+	(void)(rssi);
+	packetLen = (length > SI446X_MAX_PACKET_LEN) ? SI446X_MAX_PACKET_LEN : length;
+	gotPacket = 1;
+}
+
+void SI446X_CB_RXINVALID(int16_t rssi)
+{
+	(void)(rssi);
+	gotInvalid = 1;
+}
+
+static uint32_t elapsedMs(uint32_t start)
+{
+	return (SI446X_CB_TRACETIME() - start) / 1000;
+}
+
+static int record(const char* path, uint32_t ms)
+{
+	FILE* f = fopen(path, "wb");
+	if(!f)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+#if SI446X_HAL == SI446X_HAL_MOCK
+	si446x_emu_init(NULL);
+#endif
+	if(!Si446x_init())
+	{
+		fprintf(stderr, "Radio didn't respond\n");
+		fclose(f);
+		return EXIT_FAILURE;
+	}
+	Si446x_setupCallback(SI446X_CBS_RXBEGIN | SI446X_CBS_SENT, 1);
+
+	// Startup fills the ring with config commands, only keep what happens from here
+	Si446x_traceClear();
+	Si446x_RX(CHANNEL);
+
+#if SI446X_HAL == SI446X_HAL_MOCK
+	uint8_t good[] = {5, 'h', 'e', 'l', 'l', 'o'};
+	uint8_t bad[] = {5, 'w', 'o', 'r', 'l', 'd'};
+	si446x_emu_inject(good, sizeof(good), CHANNEL, -60, 1, 1000);
+	si446x_emu_inject(bad, sizeof(bad), CHANNEL, -70, 0, 5000);
+#endif
+
+	uint32_t start = SI446X_CB_TRACETIME();
+	while(elapsedMs(start) < ms)
+	{
+		Si446x_SERVICE();
+
+		if(gotPacket)
+		{
+			// Echo it back
+			uint8_t buff[SI446X_MAX_PACKET_LEN];
+			gotPacket = 0;
+			Si446x_read(buff, packetLen);
+			Si446x_TX(buff, packetLen, CHANNEL, SI446X_STATE_RX);
+		}
+
+		if(gotInvalid)
+		{
+			gotInvalid = 0;
+			Si446x_RX(CHANNEL);
+		}
+
+#if SI446X_HAL == SI446X_HAL_MOCK
+		si446x_emu_run(10);
+#endif
+	}
+
+	si446x_trace_t trace[SI446X_TRACE];
+	uint8_t count = Si446x_traceGet(trace, SI446X_TRACE);
+	if(fwrite(trace, sizeof(si446x_trace_t), count, f) != count)
+		perror(path);
+	fclose(f);
+
+	fprintf(stderr, "%u records\n", count);
+	return EXIT_SUCCESS;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	if(argc == 3 && !strcmp(argv[1], "dump"))
+		return dump(argv[2]);
+
+	if((argc == 3 || argc == 4) && !strcmp(argv[1], "record"))
+	{
+#if SI446X_TRACE
+		return record(argv[2], (argc > 3) ? strtoul(argv[3], NULL, 0) : 100);
+#else
+		fprintf(stderr, "Recording needs SI446X_TRACE set in Si446x_config.h\n");
+		return EXIT_FAILURE;
+#endif
+	}
+
+	fprintf(stderr, "Usage: %s dump <file>\n", argv[0]);
+	fprintf(stderr, "       %s record <file> [ms]\n", argv[0]);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,264 @@
+/*
+ * Project: Si4463 Radio Library for AVR and Arduino (Host waterfall tool)
+ * Author: Zak Kemble, contact@zakkemble.co.uk
+ * Copyright: (C) 2017 by Zak Kemble
+ * License: GNU GPL v3 (see License.txt)
+ * Web: http://blog.zakkemble.co.uk/si4463-radio-library-avr-arduino/
+ */
+
+/*
+ * Waterfall capture and reader
+ *
+ * waterfall dump <file>
+ *   Read a waterfall stream (see Si446x_waterfallStart()) and print it as CSV, one row per sweep.
+ *   The stream is read a bit at a time, so captures of any size and live streams (- for stdin, or a serial port) work.
+ *
+ * waterfall capture <file> <first channel> <count> <samples> [rows]
+ *   Capture to a memory mapped file (needs SI446X_WATERFALL), 0 or no rows to keep going until Ctrl+C.
+ *   With the mock transport the emulator is used, with a signal drifting across the channels.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Si446x.h"
+#include "Si446x_hal.h"
+#if SI446X_HAL == SI446X_HAL_MOCK
+#include "Si446x_emu.h"
+#endif
+
+#define MAP_CHUNK (1024 * 1024) // Capture file grows this much at a time
+
+static const uint8_t outDivs[] = {4, 6, 8, 12, 16, 24, 24, 24};
+
+// Print the header as comments and the CSV column names, returns 0 if it's not a waterfall stream
+static uint8_t printHeader(const uint8_t* h)
+{
+	if(memcmp(h, "SIWF", 4) || h[4] != SI446X_WATERFALL_VERSION || h[5] < SI446X_WATERFALL_HEADER_LEN)
+		return 0;
+
+	const uint8_t* freq = h + 12;
+	const uint8_t* modem = h + 21;
+
+	// XO frequency is the NCO modulus in MODEM_TX_NCO_MODE
+	uint32_t xo = ((uint32_t)(modem[6] & 0x03)<<24) | ((uint32_t)modem[7]<<16) | ((uint16_t)modem[8]<<8) | modem[9];
+	uint32_t dataRate = ((uint32_t)modem[3]<<16) | ((uint16_t)modem[4]<<8) | modem[5];
+	static const uint8_t txOsr[] = {10, 40, 20, 10};
+	double pfd = 2.0 * xo / outDivs[h[20] & 0x07];
+
+	// FRAC includes the extra 1 (always between 2^19 and 2^20), same as Si446x_hopSynth()
+	uint32_t frac = ((uint32_t)freq[1]<<16) | ((uint16_t)freq[2]<<8) | freq[3];
+	double base = (freq[0] + frac / 524288.0) * pfd;
+	double step = ((freq[4]<<8) | freq[5]) / 524288.0 * pfd;
+
+	printf("# channels %u - %u, %u samples, settle %uus, keyframe every %u rows\n", h[6], h[6] + h[7] - 1, h[8], h[10] | (h[11]<<8), h[9]);
+	printf("# xo %uHz, mod type 0x%02x, data rate %ubps\n", xo, modem[0], dataRate / txOsr[(modem[6]>>2) & 0x03]);
+	printf("time_ms");
+	for(uint8_t i=0;i<h[7];i++)
+		printf(",%.0f", base + step * (h[6] + i));
+	printf("\n");
+	return 1;
+}
+
+static int dump(const char* path)
+{
+	FILE* f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if(!f)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t header[256];
+	if(fread(header, SI446X_WATERFALL_HEADER_LEN, 1, f) != 1 || !printHeader(header))
+	{
+		fprintf(stderr, "%s: not a waterfall stream\n", path);
+		return EXIT_FAILURE;
+	}
+
+	uint8_t count = header[7];
+	int8_t row[256];
+	uint8_t bins[256];
+
+	// Skip any header fields added by later versions
+	if(header[5] > SI446X_WATERFALL_HEADER_LEN && fread(bins, header[5] - SI446X_WATERFALL_HEADER_LEN, 1, f) != 1)
+		return EXIT_FAILURE;
+	uint8_t synced = 0; // Deltas can't be used until a keyframe has been seen
+	uint32_t time = 0;
+	uint32_t rows = 0;
+	uint32_t skipped = 0;
+	int c;
+
+	while((c = fgetc(f)) != EOF)
+	{
+		uint8_t t[4];
+		if(c == SI446X_WATERFALL_KEY)
+		{
+			if(fread(t, 4, 1, f) != 1 || fread(bins, count, 1, f) != 1)
+				break;
+			time = t[0] | (t[1]<<8) | ((uint32_t)t[2]<<16) | ((uint32_t)t[3]<<24);
+			memcpy(row, bins, count);
+			synced = 1;
+		}
+		else if(c == SI446X_WATERFALL_DELTA && synced)
+		{
+			if(fread(t, 2, 1, f) != 1 || fread(bins, count, 1, f) != 1)
+				break;
+			time += t[0] | (t[1]<<8);
+			for(uint8_t i=0;i<count;i++)
+				row[i] += (int8_t)bins[i];
+		}
+		else
+		{
+			// Lost bytes (serial glitch?), wait for the next keyframe
+			synced = 0;
+			skipped++;
+			continue;
+		}
+
+		printf("%u", time);
+		for(uint8_t i=0;i<count;i++)
+			printf(",%d", row[i]);
+		printf("\n");
+		rows++;
+	}
+
+	fprintf(stderr, "%u rows", rows);
+	if(skipped)
+		fprintf(stderr, ", %u bytes skipped", skipped);
+	fprintf(stderr, "\n");
+
+	if(f != stdin)
+		fclose(f);
+	return EXIT_SUCCESS;
+}
+
+#if SI446X_WATERFALL
+static int outFd = -1;
+static uint8_t* outMap;
+static size_t outSize; // Bytes written
+static size_t outMapped; // Size of the file and mapping
+static volatile sig_atomic_t stop;
+
+// Milliseconds, like millis() on Arduino
+uint32_t SI446X_CB_TIMESTAMP(void)
+{
+#if SI446X_HAL == SI446X_HAL_MOCK
+	return (uint32_t)(si446x_emu_time() / 1000);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+#endif
+}
+
+void SI446X_CB_WATERFALL(const uint8_t* data, uint8_t len)
+{
+	if(outSize + len > outMapped)
+	{
+		if(outMap)
+			munmap(outMap, outMapped);
+		outMapped += MAP_CHUNK;
+		outMap = NULL;
+		if(ftruncate(outFd, outMapped) == 0)
+			outMap = mmap(NULL, outMapped, PROT_READ | PROT_WRITE, MAP_SHARED, outFd, 0);
+		if(outMap == NULL || outMap == MAP_FAILED)
+		{
+			perror("mmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	memcpy(outMap + outSize, data, len);
+	outSize += len;
+}
+
+static void onSignal(int sig)
+{
+	(void)(sig);
+	stop = 1;
+}
+
+static int capture(const char* path, uint8_t first, uint8_t count, uint8_t samples, uint32_t rows)
+{
+	outFd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(outFd < 0)
+	{
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, onSignal);
+
+#if SI446X_HAL == SI446X_HAL_MOCK
+	si446x_emu_init(NULL);
+#endif
+	if(!Si446x_init())
+	{
+		fprintf(stderr, "Radio didn't respond\n");
+		close(outFd);
+		return EXIT_FAILURE;
+	}
+
+	static int8_t row[256];
+	Si446x_waterfallStart(first, count, samples, row);
+
+	for(uint32_t i=0;!stop && (!rows || i<rows);i++)
+	{
+#if SI446X_HAL == SI446X_HAL_MOCK
+		// Something wandering up and down the band
+		uint8_t ch = first + (i % count);
+		si446x_emu_setRSSI(ch, -50);
+		Si446x_waterfallRow();
+		si446x_emu_setRSSI(ch, -115);
+		si446x_emu_run(10000);
+#else
+		Si446x_waterfallRow();
+#endif
+	}
+
+	// Trim the file down to what was written
+	if(outMap)
+		munmap(outMap, outMapped);
+	if(ftruncate(outFd, outSize) != 0)
+		perror("ftruncate");
+	close(outFd);
+
+	fprintf(stderr, "%zu bytes, %u sweeps per second\n", outSize, Si446x_scanRate());
+	return EXIT_SUCCESS;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	if(argc == 3 && !strcmp(argv[1], "dump"))
+		return dump(argv[2]);
+
+	if(argc >= 6 && !strcmp(argv[1], "capture"))
+	{
+#if SI446X_WATERFALL
+		int first = atoi(argv[3]);
+		int count = atoi(argv[4]);
+		int samples = atoi(argv[5]);
+		if(first < 0 || count < 1 || count > 255 || first + count > 256 || samples < 1 || samples > 255)
+		{
+			fprintf(stderr, "Bad channel range or samples\n");
+			return EXIT_FAILURE;
+		}
+		return capture(argv[2], first, count, samples, (argc > 6) ? strtoul(argv[6], NULL, 0) : 0);
+#else
+		fprintf(stderr, "Capturing needs SI446X_WATERFALL set to 1 in Si446x_config.h\n");
+		return EXIT_FAILURE;
+#endif
+	}
+
+	fprintf(stderr, "Usage: %s dump <file>\n", argv[0]);
+	fprintf(stderr, "       %s capture <file> <first channel> <count> <samples> [rows]\n", argv[0]);
+	return EXIT_FAILURE;
+}
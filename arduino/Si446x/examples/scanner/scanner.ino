@@ -9,27 +9,20 @@
 /*
  * Channel scanner
  *
- * Listen to each channel, record the highest RSSI value and print a pretty graph
+ * Sweep through all of the channels, record the highest and average RSSI values and print a pretty graph
+ * Needs SI446X_SCAN set to 1 in Si446x_config.h
  */
 
 #include <Si446x.h>
 
-static volatile uint8_t channel;
+#if !SI446X_SCAN
+#error "SI446X_SCAN must be set to 1 in Si446x_config.h"
+#endif
 
-void SI446X_CB_RXCOMPLETE(uint8_t length, int16_t rssi)
-{
-	(void)(length); // Stop warnings about unused parameters
-	(void)(rssi);
-
-	Si446x_RX(channel);
-}
-
-void SI446X_CB_RXINVALID(int16_t rssi)
-{
-	(void)(rssi);
+// Channels to sweep at a time, 2 bytes of RAM each
+#define BLOCK_SIZE 32
 
-	Si446x_RX(channel);
-}
+static si446x_scan_t results[BLOCK_SIZE];
 
 void setup()
 {
@@ -41,29 +34,32 @@ void setup()
 
 void loop()
 {
-	Si446x_RX(channel);
-	
-	int16_t peakRssi = -999;
-	for(uint16_t i=0;i<1800;i++)
+	// Sweep a block of channels, 200 RSSI readings each
+	for(uint16_t first=0;first<256;first+=BLOCK_SIZE)
 	{
-		delay(1);
-		int16_t rssi = Si446x_getRSSI();
-		if(rssi > peakRssi)
-			peakRssi = rssi;
-	}
+		if(!Si446x_scan(first, BLOCK_SIZE, 200, results))
+			continue; // Radio is busy transmitting
 
-	uint16_t bars = (130 - (peakRssi * -1)) / 4;
+		for(uint8_t i=0;i<BLOCK_SIZE;i++)
+		{
+			int16_t peakRssi = results[i].peak;
+			uint16_t bars = (130 - (peakRssi * -1)) / 4;
 
-	char buff[6];
-	sprintf_P(buff, PSTR("%03hhu: "), channel);
-	Serial.print(buff);
+			char buff[6];
+			sprintf_P(buff, PSTR("%03hhu: "), (uint8_t)(first + i));
+			Serial.print(buff);
 
-	for(uint16_t i=0;i<bars;i++)
-		Serial.print(F("|"));
+			for(uint16_t j=0;j<bars;j++)
+				Serial.print(F("|"));
 
-	Serial.print(F(" ("));
-	Serial.print(peakRssi);
-	Serial.println(F(")"));
+			Serial.print(F(" ("));
+			Serial.print(peakRssi);
+			Serial.print(F(", avg "));
+			Serial.print(results[i].mean);
+			Serial.println(F(")"));
+		}
+	}
 
-	channel++;
+	Serial.print(F("Blocks per second: "));
+	Serial.println(Si446x_scanRate());
 }
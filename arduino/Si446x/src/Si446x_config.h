@@ -44,6 +44,225 @@
 // Using fixed length packets will stop the length field from being transmitted, reducing the transmission by 3 bytes.
 #define SI446X_FIXED_LENGTH 0
 
+// Fast TX
+// 0 = Si446x_TX() always does the full idle, clear FIFO, clear interrupts, set length, transmit, restore length sequence
+// 1 = Si446x_TX() skips the steps that aren't needed:
+//	The radio is only put into idle mode if it's currently receiving (START_TX works from any other state)
+//	The FIFO is only cleared if something might have been received since it was last cleared (always with WUT low duty cycle RX on, the radio can go into RX by itself)
+//	Pending interrupts are only cleared if the NIRQ pin is asserted
+//	The packet length property is only written if it's different from the last packet, and only put back to the max length if it's been changed
+// Transmitting a max length packet from an idle state then only needs a FIFO write and a START_TX command
+#define SI446X_FAST_TX 0
+
+// GPIO CTS
+// Wait for the radio to be ready for the next command (CTS) by watching one of its GPIO pins instead of polling READ_CMD_BUFF over SPI
+// The SPI bus is then only used when there's actually a response to read, leaving it free for other devices
+// -1 = Off, poll over SPI
+// 0 - 3 = Radio GPIO to use for CTS, this must be connected to a microcontroller pin (SI446X_CTS for Arduino, SI446X_CTS_PORT/BIT for AVR, SI446X_LINUX_CTS for Linux)
+// GPIO1 is a good choice since it's the CTS pin by default after power on. Make sure the pin isn't used by the RF switch (RF_GPIO_PIN_CFG in radio_config.h)
+// NOTE: Don't change the CTS pin with Si446x_writeGPIO()
+#define SI446X_GPIO_CTS -1
+
+// Asynchronous commands
+// Adds Si446x_submit() and Si446x_poll() for sending commands without waiting for the radio to finish them
+// Queued commands are moved along by Si446x_poll(), call it from the main loop or when the CTS pin goes high (SI446X_GPIO_CTS)
+// The normal blocking functions finish off anything that's still queued before sending their own commands
+// 0 = Off
+// 1 = On
+#define SI446X_ASYNC 0
+
+// Fast interrupt handling
+// 0 = The ISR reads and clears interrupts with GET_INT_STATUS, then reads the latched RSSI and state separately
+// 1 = The fast response registers are setup to hold the latched RSSI, state, packet handler and modem pending interrupts (FRR A - D)
+//	The ISR gets all of them with a single FRR read, then only clears the interrupts it saw without waiting for the response
+//	This gets to the callbacks sooner. Chip interrupts (WUT and low battery) aren't in the FRRs, so if they're enabled the GET_INT_STATUS response is still read
+#define SI446X_FRR_ISR 0
+
+// Property cache
+// Keep a copy of the properties that the library changes (GLOBAL, INT_CTL, FRR_CTL, packet length and PA power level)
+// The copy starts off with the values from the startup config, and anything the config doesn't set is read from the radio the first time it's needed
+// Reads of these properties then don't use the SPI bus and writes are only sent if the value has changed
+// Uses around 25 bytes of RAM
+// 0 = Off
+// 1 = On
+#define SI446X_PROP_CACHE 0
+
+// Property batching
+// Number of property writes that can be held back between Si446x_beginProperties() and Si446x_commitProperties()
+// On commit they're sorted and merged into as few SET_PROPERTY commands as possible, with SI446X_PROP_CACHE small gaps between properties
+// are filled in with their cached values so they can go in the same command too
+// The library also uses this for its own back to back property writes
+// Each one uses 3 bytes of RAM
+// 0 = Off, property writes are sent straight away
+#define SI446X_PROP_BATCH 0
+
+// Warm start
+// If the microcontroller resets (watchdog, brown out, waking from deep sleep with the radio left powered) the radio might still be setup
+// With this on Si446x_init() first compares the frequency and modem properties with the startup config, if they match then the radio
+// isn't reset and only the GPIO setup and properties that the library changes (GLOBAL, INT_CTL, FRR_CTL, PKT, PA, MATCH and RX_HOP) are applied again,
+// skipping POWER_UP, IRCAL and the rest of the config
+// The SDN pin must be kept low while the microcontroller is resetting or sleeping, otherwise the radio will lose its setup anyway
+// NOTE: If radio_config.h is changed without the radio being power cycled then the radio might not get the new config if the
+// frequency and modem settings haven't changed
+// 0 = Off, always reset and apply the full config
+// 1 = On
+#define SI446X_WARM_START 0
+
+// IRCAL caching
+// The image rejection calibration (IRCAL commands in the startup config) takes a few hundred ms and can sometimes take a few seconds
+// With this on the calibration result is passed to SI446X_CB_IRCAL_SAVE(si446x_ircal_t* cal) so it can be stored somewhere (EEPROM, a file etc.)
+// and on the next cold start SI446X_CB_IRCAL_LOAD(si446x_ircal_t* cal) is called to get it back, it's then applied with IRCAL_MANUAL instead of
+// calibrating again. SI446X_CB_IRCAL_LOAD() should fill in cal and return 1, or return 0 if there's nothing stored.
+// The calibration is done again if the radio temperature has changed by more than this many degrees C since the stored result was made
+// 0 = Off, always calibrate
+// 1 - 127 = Temperature threshold, 10 is a good starting point
+#define SI446X_IRCAL_CACHE 0
+
+// Hot path counters, see Si446x_getStats()
+// Counts SPI bytes, chip selects, CTS polls for each command, the longest CTS wait, command timeouts and ISR runs
+// Everything is compiled out when off, on AVR it adds a few instructions to each SPI transfer and about 150 bytes of RAM
+// 0 = Off
+// 1 = On
+#define SI446X_STATS 0
+
+// Event trace, see Si446x_traceGet()
+// Keeps the last few driver events (commands, state changes, FIFO loads, interrupts and callbacks) in a ring of 8 byte records
+// for finding intermittent problems after they've happened. host/trace.c turns the records into a timeline.
+// Timestamps come from SI446X_CB_TRACETIME(), micros() on Arduino and 0 everywhere else unless it's defined
+// 0 = Off
+// 2 - 128 = Number of records to keep, must be a power of 2
+#define SI446X_TRACE 0
+
+// Channel hopping
+// Adds Si446x_hopSynth() and Si446x_hop() for changing channel with RX_HOP and TX_HOP, which skip the VCO calibration of a full retune,
+// and Si446x_setupRXHop() for the radio's own automatic RX hopping. While RX hopping is on the ISR reads the channel each packet arrived on
+// and passes it to SI446X_CB_RXCHANNEL(), this needs to be on for that to happen if the startup config turns RX hopping on
+// 0 = Off
+// 1 = On
+#define SI446X_HOP 0
+
+// Streaming
+// Adds Si446x_TXStream() and Si446x_RXStream() for packets that are bigger than the FIFO, the FIFO is topped up or emptied
+// by the ISR while the packet is on the air (TX FIFO almost empty and RX FIFO almost full interrupts)
+// Packets can be up to 255 bytes with a 1 byte length field, or up to 8191 bytes if the length field is set to 2 bytes in WDS (PKT_LEN SIZE and PKT_FIELD_1_LENGTH)
+// NOTE: Not available with SI446X_FIXED_LENGTH
+// 0 = Off
+// 1 = On
+#define SI446X_STREAM 0
+
+// FIFO thresholds for streaming (1 - 128)
+// TX: The FIFO is topped up once it has this many bytes free
+// RX: The FIFO is emptied once it has this many bytes in it
+// Higher values mean fewer interrupts, lower values give the ISR more time to get to the FIFO before it runs out or overflows
+#define SI446X_STREAM_TX_THRESH 64
+#define SI446X_STREAM_RX_THRESH 64
+
+// Receive packet pool
+// The ISR reads each received packet into a free buffer from the pool and passes it to SI446X_CB_RXPACKET(), no need to call Si446x_read()
+// The buffer belongs to the application until it's given back with Si446x_release()
+// If all the buffers are in use then the packet is left in the FIFO and SI446X_CB_RXCOMPLETE() is ran as usual
+// Each buffer uses SI446X_MAX_PACKET_LEN + 9 bytes of RAM
+// 0 = Off
+// 1 - 255 = Number of buffers
+#define SI446X_RX_POOL 0
+
+// Receive queue
+// The ISR reads received packets into a ring buffer, the main loop takes them out with Si446x_queuePeek() and Si446x_queuePop()
+// The radio goes straight back to RX after each packet instead of the idle state, so packets sent back to back aren't missed
+// Safe between the ISR and the main loop without turning interrupts off, as long as there's only one of each
+// Packets that arrive while the queue is full are dropped and counted, see Si446x_queueStats()
+// NOTE: Can't be used with SI446X_RX_POOL
+// 0 = Off
+// 2, 4, 8, 16, 32, 64, 128 = Queue length, each entry uses SI446X_MAX_PACKET_LEN + 8 bytes of RAM
+#define SI446X_RX_QUEUE 0
+
+// Transmit queue
+// Packets are queued with Si446x_TXQueue() and sent one after the other, the ISR starts the next one as soon as the last one has been sent
+// If the next packet fits in the FIFO while the current one is still going out then it's loaded early, so only the start command is needed between them
+// The packet data isn't copied, it must be left alone until its SI446X_CB_SENT() callback
+// 0 = Off
+// 2, 4, 8, 16, 32, 64, 128 = Queue length, each entry uses 3 bytes of RAM + pointer size
+#define SI446X_TX_QUEUE 0
+
+// MAC layer
+// Adds addresses, sequence numbers, automatic ACKs and retries on top of normal packets, see Si446x_macInit()
+// ACKs are sent straight from the ISR as soon as a packet arrives, retries are done by Si446x_macPoll()
+// Timing uses SI446X_CB_TIMESTAMP() (millis() on Arduino, other platforms must provide it, there's no default and leaving it out is a link error)
+// NOTE: Can't be used with SI446X_FIXED_LENGTH, SI446X_RX_POOL or SI446X_RX_QUEUE
+// 0 = Off
+// 1 = On
+#define SI446X_MAC 0
+
+// How long to wait for an ACK before sending again, in SI446X_CB_TIMESTAMP() units (ms on Arduino)
+#define SI446X_MAC_ACK_TIMEOUT 10
+
+// Random extra wait of up to this long, doubled for each retry, so that 2 nodes which collided don't collide again
+#define SI446X_MAC_BACKOFF 10
+
+// Number of times to send a packet again if it isn't ACKed
+#define SI446X_MAC_RETRIES 3
+
+// Number of peers to remember the last sequence number of, for throwing away duplicates when an ACK is lost (1 - 255)
+#define SI446X_MAC_PEERS 4
+
+// Per-peer link quality stats, needs SI446X_MAC
+// RSSI average and histogram, packets received, lost (worked out from gaps in the sequence numbers) and duplicates, see Si446x_linkStats()
+// Packets that other nodes are sent are counted too, so the sequence numbers don't look like they have gaps
+// 0 = Off
+// 1 = On
+#define SI446X_LINK_STATS 0
+
+// Number of peers to keep stats for, the oldest peer is forgotten when a new one turns up (1 - 255)
+#define SI446X_LINK_PEERS 4
+
+// RSSI histogram, SI446X_LINK_HIST_BINS bins of SI446X_LINK_HIST_WIDTH dB each starting at SI446X_LINK_HIST_MIN dBm
+// Anything outside of the range goes into the first or last bin
+#define SI446X_LINK_HIST_BINS 8
+#define SI446X_LINK_HIST_MIN -120
+#define SI446X_LINK_HIST_WIDTH 10
+
+// RSSI average weighting, each packet moves the average 1/(2^SI446X_LINK_EWMA) of the way towards its RSSI (0 - 4)
+#define SI446X_LINK_EWMA 3
+
+// Listen before talk
+// Si446x_TX() checks the RSSI of the channel first, if it's busy then it waits a random time and checks again
+// If the channel is still busy after SI446X_CCA_RETRIES tries then Si446x_TX() returns 0, Si446x_channelBusy() returns 1 and the radio is put back to the state it was in before
+// Nothing is checked if the radio is already transmitting, Si446x_TX() just returns 0 straight away
+// 0 = Off
+// 1 = On
+#define SI446X_CCA 0
+
+// RSSI in dBm at or above which the channel is busy
+#define SI446X_CCA_THRESHOLD -90
+
+// Number of times to back off before giving up (0 - 5)
+#define SI446X_CCA_RETRIES 4
+
+// Backoff slot time in us, the wait is a random number of slots from 1 up to 4, 8, 16... as the tries go on
+#define SI446X_CCA_SLOT 250
+
+// Time in us for the RSSI to settle if the radio wasn't already listening on the channel
+#define SI446X_CCA_SETTLE 250
+
+// Spectrum sweeps with Si446x_scan()
+// Uses RX_HOP to move between channels, so only the first channel has to wait for VCO calibration
+// Si446x_scanRate() uses SI446X_CB_TIMESTAMP() (millis() on Arduino, other platforms must provide it, there's no default and leaving it out is a link error)
+// 0 = Off
+// 1 = On
+#define SI446X_SCAN 0
+
+// Time in us after retuning for the RSSI to settle before sampling, should be at least the RSSI averaging time (4 bit periods with the default MODEM_RSSI_CONTROL)
+#define SI446X_SCAN_SETTLE 100
+
+// Waterfall capture with Si446x_waterfallRow(), needs SI446X_SCAN
+// Each row is a sweep written in a compact binary format to the SI446X_CB_WATERFALL() callback, see Si446x.h for the format
+// 0 = Off
+// 1 = On
+#define SI446X_WATERFALL 0
+
+// Rows between keyframes, keyframes hold absolute RSSI values so a reader can pick up part way through a stream (1 - 255)
+#define SI446X_WATERFALL_KEYFRAME 64
+
 
 ///////////////////
 // Pin stuff
@@ -53,6 +272,7 @@
 #define SI446X_CSN			10
 #define SI446X_SDN			5
 #define SI446X_IRQ			2 // This needs to be an interrupt pin
+#define SI446X_CTS			3 // Only used if SI446X_GPIO_CTS is not -1
 
 
 
@@ -74,6 +294,43 @@
 #define SI446X_IRQ_PORT		D
 #define SI446X_IRQ_BIT		2
 
+// CTS pin, only used if SI446X_GPIO_CTS is not -1
+#define SI446X_CTS_PORT		D
+#define SI446X_CTS_BIT		3
+
+
+
+///////////////////
+// Transport
+///////////////////
+
+// Which backend to use for SPI, pin and delay stuff
+// Arduino builds always use the Arduino SPI library and pin functions, this option is ignored
+// SI446X_HAL_AVR - AVR SPI peripheral and port registers, see Si446x_spi.c and the pin setup above
+// SI446X_HAL_LINUX - Linux spidev and gpiochip character devices, see Si446x_hal_linux.c and the Linux setup below
+// SI446X_HAL_MOCK - In-memory bus for running the library on a PC without a radio, see Si446x_hal_mock.c
+// The backend can also be chosen from the command line, e.g. -DSI446X_HAL=SI446X_HAL_LINUX
+#define SI446X_HAL_AVR		0
+#define SI446X_HAL_LINUX	1
+#define SI446X_HAL_MOCK		2
+
+#ifndef SI446X_HAL
+#define SI446X_HAL SI446X_HAL_AVR
+#endif
+
+// Linux spidev device and clock speed (max SPI clock of Si446x is 10MHz)
+#define SI446X_LINUX_SPIDEV		"/dev/spidev0.0"
+#define SI446X_LINUX_SPI_SPEED	5000000
+
+// Linux gpiochip device and line offsets
+// CSN is driven as a normal GPIO since the library needs to keep the radio selected across multiple transfers,
+// the spidev device is put into SPI_NO_CS mode
+#define SI446X_LINUX_GPIOCHIP	"/dev/gpiochip0"
+#define SI446X_LINUX_CSN		8
+#define SI446X_LINUX_SDN		25
+#define SI446X_LINUX_IRQ		24
+#define SI446X_LINUX_CTS		23 // Only used if SI446X_GPIO_CTS is not -1
+
 
 
 ///////////////////
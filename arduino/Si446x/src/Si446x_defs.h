@@ -61,11 +61,17 @@ typedef enum
 #define SI446X_FIFO_CLEAR_RX			0x02
 #define SI446X_FIFO_CLEAR_TX			0x01
 
+#define SI446X_TX_RETRANSMIT			0x04
+
 #define GLOBAL_PROP(prop)	((SI446X_PROP_GROUP_GLOBAL<<8) | prop)
 #define INT_PROP(prop)		((SI446X_PROP_GROUP_INT<<8) | prop)
+#define FRR_PROP(prop)		((SI446X_PROP_GROUP_FRR<<8) | prop)
 #define PKT_PROP(prop)		((SI446X_PROP_GROUP_PKT<<8) | prop)
 #define PA_PROP(prop)		((SI446X_PROP_GROUP_PA<<8) | prop)
 #define MATCH_PROP(prop)	((SI446X_PROP_GROUP_MATCH<<8) | prop)
+#define MODEM_PROP(prop)	((SI446X_PROP_GROUP_MODEM<<8) | prop)
+#define FREQ_PROP(prop)		((SI446X_PROP_GROUP_FREQ_CONTROL<<8) | prop)
+#define RX_HOP_PROP(prop)	((SI446X_PROP_GROUP_RX_HOP<<8) | prop)
 
 #define SI446X_GLOBAL_CONFIG			GLOBAL_PROP(0x03)
 #define SI446X_FIFO_MODE_HALF_DUPLEX	0x10
@@ -107,24 +113,51 @@ typedef enum
 #define SI446X_PACKET_SENT_PEND			5
 #define SI446X_PACKET_RX_PEND			4
 #define SI446X_CRC_ERROR_PEND			3
+#define SI446X_TX_FIFO_ALMOST_EMPTY_PEND	1
+#define SI446X_RX_FIFO_ALMOST_FULL_PEND		0
 #define SI446X_INVALID_SYNC_PEND		5
 #define SI446X_SYNC_DETECT_PEND			0
 #define SI446X_LOW_BATT_PEND			1
 #define SI446X_WUT_PEND					0
 
+#define SI446X_FRR_CTL_A_MODE			FRR_PROP(0x00)
+#define SI446X_FRR_MODE_INT_PH_PEND		0x04
+#define SI446X_FRR_MODE_INT_MODEM_PEND	0x06
+#define SI446X_FRR_MODE_CURRENT_STATE	0x09
+#define SI446X_FRR_MODE_LATCHED_RSSI	0x0A
+
 #define SI446X_MATCH_VALUE_1			MATCH_PROP(0x00)
 #define SI446X_MATCH_EN					0x40
 
 #define	SI446X_PA_PWR_LVL				PA_PROP(0x01)
 
+#define SI446X_MODEM_MOD_TYPE			MODEM_PROP(0x00)
+#define SI446X_MODEM_CLKGEN_BAND		MODEM_PROP(0x51)
+#define SI446X_CLKGEN_SY_SEL			0x08
+#define SI446X_MODEM_RSSI_THRESH		MODEM_PROP(0x4A)
+#define SI446X_MODEM_RSSI_CONTROL		MODEM_PROP(0x4C)
+#define SI446X_RSSI_LATCH				0x07
+
+#define SI446X_FREQ_CONTROL_INTE		FREQ_PROP(0x00)
+
+#define SI446X_RX_HOP_CONTROL			RX_HOP_PROP(0x00)
+#define SI446X_RX_HOP_TABLE_SIZE		RX_HOP_PROP(0x01)
+#define SI446X_RX_HOP_TABLE_ENTRY_0		RX_HOP_PROP(0x02)
+#define SI446X_RX_HOP_TABLE_MAX			64
+
+#define SI446X_PKT_LEN					PKT_PROP(0x08)
+#define SI446X_PKT_LEN_ENDIAN			0x20
+#define SI446X_PKT_LEN_SIZE				0x10
+#define SI446X_PKT_TX_THRESHOLD			PKT_PROP(0x0B)
+#define SI446X_PKT_RX_THRESHOLD			PKT_PROP(0x0C)
 #define SI446X_PKT_FIELD_1_LENGTH		PKT_PROP(0x0D)
 #define SI446X_PKT_FIELD_2_LENGTH		PKT_PROP(0x11)
 #define SI446X_PKT_FIELD_2_LENGTH_LOW	PKT_PROP(0x12)
 
 
-#ifndef ARDUINO
+#include "Si446x_config.h"
 
-	#include "Si446x_config.h"
+#if !defined(ARDUINO) && SI446X_HAL == SI446X_HAL_AVR
 
 	#define CONCAT(a, b) a ## b
 	#define CONCAT2(a, b, c) a ## b ## c
@@ -151,6 +184,13 @@ typedef enum
 		#define IRQ_PORT		PORT(SI446X_IRQ_PORT)
 		#define IRQ_BIT			PORTBIT(SI446X_IRQ_PORT, SI446X_IRQ_BIT)
 		#define IRQ_PUE			PUE(SI446X_IRQ_PORT)
+		#define IRQ_PIN			PINPORT(SI446X_IRQ_PORT)
+	#endif
+
+	#if SI446X_GPIO_CTS != -1
+		#define CTS_DDR			DDR(SI446X_CTS_PORT)
+		#define CTS_PIN			PINPORT(SI446X_CTS_PORT)
+		#define CTS_BIT			PINBIT(SI446X_CTS_PORT, SI446X_CTS_BIT)
 	#endif
 
 	#define INTCONCAT(num) CONCAT(INT, num)